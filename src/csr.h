@@ -37,6 +37,26 @@ typedef enum {
   CSR_NUM = 4096,
 } CsrType;
 
+// sstatus is a view of these mstatus bits
+#define SSTATUS_MASK 0x80000003000de762ULL
+
+// mcause/scause values
+#define CAUSE_INTERRUPT (1ULL << 63)
+#define CAUSE_FETCH_ACCESS 1
+#define CAUSE_ILLEGAL_INSTRUCTION 2
+#define CAUSE_BREAKPOINT 3
+#define CAUSE_LOAD_ACCESS 5
+#define CAUSE_STORE_ACCESS 7
+#define CAUSE_ECALL_FROM_U 8  // plus the mode the ECALL came from
+
+// mip/mie bits
+#define MIP_SSIP (1ULL << 1)
+#define MIP_MSIP (1ULL << 3)
+#define MIP_STIP (1ULL << 5)
+#define MIP_MTIP (1ULL << 7)
+#define MIP_SEIP (1ULL << 9)
+#define MIP_MEIP (1ULL << 11)
+
 typedef struct {
   u64 nx : 1;
   u64 uf : 1;
@@ -1,7 +1,5 @@
 #include "decode.h"
 
-#include <assert.h>
-
 #include "instr.h"
 #include "reg.h"
 #include "utils.h"
@@ -479,7 +477,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
           *instr = decode_ciw_type(&un);
           instr->type = U_RV32I_ADDI;
           instr->rs1 = XREG_SP;
-          assert(instr->imm != 0);
+          if (instr->imm == 0) goto illegal;  // the all-zero instruction
           return;
         case 0x1:  // CL-format: C.FLD
           *instr = decode_cl_type(&un);
@@ -512,7 +510,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
           instr->imm = __get_cs_type_imm_scaled_8(&un);
           return;
         default:
-          __builtin_unreachable();
+          goto illegal;
       }
       __builtin_unreachable();
     }  // quadrant case 0x0
@@ -606,7 +604,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
           instr->rs2 = XREG_ZERO;
           return;
         default:
-          __builtin_unreachable();
+          goto illegal;
       }
       __builtin_unreachable();
     }  // quadrant case 0x1
@@ -681,7 +679,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
           instr->rs1 = XREG_SP;
           return;
         default:
-          __builtin_unreachable();
+          goto illegal;
       }
       __builtin_unreachable();
     }  // quadrant case 0x2
@@ -713,7 +711,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV64I_LWU;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // opcode case 0x0
@@ -728,7 +726,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV32D_FLD;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // opcode case 0x1
@@ -743,7 +741,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_ZIFENCEI_FENCE_I;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // opcode case 0x3
@@ -758,7 +756,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               if ((un.gtype.instr31_25 >> 1) == 0x0) {  // SLLI
                 instr->type = U_RV64I_SLLI;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x2:  // SLTI
@@ -776,7 +774,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if ((un.gtype.instr31_25 >> 1) == 0x10) {  // SRAI
                 instr->type = U_RV64I_SRAI;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x6:  // ORI
@@ -786,7 +784,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV32I_ANDI;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // opcode case 0x4
@@ -804,7 +802,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV64I_ADDIW;
               return;
             case 0x1:  // SLLIW
-              assert(un.gtype.instr31_25 == 0x0);
+              if (un.gtype.instr31_25 != 0x0) goto illegal;
               instr->type = U_RV64I_SLLIW;
               return;
             case 0x5:
@@ -813,11 +811,11 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.gtype.instr31_25 == 0x20) {  // SRAIW
                 instr->type = U_RV64I_SRAIW;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // opcode case 0x6
@@ -838,7 +836,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV64I_SD;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // opcode case 0x8
@@ -853,7 +851,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV32D_FSD;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // case 0x9
@@ -869,7 +867,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x20) {  // SUB
                 instr->type = U_RV32I_SUB;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x1:
@@ -878,7 +876,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x1) {  // MULH
                 instr->type = U_RV32M_MULH;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x2:
@@ -887,7 +885,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x1) {  // MULHSU
                 instr->type = U_RV32M_MULHSU;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x3:
@@ -896,7 +894,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x1) {  // MULHU
                 instr->type = U_RV32M_MULHU;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x4:
@@ -905,7 +903,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x1) {  // DIV
                 instr->type = U_RV32M_DIV;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x5:
@@ -916,7 +914,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x20) {  // SRA
                 instr->type = U_RV32I_SRA;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x6:
@@ -925,7 +923,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x1) {  // REM
                 instr->type = U_RV32M_REM;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x7:
@@ -934,11 +932,11 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x1) {  // REMU
                 instr->type = U_RV32M_REMU;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // case 0xc
@@ -960,21 +958,21 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x20) {  // SUBW
                 instr->type = U_RV64I_SUBW;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x1:
               if (un.rtype.funct7 == 0x0) {  // SLLW
                 instr->type = U_RV64I_SLLW;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x4:
               if (un.rtype.funct7 == 0x1) {  // DIVW
                 instr->type = U_RV64M_DIVW;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x5:
@@ -985,25 +983,25 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct7 == 0x20) {  // SRAW
                 instr->type = U_RV64I_SRAW;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x6:
               if (un.rtype.funct7 == 0x1) {  // REMW
                 instr->type = U_RV64M_REMW;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x7:
               if (un.rtype.funct7 == 0x1) {  // REMUW
                 instr->type = U_RV64M_REMUW;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // case 0xe
@@ -1018,7 +1016,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV32D_FMADD_D;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct2
           __builtin_unreachable();
         }  // case 0x10
@@ -1033,7 +1031,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV32D_FMSUB_D;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct2
           __builtin_unreachable();
         }  // case 0x11
@@ -1048,7 +1046,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV32D_FNMSUB_D;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct2
           __builtin_unreachable();
         }  // case 0x12
@@ -1063,7 +1061,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV32D_FNMADD_D;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct2
           __builtin_unreachable();
         }  // case 0x13
@@ -1103,7 +1101,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct3 == 0x2) {  // FSNGJX.S
                 instr->type = U_RV32F_FSGNJX_S;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x11:
@@ -1114,7 +1112,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct3 == 0x2) {  // FSNGJX.D
                 instr->type = U_RV32D_FSGNJX_D;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x14:
@@ -1123,7 +1121,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct3 == 0x1) {  // FMAX.S
                 instr->type = U_RV32F_FMAX_S;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x15:
@@ -1132,23 +1130,23 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct3 == 0x1) {  // FMAX.D
                 instr->type = U_RV32D_FMAX_D;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x20:  // FCVT.S.D
-              assert(un.rtype.rs2 == 0x1);
+              if (un.rtype.rs2 != 0x1) goto illegal;
               instr->type = U_RV32D_FCVT_S_D;
               return;
             case 0x21:  // FCVT.D.S
-              assert(un.rtype.rs2 == 0x0);
+              if (un.rtype.rs2 != 0x0) goto illegal;
               instr->type = U_RV32D_FCVT_D_S;
               return;
             case 0x2c:  // FSQRT.S
-              assert(un.rtype.rs2 == 0x0);
+              if (un.rtype.rs2 != 0x0) goto illegal;
               instr->type = U_RV32F_FSQRT_S;
               return;
             case 0x2d:  // FSQRT.D
-              assert(un.rtype.rs2 == 0x0);
+              if (un.rtype.rs2 != 0x0) goto illegal;
               instr->type = U_RV32D_FSQRT_D;
               return;
             case 0x50:
@@ -1159,7 +1157,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct3 == 0x2) {  // FEQ.S
                 instr->type = U_RV32F_FEQ_S;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x51:
@@ -1170,7 +1168,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.funct3 == 0x2) {  // FEQ.D
                 instr->type = U_RV32D_FEQ_D;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x60:
@@ -1183,7 +1181,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.rs2 == 0x3) {  // FCVT.LU.S
                 instr->type = U_RV64F_FCVT_LU_S;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x61:
@@ -1196,7 +1194,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.rs2 == 0x3) {  // FCVT.LU.D
                 instr->type = U_RV64D_FCVT_LU_D;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x68:
@@ -1209,7 +1207,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.rs2 == 0x3) {  // FCVT.S.LU
                 instr->type = U_RV64F_FCVT_S_LU;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x69:
@@ -1222,39 +1220,39 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               } else if (un.rtype.rs2 == 0x3) {  // FCVT.D.LU
                 instr->type = U_RV64D_FCVT_D_LU;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x70:
-              assert(un.rtype.rs2 == 0x0);
+              if (un.rtype.rs2 != 0x0) goto illegal;
               if (un.rtype.funct3 == 0x0) {  // FMV.X.W
                 instr->type = U_RV32F_FMV_X_W;
               } else if (un.rtype.funct3 == 0x1) {  // FCLASS.S
                 instr->type = U_RV32F_FCLASS_S;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x71:
-              assert(un.rtype.rs2 == 0x0);
+              if (un.rtype.rs2 != 0x0) goto illegal;
               if (un.rtype.funct3 == 0x0) {  // FMV.X.D
                 instr->type = U_RV64D_FMV_X_D;
               } else if (un.rtype.funct3 == 0x1) {  // FCLASS.D
                 instr->type = U_RV32D_FCLASS_D;
               } else {
-                __builtin_unreachable();
+                goto illegal;
               }
               return;
             case 0x78:  // FMV.W.X
-              assert(un.rtype.rs2 == 0x0 && un.rtype.funct3 == 0x0);
+              if (un.rtype.rs2 != 0x0 || un.rtype.funct3 != 0x0) goto illegal;
               instr->type = U_RV32F_FMV_W_X;
               return;
             case 0x79:  // FMV.D.X
-              assert(un.rtype.rs2 == 0x0 && un.rtype.funct3 == 0x0);
+              if (un.rtype.rs2 != 0x0 || un.rtype.funct3 != 0x0) goto illegal;
               instr->type = U_RV64D_FMV_D_X;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct7
           __builtin_unreachable();
         }  // case 0x14
@@ -1281,7 +1279,7 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               instr->type = U_RV32I_BGEU;
               return;
             default:
-              __builtin_unreachable();
+              goto illegal;
           }  // switch funct3
           __builtin_unreachable();
         }  // case 0x18
@@ -1313,8 +1311,15 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
               case 0x302:  // MRET
                 instr->type = P_MRET;
                 return;
+              case 0x105:  // WFI
+                instr->type = P_WFI;
+                return;
               default:
-                __builtin_unreachable();
+                if ((un.itype.imm11_0 >> 5) == 0x09) {  // SFENCE.VMA
+                  instr->type = P_SFENCE_VMA;
+                  return;
+                }
+                goto illegal;
             }
           } else {  // I-type: Zicsr
             *instr = decode_i_type_with_csr(&un);
@@ -1338,19 +1343,23 @@ void rv_instr_decode(RvInstr *instr, u32 instr_raw) {
                 instr->type = U_ZICSR_CSRRCI;
                 return;
               default:
-                __builtin_unreachable();
+                goto illegal;
             }  // switch funct3
           }
           __builtin_unreachable();
         }  // case 0x1c
 
         default:
-          __builtin_unreachable();
+          goto illegal;
       }  // switch opcode
       __builtin_unreachable();
     }  // quadrant case 0x3
 
     default:
-      __builtin_unreachable();
+      goto illegal;
   }
+
+illegal:
+  // not an encoding we implement, so the guest gets an illegal instruction
+  instr->type = RV_ILLEGAL;
 }
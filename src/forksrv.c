@@ -0,0 +1,221 @@
+#include "forksrv.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "utils.h"
+
+#define RVEMU_FORKSRV_MAX_REQUEST (1 << 20)
+
+// Removes a socket left at path by a server that is gone. Anything else
+// there, including a socket a server still listens on, is left alone and
+// makes this return false with errno set.
+static bool remove_stale_socket(const struct sockaddr_un* addr) {
+  struct stat st;
+  if (lstat(addr->sun_path, &st) < 0) return errno == ENOENT;
+  if (!S_ISSOCK(st.st_mode)) {
+    errno = EEXIST;
+    return false;
+  }
+
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe < 0) return false;
+  int ret = connect(probe, (const struct sockaddr*)addr, sizeof(*addr));
+  int err = errno;
+  close(probe);
+  if (ret == 0) {
+    errno = EADDRINUSE;
+    return false;
+  }
+  if (err != ECONNREFUSED) {
+    errno = err;
+    return false;
+  }
+  return unlink(addr->sun_path) == 0 || errno == ENOENT;
+}
+
+// Returns a listening Unix socket at path, or -1 with errno set.
+int forksrv_bind(const char* path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  if (!remove_stale_socket(&addr)) return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+bool forksrv_listen(ForkServer* srv, const char* path) {
+  int fd = forksrv_bind(path);
+  if (fd < 0) return false;
+
+  srv->listen_fd = fd;
+  srv->enabled = true;
+  return true;
+}
+
+// Makes the server refuse requests that name any file but prog, told apart
+// by device and inode so that any path to it will do.
+bool forksrv_set_program(ForkServer* srv, const char* prog) {
+  struct stat st;
+  if (stat(prog, &st) < 0) return false;
+  srv->program = prog;
+  srv->program_dev = st.st_dev;
+  srv->program_ino = st.st_ino;
+  return true;
+}
+
+static bool is_program(const ForkServer* srv, const ForkRequest* req) {
+  if (!srv->program) return true;
+  struct stat st;
+  return req->argc > 1 && stat(req->argv[1], &st) == 0 &&
+         st.st_dev == srv->program_dev && st.st_ino == srv->program_ino;
+}
+
+static bool read_full(int fd, void* buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, (u8*)buf + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+// Takes the argv strings and the three stdio fds off the connection. The
+// request owns argv and strings when this succeeds.
+bool forksrv_receive(int conn, ForkRequest* req, int fds[3]) {
+  u32 len;
+  struct iovec iov = {&len, sizeof(len)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } control;
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(len)) return false;
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+    return false;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+  char* strings = len > 0 && len <= RVEMU_FORKSRV_MAX_REQUEST
+                      ? malloc(len + 1)
+                      : NULL;
+  if (!strings || !read_full(conn, strings, len)) {
+    free(strings);
+    for (int i = 0; i < 3; i++) {
+      close(fds[i]);
+    }
+    return false;
+  }
+  strings[len] = '\0';
+
+  req->argc = 1;
+  for (u32 i = 0; i < len; i++) {
+    req->argc += strings[i] == '\0';
+  }
+  req->argv = calloc(req->argc + 1, sizeof(char*));
+  if (!req->argv) {
+    free(strings);
+    for (int i = 0; i < 3; i++) {
+      close(fds[i]);
+    }
+    return false;
+  }
+  req->strings = strings;
+  req->argv[0] = "rvemu";
+  char* s = strings;
+  for (int i = 1; i < req->argc; i++) {
+    req->argv[i] = s;
+    s += strlen(s) + 1;
+  }
+  return true;
+}
+
+// Runs in a per-request child: forks the guest run, waits for it and
+// reports its status, so the server itself never blocks on a run.
+static ForkRequest serve_connection(const ForkServer* srv, int conn) {
+  ForkRequest req;
+  int fds[3];
+  if (!forksrv_receive(conn, &req, fds)) _exit(1);
+
+  i32 reply = W_EXITCODE(127, 0);
+  if (!is_program(srv, &req)) {
+    dprintf(fds[2], "rvemu: this fork server runs %s, not %s\n",
+            srv->program, req.argc > 1 ? req.argv[1] : "nothing");
+    write(conn, &reply, sizeof(reply));
+    _exit(0);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (int i = 0; i < 3; i++) {
+      dup2(fds[i], i);
+      close(fds[i]);
+    }
+    close(conn);
+    return req;
+  }
+
+  int status = 0;
+  while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  if (pid < 0) status = W_EXITCODE(127, 0);
+  reply = status;
+  write(conn, &reply, sizeof(reply));
+  _exit(0);
+}
+
+// Returns once per request, in a fresh copy of the guest; the server
+// process itself loops here forever.
+ForkRequest forksrv_serve(ForkServer* srv) {
+  // the per-request children are never waited on
+  struct sigaction sa = {.sa_handler = SIG_IGN, .sa_flags = SA_NOCLDWAIT};
+  sigaction(SIGCHLD, &sa, NULL);
+
+  while (true) {
+    int conn = accept(srv->listen_fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      FATALF("fork server accept failed: %s", strerror(errno));
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(srv->listen_fd);
+      srv->enabled = false;
+      sa.sa_handler = SIG_DFL;
+      sa.sa_flags = 0;
+      sigaction(SIGCHLD, &sa, NULL);
+      return serve_connection(srv, conn);
+    }
+    close(conn);
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef RVEMU_FORKSRV_H_
+#define RVEMU_FORKSRV_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Keeps a loaded guest resident and forks a copy of it per run request, so
+// the ELF is parsed and the guest's start-up work done only once.
+//
+// A request is one message on the Unix socket: a u32 byte count followed by
+// that many bytes of NUL-terminated guest argv strings, with the run's
+// stdin, stdout and stderr attached as SCM_RIGHTS. When the run ends the
+// server answers with its wait status as an i32. The first string is the
+// guest's argv[0] and names its program; the server refuses requests for
+// any file but the one it loaded.
+typedef struct {
+  bool enabled;
+  bool at_marker;  // fork at the guest's SYS_RVEMU_FORKSRV, not at entry
+  int listen_fd;
+  const char* program;  // what requests must name, NULL to take any
+  dev_t program_dev;
+  ino_t program_ino;
+} ForkServer;
+
+typedef struct {
+  int argc;  // laid out like main's argv, argv[0] being the emulator
+  char** argv;
+  char* strings;  // what argv[1..] point into
+} ForkRequest;
+
+int forksrv_bind(const char*);
+
+bool forksrv_receive(int, ForkRequest*, int[3]);
+
+bool forksrv_listen(ForkServer*, const char*);
+
+bool forksrv_set_program(ForkServer*, const char*);
+
+ForkRequest forksrv_serve(ForkServer*);
+
+#endif  // RVEMU_FORKSRV_H_
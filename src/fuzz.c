@@ -0,0 +1,91 @@
+#include "fuzz.h"
+
+#include <fcntl.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+bool fuzz_init(Fuzz* fuzz, const char* corpus) {
+  // under afl-fuzz the bitmap is the fuzzer's shared memory
+  const char* shm_id = getenv("__AFL_SHM_ID");
+  if (shm_id) {
+    fuzz->bitmap = shmat(atoi(shm_id), NULL, 0);
+    if (fuzz->bitmap == (void*)-1) return false;
+  } else {
+    fuzz->bitmap = calloc(RVEMU_FUZZ_MAP_SIZE, 1);
+  }
+
+  if (corpus) {
+    fuzz->corpus = opendir(corpus);
+    if (!fuzz->corpus) return false;
+    fuzz->corpus_fd = dirfd(fuzz->corpus);
+  } else {
+    // the fork server hello; every run is then reported as a child of ours
+    u32 hello = 0;
+    if (write(RVEMU_FUZZ_AFL_FD + 1, &hello, sizeof(hello)) != sizeof(hello)) {
+      return false;
+    }
+    fuzz->afl = true;
+  }
+  fuzz->enabled = true;
+  return true;
+}
+
+static i64 read_corpus_file(Fuzz* fuzz, u8* buf, u64 max_len) {
+  struct dirent* entry;
+  while ((entry = readdir(fuzz->corpus)) != NULL) {
+    int fd = openat(fuzz->corpus_fd, entry->d_name, O_RDONLY);
+    if (fd < 0) continue;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      continue;
+    }
+    ssize_t len = read(fd, buf, max_len);
+    close(fd);
+    if (len >= 0) return len;
+  }
+  return -1;
+}
+
+// Waits for the next input and copies it to buf. Returns its length, or -1
+// once there are no more.
+i64 fuzz_next_input(Fuzz* fuzz, u8* buf, u64 max_len) {
+  fuzz->prev_loc = 0;
+  if (!fuzz->afl) {
+    return read_corpus_file(fuzz, buf, max_len);
+  }
+
+  // afl-fuzz rewrites the test case behind our stdin before each run
+  u32 was_killed;
+  if (read(RVEMU_FUZZ_AFL_FD, &was_killed, sizeof(was_killed)) !=
+      sizeof(was_killed)) {
+    return -1;
+  }
+  u32 pid = getpid();
+  write(RVEMU_FUZZ_AFL_FD + 1, &pid, sizeof(pid));
+  ssize_t len = pread(0, buf, max_len, 0);
+  return len < 0 ? 0 : len;
+}
+
+void fuzz_report(Fuzz* fuzz, int status) {
+  fuzz->runs++;
+  if (WIFSIGNALED(status)) {
+    fuzz->crashes++;
+  }
+  if (fuzz->afl) {
+    write(RVEMU_FUZZ_AFL_FD + 1, &status, sizeof(status));
+  }
+}
+
+void fuzz_summary(Fuzz* fuzz) {
+  u64 edges = 0;
+  for (u64 i = 0; i < RVEMU_FUZZ_MAP_SIZE; i++) {
+    edges += fuzz->bitmap[i] != 0;
+  }
+  fprintf(stderr, "fuzz: %lu runs, %lu crashes, %lu edges\n", fuzz->runs,
+          fuzz->crashes, edges);
+}
@@ -0,0 +1,45 @@
+#ifndef RVEMU_FUZZ_H_
+#define RVEMU_FUZZ_H_
+
+#include <dirent.h>
+#include <stdbool.h>
+
+#include "types.h"
+
+#define RVEMU_FUZZ_MAP_SIZE (1 << 16)  // AFL's MAP_SIZE
+#define RVEMU_FUZZ_AFL_FD 198          // AFL's FORKSRV_FD
+
+// In-process persistent fuzzing. The guest asks for an input with
+// SYS_RVEMU_FUZZ_START(buf, max_len), which checkpoints the machine the first
+// time, and ends a run with SYS_RVEMU_FUZZ_END, an exit or a crash. Each run
+// then starts from the checkpoint again with the next input, and taken
+// branches are counted into an AFL-style edge bitmap along the way.
+typedef struct {
+  bool enabled;
+  bool afl;      // driven by an AFL fork server over its control fds
+  bool started;  // the guest reached SYS_RVEMU_FUZZ_START
+  u8* bitmap;
+  u64 prev_loc;
+  u64 buf;  // the guest's input buffer
+  u64 max_len;
+  DIR* corpus;  // inputs when not run by AFL
+  int corpus_fd;
+  u64 runs;
+  u64 crashes;
+} Fuzz;
+
+bool fuzz_init(Fuzz*, const char*);
+
+i64 fuzz_next_input(Fuzz*, u8*, u64);
+
+void fuzz_report(Fuzz*, int);
+
+void fuzz_summary(Fuzz*);
+
+static inline void fuzz_edge(Fuzz* fuzz, u64 pc) {
+  u64 cur = (pc >> 1 ^ pc >> 17) & (RVEMU_FUZZ_MAP_SIZE - 1);
+  fuzz->bitmap[cur ^ fuzz->prev_loc]++;
+  fuzz->prev_loc = cur >> 1;
+}
+
+#endif  // RVEMU_FUZZ_H_
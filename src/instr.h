@@ -134,9 +134,10 @@
 
 #define EXTENSION(s) s##_INSTRS(s##_NAMES)
 
-#define RVEMU_ISA(...)        \
-  typedef enum {              \
-    __VA_ARGS__ RV_INSTR_NUM, \
+// RV_ILLEGAL is every encoding not listed here
+#define RVEMU_ISA(...)                    \
+  typedef enum {                          \
+    __VA_ARGS__ RV_ILLEGAL, RV_INSTR_NUM, \
   } RvInstrType;
 
 // clang-format off
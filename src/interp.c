@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #include "decode.h"
+#include "mmu.h"
 #include "utils.h"
 
 static void handler_lui(State* state, const RvInstr* instr) {
@@ -65,9 +66,14 @@ static void handler_bgeu(State* state, const RvInstr* instr) {
 
 #undef __HANDLER_BRANCH
 
-#define __HANDLER_LOAD(type)                             \
-  u64 addr = state->xregs[instr->rs1] + (i64)instr->imm; \
-  state->xregs[instr->rd] = *(type*)TO_HOST(addr);
+#define __HANDLER_LOAD(type)                                       \
+  u64 addr = state->xregs[instr->rs1] + (i64)instr->imm;           \
+  if (__builtin_expect(addr < state->mmio_end, 0)) {               \
+    state->xregs[instr->rd] =                                      \
+        (type)state->mmio_read(state, addr, sizeof(type));         \
+    return;                                                        \
+  }                                                                \
+  state->xregs[instr->rd] = *(type*)TO_HOST(state->mem_base, addr);
 
 static void handler_lb(State* state, const RvInstr* instr) {
   __HANDLER_LOAD(i8);
@@ -99,9 +105,14 @@ static void handler_lwu(State* state, const RvInstr* instr) {
 
 #undef __HANDLER_LOAD
 
-#define __HANDLER_STORE(type)                            \
-  u64 addr = state->xregs[instr->rs1] + (i64)instr->imm; \
-  *(type*)TO_HOST(addr) = (type)state->xregs[instr->rs2];
+#define __HANDLER_STORE(type)                                                \
+  u64 addr = state->xregs[instr->rs1] + (i64)instr->imm;                     \
+  if (__builtin_expect(addr < state->mmio_end, 0)) {                         \
+    state->mmio_write(state, addr, (type)state->xregs[instr->rs2],           \
+                      sizeof(type));                                         \
+    return;                                                                  \
+  }                                                                          \
+  *(type*)TO_HOST(state->mem_base, addr) = (type)state->xregs[instr->rs2];
 
 static void handler_sb(State* state, const RvInstr* instr) {
   __HANDLER_STORE(i8);
@@ -378,6 +389,13 @@ static u64 load_csr(const State* state, u16 addr) {
     }
     case CSR_SIE:
       return state->csrs[CSR_MIE] & state->csrs[CSR_MIDELEG];
+    case CSR_SSTATUS:
+      return state->csrs[CSR_MSTATUS] & SSTATUS_MASK;
+    case CSR_SIP:
+      return state->csrs[CSR_MIP] & state->csrs[CSR_MIDELEG];
+    case CSR_TIME:
+      return state->read_time ? state->read_time((State*)state)
+                              : state->csrs[addr];
     default:
       return state->csrs[addr];
   }
@@ -404,13 +422,30 @@ static void store_csr(State* state, u16 addr, u64 value) {
       return;
     }
     case CSR_SIE:
-      state->csrs[addr] = (state->csrs[CSR_MIE] & ~(state->csrs[CSR_MIDELEG])) |
-                          (value & state->csrs[CSR_MIDELEG]);
-      return;
+      state->csrs[CSR_MIE] =
+          (state->csrs[CSR_MIE] & ~(state->csrs[CSR_MIDELEG])) |
+          (value & state->csrs[CSR_MIDELEG]);
+      break;
+    case CSR_SSTATUS:
+      state->csrs[CSR_MSTATUS] =
+          (state->csrs[CSR_MSTATUS] & ~SSTATUS_MASK) | (value & SSTATUS_MASK);
+      break;
+    case CSR_SIP: {
+      u64 mask = state->csrs[CSR_MIDELEG] & MIP_SSIP;
+      state->csrs[CSR_MIP] = (state->csrs[CSR_MIP] & ~mask) | (value & mask);
+      break;
+    }
+    case CSR_MSTATUS:
+    case CSR_MIE:
+    case CSR_MIP:
+      state->csrs[addr] = value;
+      break;
     default:
       state->csrs[addr] = value;
       return;
   }
+  // an interrupt may have just been enabled or raised
+  atomic_store_explicit(&state->irq_pending, 1, memory_order_relaxed);
 }
 
 #undef __STORE_FCSR_FIELD
@@ -461,19 +496,37 @@ static void handler_csrrci(State* state, const RvInstr* instr) {
 
 #undef __HANDLER_CSR
 
+// Floating-point loads and stores reach devices the same way integer ones
+// do, with the bits moved as they are.
+#define __HANDLER_LOAD_F(type)                               \
+  u64 addr = state->xregs[instr->rs1] + (i64)instr->imm;     \
+  type val;                                                  \
+  if (__builtin_expect(addr < state->mmio_end, 0)) {         \
+    val = (type)state->mmio_read(state, addr, sizeof(type)); \
+  } else {                                                   \
+    val = *(type*)TO_HOST(state->mem_base, addr);            \
+  }
+
 static void handler_flw(State* state, const RvInstr* instr) {
-  u64 addr = state->xregs[instr->rs1] + (i64)instr->imm;
-  state->fregs[instr->rd].lu = *(u32*)TO_HOST(addr) | (UINT64_MAX << 32);
+  __HANDLER_LOAD_F(u32);
+  state->fregs[instr->rd].lu = val | (UINT64_MAX << 32);  // NaN-boxed
 }
 
 static void handler_fld(State* state, const RvInstr* instr) {
-  u64 addr = state->xregs[instr->rs1] + (i64)instr->imm;
-  state->fregs[instr->rd].lu = *(u64*)TO_HOST(addr);
+  __HANDLER_LOAD_F(u64);
+  state->fregs[instr->rd].lu = val;
 }
 
-#define __HANDLER_STORE_F(type)                          \
-  u64 addr = state->xregs[instr->rs1] + (i64)instr->imm; \
-  *(type*)TO_HOST(addr) = (type)state->fregs[instr->rs2].lu;
+#undef __HANDLER_LOAD_F
+
+#define __HANDLER_STORE_F(type)                                              \
+  u64 addr = state->xregs[instr->rs1] + (i64)instr->imm;                     \
+  if (__builtin_expect(addr < state->mmio_end, 0)) {                         \
+    state->mmio_write(state, addr, (type)state->fregs[instr->rs2].lu,        \
+                      sizeof(type));                                         \
+    return;                                                                  \
+  }                                                                          \
+  *(type*)TO_HOST(state->mem_base, addr) = (type)state->fregs[instr->rs2].lu;
 
 static void handler_fsw(State* state, const RvInstr* instr) {
   __HANDLER_STORE_F(u32);
@@ -933,6 +986,33 @@ static void handler_mret(State* state, const RvInstr* instr) {
   state->cont = true;
 }
 
+// Ends the block at the instruction itself, for machine_step to raise the
+// exception there.
+static void raise_exception(State* state, u64 cause, u64 tval) {
+  state->trap_cause = cause;
+  state->trap_tval = tval;
+  state->re_enter_pc = state->pc;
+  state->exit_reason = kException;
+  state->cont = true;
+}
+
+static void handler_ebreak(State* state, const RvInstr* instr) {
+  raise_exception(state, CAUSE_BREAKPOINT, state->pc);
+}
+
+static void handler_illegal(State* state, const RvInstr* instr) {
+  u32 raw = *(u32*)TO_HOST(state->mem_base, state->pc);
+  raise_exception(state, CAUSE_ILLEGAL_INSTRUCTION,
+                  (raw & 3) == 3 ? raw : raw & 0xffff);
+}
+
+// ends the block so machine_step can idle the hart until an interrupt
+static void handler_wfi(State* state, const RvInstr* instr) {
+  state->re_enter_pc = state->pc + 4;
+  state->exit_reason = kWfi;
+  state->cont = true;
+}
+
 static void handler_ni(State* state, const RvInstr* instr) {}
 
 static void (*rv_instr_handler[RV_INSTR_NUM])(State*, const RvInstr*) = {
@@ -976,7 +1056,7 @@ static void (*rv_instr_handler[RV_INSTR_NUM])(State*, const RvInstr*) = {
     [U_RV32I_AND] = handler_and,
     [U_RV32I_FENCE] = handler_ni,
     [U_RV32I_ECALL] = handler_ecall,
-    [U_RV32I_EBREAK] = handler_ni,
+    [U_RV32I_EBREAK] = handler_ebreak,
 #endif
 #ifdef RV64I_INSTRS
     [U_RV64I_LWU] = handler_lwu,
@@ -1124,26 +1204,31 @@ static void (*rv_instr_handler[RV_INSTR_NUM])(State*, const RvInstr*) = {
     [P_SRET] = handler_sret,
     [P_MRET] = handler_mret,
     // privileged: interrupt-management
-    [P_WFI] = handler_ni,
+    [P_WFI] = handler_wfi,
     // privileged: supervisor memory-management
     [P_SFENCE_VMA] = handler_ni,
     [P_SINVAL_VMA] = handler_ni,
     [P_SFENCE_W_INVAL] = handler_ni,
     [P_SFENCE_INVAL_IR] = handler_ni,
 #endif
+    [RV_ILLEGAL] = handler_illegal,
 };
 
-void exec_block_interp(State* state) {
-  static RvInstr instr = {0};
+// Returns the number of instructions run, the branch or ECALL included.
+u64 exec_block_interp(State* state) {
+  RvInstr instr = {0};  // per call, so machines can run on many threads
+  u64 executed = 0;
   while (true) {
-    u32 instr_raw = *(u32*)TO_HOST(state->pc);
+    u32 instr_raw = *(u32*)TO_HOST(state->mem_base, state->pc);
     rv_instr_decode(&instr, instr_raw);
     rv_instr_handler[instr.type](state, &instr);
 
     state->xregs[XREG_ZERO] = 0;
+    executed++;
 
     if (state->cont) break;
 
     state->pc += instr.rvc ? 2 : 4;
   }
+  return executed;
 }
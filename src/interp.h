@@ -1,6 +1,7 @@
 #ifndef RVEMU_INTERP_H_
 #define RVEMU_INTERP_H_
 
+#include <stdatomic.h>
 #include <stdbool.h>
 
 #include "csr.h"
@@ -14,6 +15,10 @@ typedef enum {
   kDirectBranch,
   kIndirectBranch,
   kECall,
+  kWfi,
+  kException,  // trap_cause and trap_tval say which
+  kBudgetExhausted,
+  kHalt,  // a device stopped the machine
 } ExitReason;
 
 typedef enum {
@@ -23,19 +28,30 @@ typedef enum {
   kDebug,
 } Mode;
 
-typedef struct {
+typedef struct State {
   u64 xregs[XREG_NUM];
   FReg fregs[FREG_NUM];
   u64 csrs[CSR_NUM];
   u64 pc;
   u64 re_enter_pc;
+  u64 mem_base;  // the Mmu's, kept here for loads and stores
   Mode mode;
   bool enable_paging;
   u64 page_table;
   ExitReason exit_reason;
   bool cont;
+  u64 trap_cause;
+  u64 trap_tval;
+  // system mode: loads and stores below mmio_end go to the device hooks, and
+  // any thread sets irq_pending to have interrupts looked at between blocks;
+  // it is also the futex word a hart in WFI sleeps on
+  u64 mmio_end;
+  u64 (*mmio_read)(struct State*, u64, int);
+  void (*mmio_write)(struct State*, u64, u64, int);
+  u64 (*read_time)(struct State*);
+  atomic_uint irq_pending;
 } State;
 
-void exec_block_interp(State*);
+u64 exec_block_interp(State*);
 
 #endif  // RVEMU_INTERP_H_
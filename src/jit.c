@@ -0,0 +1,700 @@
+#include "jit.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "decode.h"
+#include "utils.h"
+
+#if defined(__x86_64__)
+
+// x86-64 register numbers
+enum {
+  // clang-format off
+  HREG_RAX, HREG_RCX, HREG_RDX, HREG_RBX, HREG_RSP, HREG_RBP, HREG_RSI,
+  HREG_RDI, HREG_R8, HREG_R9, HREG_R10, HREG_R11, HREG_R12, HREG_R13,
+  HREG_R14, HREG_R15,
+  // clang-format on
+};
+
+// an r/m operand that is the State field at a displacement from rdi
+#define HREG_STATE (-1)
+
+// condition codes, as in jcc and setcc
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_L 0xc
+#define CC_GE 0xd
+
+#define STATE_OFF(field) ((i32)offsetof(State, field))
+#define XREG_OFF(r) (STATE_OFF(xregs) + (i32)((r) * sizeof(u64)))
+
+_Static_assert(sizeof(ExitReason) == 4, "exits store exit_reason as a dword");
+
+// Guest registers get these in order of use. Throughout a trace rdi holds
+// State, r15 the guest memory base, rdx the instructions run and rsi the
+// most it may run before leaving; rax and rcx are scratch. There are no
+// calls out, so caller-saved registers are as good as any.
+static const int alloc_order[] = {
+    HREG_RBX, HREG_RBP, HREG_R12, HREG_R13, HREG_R14,
+    HREG_R8,  HREG_R9,  HREG_R10, HREG_R11,
+};
+
+// host code for one trace as it is put together
+typedef struct {
+  u8* buf;
+  u32 len;   // may pass cap, in which case the trace is given up
+  u32 cap;
+  u64 base;  // of buf in Jit.code
+  JitTrace* trace;
+  u32 epilogue;  // where every exit ends up
+  u32 loop;      // the first guest instruction
+} Asm;
+
+static void emit(Asm* a, u8 byte) {
+  if (a->len < a->cap) a->buf[a->len] = byte;
+  a->len++;
+}
+
+static void emit32(Asm* a, u32 value) {
+  for (int i = 0; i < 4; i++) {
+    emit(a, value >> i * 8);
+  }
+}
+
+static void emit64(Asm* a, u64 value) {
+  emit32(a, value);
+  emit32(a, value >> 32);
+}
+
+static void emit_rex(Asm* a, bool w, int r, int b) {
+  u8 rex = 0x40 | w << 3 | (r >> 3) << 2 | b >> 3;
+  if (rex != 0x40) emit(a, rex);
+}
+
+// op, one byte or 0x0f and one, with reg field r and r/m either host
+// register rm or, for HREG_STATE, the State field at disp
+static void emit_rm(Asm* a, bool w, u32 op, int r, int rm, i32 disp) {
+  emit_rex(a, w, r, rm == HREG_STATE ? HREG_RDI : rm);
+  if (op > 0xff) emit(a, op >> 8);
+  emit(a, op);
+  if (rm != HREG_STATE) {
+    emit(a, 0xc0 | (r & 7) << 3 | (rm & 7));
+  } else if (disp == (i8)disp) {
+    emit(a, 0x40 | (r & 7) << 3 | HREG_RDI);
+    emit(a, disp);
+  } else {
+    emit(a, 0x80 | (r & 7) << 3 | HREG_RDI);
+    emit32(a, disp);
+  }
+}
+
+// op with reg field r on the guest memory at [r15 + rax]
+static void emit_guest_mem(Asm* a, bool w, u32 op, int r) {
+  emit_rex(a, w, r, HREG_R15);
+  if (op > 0xff) emit(a, op >> 8);
+  emit(a, op);
+  emit(a, (r & 7) << 3 | 4);
+  emit(a, HREG_RAX << 3 | (HREG_R15 & 7));
+}
+
+// one of the 0x81 group, add (0) to cmp (7), with an immediate operand
+static void emit_alu_imm(Asm* a, bool w, int ext, int rm, i32 imm) {
+  if (imm == (i8)imm) {
+    emit_rm(a, w, 0x83, ext, rm, 0);
+    emit(a, imm);
+  } else {
+    emit_rm(a, w, 0x81, ext, rm, 0);
+    emit32(a, imm);
+  }
+}
+
+static void emit_imm(Asm* a, int h, u64 value) {
+  if (value == (u64)(i64)(i32)value) {
+    emit_rm(a, true, 0xc7, 0, h, 0);
+    emit32(a, value);
+  } else {
+    emit_rex(a, true, 0, h);
+    emit(a, 0xb8 | (h & 7));
+    emit64(a, value);
+  }
+}
+
+// movsxd h, h32; the W instructions work on the low half and sign-extend
+static void emit_sext32(Asm* a, int h) { emit_rm(a, true, 0x63, h, h, 0); }
+
+// Returns where the rel32 of a forward jcc is, for patch_here.
+static u32 emit_jcc(Asm* a, int cc) {
+  emit(a, 0x0f);
+  emit(a, 0x80 | cc);
+  emit32(a, 0);
+  return a->len;
+}
+
+static void patch_here(Asm* a, u32 end) {
+  if (end > a->cap) return;
+  i32 rel = a->len - end;
+  memcpy(a->buf + end - 4, &rel, sizeof(rel));
+}
+
+static void emit_jcc_to(Asm* a, int cc, u32 target) {
+  emit(a, 0x0f);
+  emit(a, 0x80 | cc);
+  emit32(a, target - (a->len + 4));
+}
+
+static void emit_jmp_to(Asm* a, u32 target) {
+  emit(a, 0xe9);
+  emit32(a, target - (a->len + 4));
+}
+
+static int xreg_rm(const JitTrace* t, int xreg) {
+  return t->host_reg[xreg] >= 0 ? t->host_reg[xreg] : HREG_STATE;
+}
+
+static void emit_rm_xreg(Asm* a, bool w, u32 op, int r, int xreg) {
+  emit_rm(a, w, op, r, xreg_rm(a->trace, xreg), XREG_OFF(xreg));
+}
+
+static void emit_load_xreg(Asm* a, int h, int xreg) {
+  if (xreg == XREG_ZERO) {
+    emit_rm(a, false, 0x31, h, h, 0);  // xor
+  } else if (a->trace->host_reg[xreg] != h) {
+    emit_rm_xreg(a, true, 0x8b, h, xreg);
+  }
+}
+
+static void emit_store_xreg(Asm* a, int xreg, int h) {
+  if (xreg == XREG_ZERO || a->trace->host_reg[xreg] == h) return;
+  emit_rm_xreg(a, true, 0x89, h, xreg);
+}
+
+// Where to compute instr's result: in rd's own host register when it has
+// one and rs1 going there would not clobber an rs2 still to be read.
+static int result_reg(const Asm* a, const RvInstr* instr, bool reads_rs2) {
+  int h = a->trace->host_reg[instr->rd];
+  if (h < 0 ||
+      (reads_rs2 && instr->rs2 == instr->rd && instr->rs1 != instr->rd)) {
+    return HREG_RAX;
+  }
+  return h;
+}
+
+// Leaves the trace for the guest pc in rax, counting executed more
+// instructions run this time round.
+static void emit_exit(Asm* a, u32 executed, ExitReason reason) {
+  if (executed) emit_alu_imm(a, true, 0, HREG_RDX, executed);
+  emit_rm(a, true, 0x89, HREG_RAX, HREG_STATE, STATE_OFF(re_enter_pc));
+  emit_rm(a, false, 0xc7, 0, HREG_STATE, STATE_OFF(exit_reason));
+  emit32(a, reason);
+  emit_jmp_to(a, a->epilogue);
+}
+
+// A jump back to the start of the trace goes round again without leaving,
+// unless that would pass the limit or an interrupt wants looking at.
+static void emit_branch_to(Asm* a, u32 executed, u64 target) {
+  if (target == a->trace->pc) {
+    emit_alu_imm(a, true, 0, HREG_RDX, executed);
+    emit_rm(a, true, 0x3b, HREG_RDX, HREG_RSI, 0);
+    u32 full = emit_jcc(a, CC_AE);
+    emit_rm(a, false, 0x83, 7, HREG_STATE, STATE_OFF(irq_pending));
+    emit(a, 0);
+    emit_jcc_to(a, CC_E, a->loop);
+    patch_here(a, full);
+    executed = 0;
+  }
+  emit_imm(a, HREG_RAX, target);
+  emit_exit(a, executed, kDirectBranch);
+}
+
+static void emit_r_alu(Asm* a, const RvInstr* instr, bool word, u32 op) {
+  int res = result_reg(a, instr, true);
+  emit_load_xreg(a, res, instr->rs1);
+  emit_rm_xreg(a, !word, op, res, instr->rs2);
+  if (word) emit_sext32(a, res);
+  emit_store_xreg(a, instr->rd, res);
+}
+
+static void emit_i_alu(Asm* a, const RvInstr* instr, bool word, int ext) {
+  int res = result_reg(a, instr, false);
+  emit_load_xreg(a, res, instr->rs1);
+  if (instr->imm != 0 || ext == 4) {  // and with 0 is the only one to keep
+    emit_alu_imm(a, !word, ext, res, instr->imm);
+  }
+  if (word) emit_sext32(a, res);
+  emit_store_xreg(a, instr->rd, res);
+}
+
+// shl (4), shr (5) or sar (7), by the immediate or else by rs2 in cl;
+// x86 masks the count the same way RISC-V does
+static void emit_shift(Asm* a, const RvInstr* instr, bool word, bool imm,
+                       int ext) {
+  if (!imm) emit_load_xreg(a, HREG_RCX, instr->rs2);
+  int res = result_reg(a, instr, false);
+  emit_load_xreg(a, res, instr->rs1);
+  emit_rm(a, !word, imm ? 0xc1 : 0xd3, ext, res, 0);
+  if (imm) emit(a, instr->imm & (word ? 0x1f : 0x3f));
+  if (word) emit_sext32(a, res);
+  emit_store_xreg(a, instr->rd, res);
+}
+
+static void emit_set(Asm* a, const RvInstr* instr, bool imm, int cc) {
+  emit_load_xreg(a, HREG_RAX, instr->rs1);
+  if (imm) {
+    emit_alu_imm(a, true, 7, HREG_RAX, instr->imm);
+  } else {
+    emit_rm_xreg(a, true, 0x3b, HREG_RAX, instr->rs2);
+  }
+  emit_rm(a, false, 0x0f90 | cc, 0, HREG_RAX, 0);
+  emit_rm(a, false, 0x0fb6, HREG_RAX, HREG_RAX, 0);
+  emit_store_xreg(a, instr->rd, HREG_RAX);
+}
+
+// the guest address of a load or store, into rax, wrapped around the guest
+// window as TO_HOST does
+static void emit_address(Asm* a, const RvInstr* instr) {
+  int shift = 64 - __builtin_ctzll(RVEMU_MMU_GUEST_LIMIT);
+  emit_load_xreg(a, HREG_RAX, instr->rs1);
+  if (instr->imm != 0) emit_alu_imm(a, true, 0, HREG_RAX, instr->imm);
+  emit_rm(a, true, 0xc1, 4, HREG_RAX, 0);
+  emit(a, shift);
+  emit_rm(a, true, 0xc1, 5, HREG_RAX, 0);
+  emit(a, shift);
+}
+
+// notes the access just emitted from start on as the guest's at pc
+static void add_mem_op(Asm* a, u32 start, u64 pc) {
+  JitTrace* t = a->trace;
+  t->mem_ops[t->num_mem_ops++] = (JitMemOp){
+      .start = a->base + start,
+      .end = a->base + a->len,
+      .pc = pc,
+  };
+}
+
+static void emit_load(Asm* a, const RvInstr* instr, u64 pc, bool w, u32 op) {
+  emit_address(a, instr);
+  int h = a->trace->host_reg[instr->rd];
+  int res = h >= 0 ? h : HREG_RCX;
+  u32 start = a->len;
+  emit_guest_mem(a, w, op, res);
+  add_mem_op(a, start, pc);
+  emit_store_xreg(a, instr->rd, res);
+}
+
+static void emit_store(Asm* a, const RvInstr* instr, u64 pc, int size) {
+  int src = a->trace->host_reg[instr->rs2];
+  if (src < 0) {
+    src = HREG_RCX;
+    emit_load_xreg(a, src, instr->rs2);
+  }
+  emit_address(a, instr);
+  u32 start = a->len;
+  if (size == 2) emit(a, 0x66);
+  emit_guest_mem(a, size == 8, size == 1 ? 0x88 : 0x89, src);
+  add_mem_op(a, start, pc);
+}
+
+static void emit_branch(Asm* a, const RvInstr* instr, u64 pc, u32 executed,
+                        int cc) {
+  int lhs = a->trace->host_reg[instr->rs1];
+  if (lhs < 0) {
+    lhs = HREG_RAX;
+    emit_load_xreg(a, lhs, instr->rs1);
+  }
+  emit_rm_xreg(a, true, 0x3b, lhs, instr->rs2);
+  u32 not_taken = emit_jcc(a, cc ^ 1);
+  emit_branch_to(a, executed, pc + (i64)instr->imm);
+  patch_here(a, not_taken);
+}
+
+// rd of a JAL or JALR
+static void emit_link(Asm* a, const RvInstr* instr, u64 pc) {
+  if (instr->rd == XREG_ZERO) return;
+  int h = a->trace->host_reg[instr->rd];
+  int res = h >= 0 ? h : HREG_RAX;
+  emit_imm(a, res, pc + (instr->rvc ? 2 : 4));
+  emit_store_xreg(a, instr->rd, res);
+}
+
+// What the tier compiles: integer instructions that cannot trap, and
+// loads and stores when there is no MMIO below them to route around.
+static bool jit_supports(const RvInstr* instr, const State* state) {
+  switch (instr->type) {
+    case U_RV32I_LUI:
+    case U_RV32I_AUIPC:
+    case U_RV32I_JAL:
+    case U_RV32I_JALR:
+    case U_RV32I_BEQ:
+    case U_RV32I_BNE:
+    case U_RV32I_BLT:
+    case U_RV32I_BGE:
+    case U_RV32I_BLTU:
+    case U_RV32I_BGEU:
+    case U_RV32I_ADDI:
+    case U_RV32I_SLTI:
+    case U_RV32I_SLTIU:
+    case U_RV32I_XORI:
+    case U_RV32I_ORI:
+    case U_RV32I_ANDI:
+    case U_RV32I_SLLI:
+    case U_RV32I_SRLI:
+    case U_RV32I_SRAI:
+    case U_RV32I_ADD:
+    case U_RV32I_SUB:
+    case U_RV32I_SLL:
+    case U_RV32I_SLT:
+    case U_RV32I_SLTU:
+    case U_RV32I_XOR:
+    case U_RV32I_SRL:
+    case U_RV32I_SRA:
+    case U_RV32I_OR:
+    case U_RV32I_AND:
+    case U_RV64I_SLLI:
+    case U_RV64I_SRLI:
+    case U_RV64I_SRAI:
+    case U_RV64I_ADDIW:
+    case U_RV64I_SLLIW:
+    case U_RV64I_SRLIW:
+    case U_RV64I_SRAIW:
+    case U_RV64I_ADDW:
+    case U_RV64I_SUBW:
+    case U_RV64I_SLLW:
+    case U_RV64I_SRLW:
+    case U_RV64I_SRAW:
+    case U_RV32M_MUL:
+    case U_RV64M_MULW:
+      return true;
+    case U_RV32I_LB:
+    case U_RV32I_LH:
+    case U_RV32I_LW:
+    case U_RV32I_LBU:
+    case U_RV32I_LHU:
+    case U_RV32I_SB:
+    case U_RV32I_SH:
+    case U_RV32I_SW:
+    case U_RV64I_LWU:
+    case U_RV64I_LD:
+    case U_RV64I_SD:
+      return state->mmio_end == 0;
+    default:
+      return false;
+  }
+}
+
+// the code for instr at pc, which is the executed'th of the trace
+static void emit_instr(Asm* a, const RvInstr* instr, u64 pc, u32 executed) {
+  switch (instr->type) {
+    case U_RV32I_LUI:
+    case U_RV32I_AUIPC: {
+      if (instr->rd == XREG_ZERO) break;
+      u64 value = (i64)instr->imm;
+      if (instr->type == U_RV32I_AUIPC) value += pc;
+      int h = a->trace->host_reg[instr->rd];
+      int res = h >= 0 ? h : HREG_RAX;
+      emit_imm(a, res, value);
+      emit_store_xreg(a, instr->rd, res);
+      break;
+    }
+    case U_RV32I_JAL:
+      emit_link(a, instr, pc);
+      emit_branch_to(a, executed, pc + (i64)instr->imm);
+      break;
+    case U_RV32I_JALR:
+      emit_load_xreg(a, HREG_RCX, instr->rs1);
+      if (instr->imm != 0) emit_alu_imm(a, true, 0, HREG_RCX, instr->imm);
+      emit_alu_imm(a, true, 4, HREG_RCX, -2);
+      emit_link(a, instr, pc);
+      emit_rm(a, true, 0x8b, HREG_RAX, HREG_RCX, 0);
+      emit_exit(a, executed, kIndirectBranch);
+      break;
+    case U_RV32I_BEQ: emit_branch(a, instr, pc, executed, CC_E); break;
+    case U_RV32I_BNE: emit_branch(a, instr, pc, executed, CC_NE); break;
+    case U_RV32I_BLT: emit_branch(a, instr, pc, executed, CC_L); break;
+    case U_RV32I_BGE: emit_branch(a, instr, pc, executed, CC_GE); break;
+    case U_RV32I_BLTU: emit_branch(a, instr, pc, executed, CC_B); break;
+    case U_RV32I_BGEU: emit_branch(a, instr, pc, executed, CC_AE); break;
+    case U_RV32I_LB: emit_load(a, instr, pc, true, 0x0fbe); break;
+    case U_RV32I_LH: emit_load(a, instr, pc, true, 0x0fbf); break;
+    case U_RV32I_LW: emit_load(a, instr, pc, true, 0x63); break;
+    case U_RV32I_LBU: emit_load(a, instr, pc, false, 0x0fb6); break;
+    case U_RV32I_LHU: emit_load(a, instr, pc, false, 0x0fb7); break;
+    case U_RV64I_LWU: emit_load(a, instr, pc, false, 0x8b); break;
+    case U_RV64I_LD: emit_load(a, instr, pc, true, 0x8b); break;
+    case U_RV32I_SB: emit_store(a, instr, pc, 1); break;
+    case U_RV32I_SH: emit_store(a, instr, pc, 2); break;
+    case U_RV32I_SW: emit_store(a, instr, pc, 4); break;
+    case U_RV64I_SD: emit_store(a, instr, pc, 8); break;
+    case U_RV32I_ADDI: emit_i_alu(a, instr, false, 0); break;
+    case U_RV32I_SLTI: emit_set(a, instr, true, CC_L); break;
+    case U_RV32I_SLTIU: emit_set(a, instr, true, CC_B); break;
+    case U_RV32I_XORI: emit_i_alu(a, instr, false, 6); break;
+    case U_RV32I_ORI: emit_i_alu(a, instr, false, 1); break;
+    case U_RV32I_ANDI: emit_i_alu(a, instr, false, 4); break;
+    case U_RV32I_SLLI:
+    case U_RV64I_SLLI: emit_shift(a, instr, false, true, 4); break;
+    case U_RV32I_SRLI:
+    case U_RV64I_SRLI: emit_shift(a, instr, false, true, 5); break;
+    case U_RV32I_SRAI:
+    case U_RV64I_SRAI: emit_shift(a, instr, false, true, 7); break;
+    case U_RV32I_ADD: emit_r_alu(a, instr, false, 0x03); break;
+    case U_RV32I_SUB: emit_r_alu(a, instr, false, 0x2b); break;
+    case U_RV32I_SLL: emit_shift(a, instr, false, false, 4); break;
+    case U_RV32I_SLT: emit_set(a, instr, false, CC_L); break;
+    case U_RV32I_SLTU: emit_set(a, instr, false, CC_B); break;
+    case U_RV32I_XOR: emit_r_alu(a, instr, false, 0x33); break;
+    case U_RV32I_SRL: emit_shift(a, instr, false, false, 5); break;
+    case U_RV32I_SRA: emit_shift(a, instr, false, false, 7); break;
+    case U_RV32I_OR: emit_r_alu(a, instr, false, 0x0b); break;
+    case U_RV32I_AND: emit_r_alu(a, instr, false, 0x23); break;
+    case U_RV64I_ADDIW: emit_i_alu(a, instr, true, 0); break;
+    case U_RV64I_SLLIW: emit_shift(a, instr, true, true, 4); break;
+    case U_RV64I_SRLIW: emit_shift(a, instr, true, true, 5); break;
+    case U_RV64I_SRAIW: emit_shift(a, instr, true, true, 7); break;
+    case U_RV64I_ADDW: emit_r_alu(a, instr, true, 0x03); break;
+    case U_RV64I_SUBW: emit_r_alu(a, instr, true, 0x2b); break;
+    case U_RV64I_SLLW: emit_shift(a, instr, true, false, 4); break;
+    case U_RV64I_SRLW: emit_shift(a, instr, true, false, 5); break;
+    case U_RV64I_SRAW: emit_shift(a, instr, true, false, 7); break;
+    case U_RV32M_MUL: emit_r_alu(a, instr, false, 0x0faf); break;
+    case U_RV64M_MULW: emit_r_alu(a, instr, true, 0x0faf); break;
+    default:
+      __builtin_unreachable();
+  }
+}
+
+static const u8 saved_regs[] = {HREG_RBX, HREG_RBP, HREG_R12,
+                                HREG_R13, HREG_R14, HREG_R15};
+
+// Lays out the shared exit first and the entry after it, so every exit
+// jumps back to an address already known.
+static void emit_trace(Asm* a, const RvInstr* instrs, u32 n) {
+  const JitTrace* t = a->trace;
+  a->epilogue = a->len;
+  for (int r = 0; r < XREG_NUM; r++) {
+    if (t->host_reg[r] >= 0) {
+      emit_rm(a, true, 0x89, t->host_reg[r], HREG_STATE, XREG_OFF(r));
+    }
+  }
+  emit_rm(a, true, 0x8b, HREG_RAX, HREG_RDX, 0);
+  for (int i = SIZEOF_ARRAY(saved_regs) - 1; i >= 0; i--) {
+    emit_rex(a, false, 0, saved_regs[i]);
+    emit(a, 0x58 | (saved_regs[i] & 7));  // pop
+  }
+  emit(a, 0xc3);  // ret
+
+  u32 entry = a->len;
+  for (int i = 0; i < SIZEOF_ARRAY(saved_regs); i++) {
+    emit_rex(a, false, 0, saved_regs[i]);
+    emit(a, 0x50 | (saved_regs[i] & 7));  // push
+  }
+  emit_rm(a, true, 0x8b, HREG_R15, HREG_STATE, STATE_OFF(mem_base));
+  emit_rm(a, false, 0x31, HREG_RDX, HREG_RDX, 0);
+  for (int r = 0; r < XREG_NUM; r++) {
+    if (t->host_reg[r] >= 0) {
+      emit_rm(a, true, 0x8b, t->host_reg[r], HREG_STATE, XREG_OFF(r));
+    }
+  }
+
+  a->loop = a->len;
+  u64 pc = t->pc;
+  for (u32 i = 0; i < n; i++) {
+    emit_instr(a, &instrs[i], pc, i + 1);
+    pc += instrs[i].rvc ? 2 : 4;
+  }
+  RvInstrType last = instrs[n - 1].type;
+  if (last != U_RV32I_JAL && last != U_RV32I_JALR) {
+    emit_imm(a, HREG_RAX, pc);  // fell off the end
+    emit_exit(a, n, kDirectBranch);
+  }
+  a->trace->run = (void*)(a->buf + entry);
+}
+
+// Takes the supported run of instructions at state.pc, up to a jump, and
+// gives the registers it uses most the host registers there are.
+static JitTrace* jit_compile(Jit* jit, const State* state) {
+  RvInstr instrs[RVEMU_JIT_MAX_INSTRS];
+  u32 uses[XREG_NUM] = {0};
+  u64 pc = state->pc;
+  u32 n = 0;
+  while (n < RVEMU_JIT_MAX_INSTRS) {
+    RvInstr* instr = &instrs[n];
+    *instr = (RvInstr){0};
+    rv_instr_decode(instr, *(u32*)TO_HOST(state->mem_base, pc));
+    if (!jit_supports(instr, state)) break;
+    uses[instr->rs1]++;
+    uses[instr->rs2]++;
+    uses[instr->rd]++;
+    pc += instr->rvc ? 2 : 4;
+    n++;
+    if (instr->type == U_RV32I_JAL || instr->type == U_RV32I_JALR) break;
+  }
+  if (n == 0) return NULL;
+
+  JitTrace* t = calloc(1, sizeof(JitTrace));
+  if (!t) return NULL;
+  t->pc = state->pc;
+  t->num_instrs = n;
+  t->guest_len = pc - state->pc;
+  memcpy(t->guest, (void*)TO_HOST(state->mem_base, t->pc), t->guest_len);
+
+  memset(t->host_reg, -1, sizeof(t->host_reg));
+  uses[XREG_ZERO] = 0;  // always read from State, where it stays 0
+  for (int i = 0; i < SIZEOF_ARRAY(alloc_order); i++) {
+    int best = XREG_ZERO;
+    for (int r = 1; r < XREG_NUM; r++) {
+      if (t->host_reg[r] < 0 && uses[r] > uses[best]) best = r;
+    }
+    if (best == XREG_ZERO) break;
+    t->host_reg[best] = alloc_order[i];
+  }
+
+  // code is never writable and executable at once, so the pages the trace
+  // may take are writable only while it is emitted
+  u8* start = (u8*)ROUNDDOWN((u64)jit->code + jit->code_used, PAGE_SIZE);
+  u8* end = (u8*)ROUNDUP(
+      (u64)jit->code + jit->code_used + RVEMU_JIT_MAX_TRACE_CODE, PAGE_SIZE);
+  if (mprotect(start, end - start, PROT_READ | PROT_WRITE) != 0) {
+    free(t);
+    return NULL;
+  }
+
+  Asm a = {
+      .buf = jit->code + jit->code_used,
+      .cap = RVEMU_JIT_MAX_TRACE_CODE,
+      .base = jit->code_used,
+      .trace = t,
+  };
+  emit_trace(&a, instrs, n);
+  if (mprotect(start, end - start, PROT_READ | PROT_EXEC) != 0) {
+    FATALF("cannot make jitted code executable: %s", strerror(errno));
+  }
+  if (a.len > a.cap) {
+    free(t);
+    return NULL;
+  }
+  jit->code_used += ROUNDUP(a.len, 16);
+  return t;
+}
+
+// drops every trace, for when the code buffer has filled up
+static void jit_flush(Jit* jit) {
+  for (int i = 0; i < RVEMU_JIT_TABLE_SIZE; i++) {
+    free(jit->table[i].trace);
+    jit->table[i] = (JitEntry){0};
+  }
+  jit->code_used = 0;
+}
+
+static bool jit_start(Jit* jit) {
+  void* code = mmap(NULL, RVEMU_JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (code == MAP_FAILED) return false;
+  jit->table = calloc(RVEMU_JIT_TABLE_SIZE, sizeof(JitEntry));
+  if (!jit->table) {
+    munmap(code, RVEMU_JIT_CODE_SIZE);
+    return false;
+  }
+  jit->code = code;
+  return true;
+}
+
+// Runs the block at state.pc as jitted code, once it has been interpreted
+// often enough to be worth compiling, and returns false to have it
+// interpreted instead. A looping trace keeps going round until limit
+// instructions have run; *executed is how many did.
+bool jit_run(Jit* jit, State* state, u64 limit, u64* executed) {
+  if (!jit->table && !jit_start(jit)) {
+    jit->enabled = false;  // no executable memory, so no JIT
+    return false;
+  }
+
+  JitEntry* entry = &jit->table[(state->pc >> 1) % RVEMU_JIT_TABLE_SIZE];
+  if (entry->pc != state->pc) {
+    free(entry->trace);
+    *entry = (JitEntry){.pc = state->pc};
+  }
+  if (!entry->trace) {
+    if (entry->count == UINT32_MAX || ++entry->count < RVEMU_JIT_HOT) {
+      return false;
+    }
+    if (jit->code_used + RVEMU_JIT_MAX_TRACE_CODE > RVEMU_JIT_CODE_SIZE) {
+      jit_flush(jit);
+      entry->pc = state->pc;
+    }
+    entry->trace = jit_compile(jit, state);
+    if (!entry->trace) {
+      entry->count = UINT32_MAX;
+      return false;
+    }
+  }
+
+  JitTrace* t = entry->trace;
+  if (memcmp(t->guest, (void*)TO_HOST(state->mem_base, t->pc),
+             t->guest_len) != 0) {
+    free(t);  // the guest rewrote it, so start counting afresh
+    entry->trace = NULL;
+    entry->count = 0;
+    return false;
+  }
+  jit->running = t;
+  *executed = t->run(state, limit);
+  jit->running = NULL;
+  return true;
+}
+
+// Puts State where the interpreter would have it on a guest fault in
+// jitted code: pc on the faulting access, and the registers held in host
+// ones as they were just before it. Returns the number of instructions the
+// trace ran before the access.
+u64 jit_recover(Jit* jit, State* state, const MmuFault* fault) {
+  JitTrace* t = jit->running;
+  if (!t) return 0;
+  jit->running = NULL;
+  u64 off = fault->host_pc - (u64)jit->code;
+  for (u32 i = 0; i < t->num_mem_ops; i++) {
+    const JitMemOp* op = &t->mem_ops[i];
+    if (off < op->start || off >= op->end) continue;
+    state->pc = op->pc;
+    for (int r = 0; r < XREG_NUM; r++) {
+      if (t->host_reg[r] >= 0) {
+        state->xregs[r] = fault->host_regs[(int)t->host_reg[r]];
+      }
+    }
+    // rdx counts the earlier times round, the rest are in this one
+    u64 executed = fault->host_regs[HREG_RDX];
+    for (u64 off = 0; off < op->pc - t->pc; executed++) {
+      off += (t->guest[off] & 3) == 3 ? 4 : 2;
+    }
+    return executed;
+  }
+  FATAL("fault in jitted code outside a guest access");
+}
+
+void jit_destroy(Jit* jit) {
+  if (!jit->table) return;
+  jit_flush(jit);
+  free(jit->table);
+  munmap(jit->code, RVEMU_JIT_CODE_SIZE);
+  jit->table = NULL;
+}
+
+#else
+
+// other hosts have the interpreter only
+bool jit_run(Jit* jit, State* state, u64 limit, u64* executed) {
+  return false;
+}
+
+u64 jit_recover(Jit* jit, State* state, const MmuFault* fault) {
+  return 0;
+}
+
+void jit_destroy(Jit* jit) {}
+
+#endif
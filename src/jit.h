@@ -0,0 +1,63 @@
+#ifndef RVEMU_JIT_H_
+#define RVEMU_JIT_H_
+
+#include <stdbool.h>
+
+#include "interp.h"
+#include "mmu.h"
+#include "reg.h"
+#include "types.h"
+
+#define RVEMU_JIT_CODE_SIZE (16 * 1024 * 1024)
+#define RVEMU_JIT_TABLE_SIZE 4096  // direct-mapped by block pc
+#define RVEMU_JIT_HOT 1000         // interpreted runs before a block compiles
+#define RVEMU_JIT_MAX_INSTRS 64
+#define RVEMU_JIT_MAX_TRACE_CODE 8192  // host bytes a trace can take at most
+
+// a host instruction that touches guest memory and so may fault
+typedef struct {
+  u32 start;  // offsets into Jit.code
+  u32 end;
+  u64 pc;  // of the guest load or store
+} JitMemOp;
+
+// A compiled block: straight-line integer code ending in a branch, and a
+// loop when the branch goes back to the start. Guest registers the block
+// uses most live in host registers for the whole run, and go back to State
+// only when it exits.
+typedef struct {
+  u64 pc;
+  u32 num_instrs;
+  u32 guest_len;
+  u8 guest[RVEMU_JIT_MAX_INSTRS * 4];  // compared on entry, for code changes
+  // runs the block, going round its loop until at least limit guest
+  // instructions have run, and returns how many did
+  u64 (*run)(State*, u64 limit);
+  i8 host_reg[XREG_NUM];  // each guest register's host register, or -1
+  u32 num_mem_ops;
+  JitMemOp mem_ops[RVEMU_JIT_MAX_INSTRS];
+} JitTrace;
+
+typedef struct {
+  u64 pc;
+  u32 count;  // interpreted runs, UINT32_MAX once the block cannot compile
+  JitTrace* trace;
+} JitEntry;
+
+// The x86-64 tier above the interpreter. A machine's table and code buffer
+// are made when it first runs, so copies of an unused template are safe.
+typedef struct {
+  bool enabled;
+  u8* code;
+  u64 code_used;
+  JitEntry* table;
+  JitTrace* running;  // the trace a guest fault came from, for jit_recover
+} Jit;
+
+bool jit_run(Jit*, State*, u64, u64*);
+
+u64 jit_recover(Jit*, State*, const MmuFault*);
+
+void jit_destroy(Jit*);
+
+#endif  // RVEMU_JIT_H_
@@ -3,22 +3,96 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "syscall.h"
 #include "utils.h"
 
-ExitReason machine_step(Machine* m) {
+// Delivers an exception at state.pc. A system guest takes it through its
+// trap vector; a process dies of sig instead, which in a fuzz run only ends
+// the run. Returns true when the machine has halted.
+static bool machine_exception(Machine* m, u64 cause, u64 tval, int sig) {
+  if (m->sys) {
+    system_trap(m, cause, tval);
+    return false;
+  }
+  if (m->fuzz.enabled) {
+    machine_set_xreg(m, XREG_A0, machine_fuzz_next(m, sig));
+    return false;
+  }
+  m->halted = true;
+  m->exit_code = 128 + sig;
+  m->term_signal = sig;
+  return true;
+}
+
+static bool is_store(u32 raw) {
+  if ((raw & 3) != 3) {  // C.FSD, C.SW and C.SD, plus their SP forms
+    return (raw & 1) == 0 && (raw >> 13 & 7) >= 5;
+  }
+  u32 opcode = raw & 0x7f;
+  bool lr = opcode == 0x2f && (raw >> 27) == 0x02;
+  return opcode == 0x23 || opcode == 0x27 || (opcode == 0x2f && !lr);
+}
+
+// The exception a host fault on guest address addr stands for. A
+// compressed instruction can end its page, so only its own half is read.
+static u64 fault_cause(const State* state, u64 addr) {
+  if (addr - state->pc < 4) return CAUSE_FETCH_ACCESS;
+  const u16* instr = (const u16*)TO_HOST(state->mem_base, state->pc);
+  u32 raw = instr[0];
+  if ((raw & 3) == 3) raw |= (u32)instr[1] << 16;
+  return is_store(raw) ? CAUSE_STORE_ACCESS : CAUSE_LOAD_ACCESS;
+}
+
+static ExitReason machine_run(Machine* m) {
   while (true) {
     m->state.exit_reason = kNone;
-    exec_block_interp(&m->state);
+    u64 executed;
+    u64 limit = m->budgeted ? m->budget : UINT64_MAX;
+    if (!m->jit.enabled ||
+        !jit_run(&m->jit, &m->state, limit, &executed)) {
+      executed = exec_block_interp(&m->state);
+    }
+    if (m->budgeted) {
+      m->budget = executed < m->budget ? m->budget - executed : 0;
+    }
 
     assert(m->state.exit_reason != kNone);
     if (m->state.exit_reason == kDirectBranch ||
-        m->state.exit_reason == kIndirectBranch) {
+        m->state.exit_reason == kIndirectBranch ||
+        m->state.exit_reason == kWfi) {
+      if (m->fuzz.enabled) {
+        fuzz_edge(&m->fuzz, m->state.re_enter_pc);
+      }
+      m->state.pc = m->state.re_enter_pc;
+      m->state.cont = false;
+      if (m->state.exit_reason == kWfi && m->sys) system_wfi(m);
+      if (atomic_load_explicit(&m->state.irq_pending, memory_order_relaxed) &&
+          system_interrupt(m)) {
+        return kHalt;
+      }
+      if (m->budgeted && m->budget == 0) return kBudgetExhausted;
+      continue;
+    }
+    if (m->state.exit_reason == kException) {
+      m->state.pc = m->state.re_enter_pc;
+      m->state.cont = false;
+      u64 cause = m->state.trap_cause;
+      int sig = cause == CAUSE_BREAKPOINT ? SIGTRAP : SIGILL;
+      if (machine_exception(m, cause, m->state.trap_tval, sig)) return kHalt;
+      continue;
+    }
+    if (m->state.exit_reason == kECall && !m->trap_all_syscalls &&
+        do_syscall_fast(m)) {
       m->state.pc = m->state.re_enter_pc;
       m->state.cont = false;
-      continue;  // JIT
+      if (m->budgeted && m->budget == 0) return kBudgetExhausted;
+      continue;
     }
     break;
   }
@@ -29,25 +103,112 @@ ExitReason machine_step(Machine* m) {
   return kECall;
 }
 
-void machine_load_program(Machine* m, const char* prog) {
-  int fd = open(prog, O_RDONLY);
-  if (fd == -1) {
-    FATAL(strerror(errno));
+// Runs blocks until an ECALL that needs the caller or, with a budget set,
+// until the budget runs out at a block boundary. Either way state.pc is
+// where the guest resumes. In system mode, interrupts are taken between
+// blocks too, and WFI sleeps until there is one; elsewhere WFI is a nop.
+//
+// Guest exceptions are precise. Illegal instructions and EBREAK end their
+// block, and memory faults come back here as host signals, so loads and
+// stores carry no checks of their own; jitted code is mapped back to the
+// guest's pc and registers first. kHalt means a process guest died of one,
+// with term_signal set.
+ExitReason machine_step(Machine* m) {
+  MmuFault fault = {.mmu = &m->mmu};
+  if (sigsetjmp(fault.jmp, 0)) {
+    // a fault while this is handled is the emulator's own
+    mmu_guest_fault = NULL;
+    m->state.cont = false;
+    u64 executed = jit_recover(&m->jit, &m->state, &fault);
+    if (m->budgeted) {
+      m->budget = executed < m->budget ? m->budget - executed : 0;
+    }
+    u64 cause = fault_cause(&m->state, fault.addr);
+    if (machine_exception(m, cause, fault.addr, fault.signal)) {
+      mmu_guest_fault = NULL;
+      return kHalt;
+    }
   }
+  mmu_guest_fault = &fault;
+  ExitReason reason = machine_run(m);
+  mmu_guest_fault = NULL;
+  return reason;
+}
+
+bool machine_init(Machine* m) {
+  if (!mmu_init(&m->mmu)) return false;
+  m->state.mem_base = m->mmu.mem_base;
+  for (int fd = 0; fd < RVEMU_MACHINE_MAX_FDS; fd++) {
+    m->fds[fd] = fd < 3 ? fd : -1;
+  }
+  return true;
+}
 
-  mmu_load_elf(&m->mmu, fd);
+static void machine_free_checkpoint_fds(Machine* m) {
+  MachineFds* saved = m->checkpoint_fds;
+  if (!saved) return;
+  for (int fd = 3; fd < RVEMU_MACHINE_MAX_FDS; fd++) {
+    if (saved->fds[fd] >= 0) close(saved->fds[fd]);
+  }
+  free(saved);
+  m->checkpoint_fds = NULL;
+}
+
+void machine_destroy(Machine* m) {
+  outbuf_destroy(&m->outbuf);
+  free(m->iov);
+  machine_free_checkpoint_fds(m);
+  for (int fd = 3; fd < RVEMU_MACHINE_MAX_FDS; fd++) {
+    if (m->fds[fd] >= 0 && !vfs_owns(&m->vfs, m->fds[fd])) close(m->fds[fd]);
+    m->fds[fd] = -1;
+  }
+  vfs_destroy(&m->vfs);
+  trace_destroy(&m->trace);
+  replay_destroy(&m->replay);
+  jit_destroy(&m->jit);
+  mmu_destroy(&m->mmu);
+}
+
+// Gives host_fd the lowest free guest fd and returns it, or -EMFILE when
+// the guest has no fd left.
+int machine_add_fd(Machine* m, int host_fd) {
+  for (int fd = 3; fd < RVEMU_MACHINE_MAX_FDS; fd++) {
+    if (m->fds[fd] < 0) {
+      m->fds[fd] = host_fd;
+      return fd;
+    }
+  }
+  return -EMFILE;
+}
+
+// Returns false with errno set when prog cannot be loaded.
+bool machine_load_program(Machine* m, const char* prog) {
+  int fd = open(prog, O_RDONLY);
+  if (fd == -1) return false;
+
+  bool ok = mmu_load_elf(&m->mmu, fd);
+  int err = errno;
   close(fd);
+  errno = err;
 
   m->state.pc = (u64)m->mmu.entry;
+  return ok;
 }
 
-static inline void mmu_write(u64 addr, u8* data, size_t len) {
-  memcpy((void*)TO_HOST(addr), (void*)data, len);
+bool machine_load_image(Machine* m, const MmuImage* image) {
+  bool ok = mmu_map_image(&m->mmu, image);
+  m->state.pc = (u64)m->mmu.entry;
+  return ok;
+}
+
+static inline void mmu_write(Mmu* mmu, u64 addr, u8* data, size_t len) {
+  memcpy(mmu_host(mmu, addr), (void*)data, len);
 }
 
 void machine_setup(Machine* m, int argc, char** argv) {
   size_t stack_size = RVEMU_MACHINE_STACK_SIZE;
   u64 stack = mmu_alloc(&m->mmu, stack_size);
+  if ((i64)stack < 0) FATAL("cannot allocate the guest stack");
   m->state.xregs[XREG_SP] = stack + stack_size;
 
   m->state.xregs[XREG_SP] -= 8;  // auxv
@@ -58,11 +219,131 @@ void machine_setup(Machine* m, int argc, char** argv) {
   for (u64 i = guest_argc; i > 0; i--) {
     size_t arg_len = strlen(argv[i]);
     u64 addr = mmu_alloc(&m->mmu, arg_len + 1);
-    mmu_write(addr, (u8*)argv[i], arg_len);
+    if ((i64)addr < 0) FATAL("cannot allocate the guest arguments");
+    mmu_write(&m->mmu, addr, (u8*)argv[i], arg_len);
     m->state.xregs[XREG_SP] -= 8;
-    mmu_write(m->state.xregs[XREG_SP], (u8*)&addr, sizeof(u64));
+    mmu_write(&m->mmu, m->state.xregs[XREG_SP], (u8*)&addr, sizeof(u64));
   }
 
   m->state.xregs[XREG_SP] -= 8;  // argc
-  mmu_write(m->state.xregs[XREG_SP], (u8*)&guest_argc, sizeof(u64));
+  mmu_write(&m->mmu, m->state.xregs[XREG_SP], (u8*)&guest_argc, sizeof(u64));
+}
+
+static bool machine_checkpoint_fds(Machine* m) {
+  machine_free_checkpoint_fds(m);
+  MachineFds* saved = calloc(1, sizeof(MachineFds));
+  if (!saved) return false;
+  m->checkpoint_fds = saved;
+  for (int fd = 0; fd < RVEMU_MACHINE_MAX_FDS; fd++) {
+    saved->fds[fd] = -1;
+  }
+  for (int fd = 3; fd < RVEMU_MACHINE_MAX_FDS; fd++) {
+    int host_fd = m->fds[fd];
+    if (host_fd < 0) continue;
+    saved->fds[fd] = fcntl(host_fd, F_DUPFD_CLOEXEC, 0);
+    if (saved->fds[fd] == -1) return false;
+    if (vfs_owns(&m->vfs, host_fd)) {
+      saved->vfds[fd] = m->vfs.fds[host_fd];
+    } else {
+      saved->offsets[fd] = lseek(host_fd, 0, SEEK_CUR);
+    }
+  }
+  return true;
+}
+
+// Closes every fd the guest has and hands it back the ones it had at the
+// checkpoint, at the offsets they had then.
+static void machine_reset_fds(Machine* m) {
+  for (int fd = 3; fd < RVEMU_MACHINE_MAX_FDS; fd++) {
+    int host_fd = m->fds[fd];
+    m->fds[fd] = -1;
+    if (host_fd < 0) continue;
+    if (vfs_owns(&m->vfs, host_fd)) {
+      vfs_close(&m->vfs, host_fd);
+    } else {
+      close(host_fd);
+    }
+  }
+  vfs_reset(&m->vfs);
+
+  MachineFds* saved = m->checkpoint_fds;
+  for (int fd = 3; fd < RVEMU_MACHINE_MAX_FDS; fd++) {
+    if (saved->fds[fd] < 0) continue;
+    int host_fd = fcntl(saved->fds[fd], F_DUPFD_CLOEXEC, 0);
+    if (host_fd == -1) FATAL("cannot give the guest back its fds");
+    m->fds[fd] = host_fd;
+    if (saved->vfds[fd].file) {
+      if (host_fd >= RVEMU_VFS_MAX_FDS) {
+        FATAL("cannot give the guest back its fds");
+      }
+      m->vfs.fds[host_fd] = saved->vfds[fd];
+    } else if (saved->offsets[fd] >= 0) {
+      lseek(host_fd, saved->offsets[fd], SEEK_SET);
+    }
+  }
+}
+
+// Remembers State, the fds and the in-memory files and starts tracking
+// guest writes, so machine_reset can return here by copying back only the
+// pages written in between.
+bool machine_checkpoint(Machine* m) {
+  if (!machine_checkpoint_fds(m) || !vfs_checkpoint(&m->vfs)) return false;
+  if (!mmu_checkpoint(&m->mmu)) return false;
+  m->checkpoint = m->state;
+  return true;
+}
+
+// Output the guest wrote since the checkpoint has happened, so it is
+// flushed rather than dropped.
+void machine_reset(Machine* m) {
+  outbuf_flush(&m->outbuf);
+  mmu_reset(&m->mmu);
+  machine_reset_fds(m);
+  m->state = m->checkpoint;
+}
+
+// Ends the current fuzz run, if any, with a wait status and starts the next
+// one from the checkpoint. Returns what SYS_RVEMU_FUZZ_START hands the guest.
+u64 machine_fuzz_next(Machine* m, int status) {
+  Fuzz* fuzz = &m->fuzz;
+  if (fuzz->started) {
+    fuzz_report(fuzz, status);
+    machine_reset(m);
+  } else if (machine_checkpoint(m)) {
+    fuzz->started = true;
+  } else {
+    FATAL("cannot checkpoint the guest for fuzzing");
+  }
+
+  mmu_prepare_write(&m->mmu, fuzz->buf, fuzz->max_len);
+  i64 len =
+      fuzz_next_input(fuzz, mmu_host(&m->mmu, fuzz->buf), fuzz->max_len);
+  if (len < 0) {
+    fuzz_summary(fuzz);
+    exit(fuzz->crashes != 0);
+  }
+  return len;
+}
+
+// Copies argv[1..argc) into guest memory as a NULL-terminated pointer array
+// followed by the strings. They get a mapping of their own, since a running
+// guest's libc already owns the brk heap. Returns 0 when there is no room.
+u64 machine_alloc_argv(Machine* m, int argc, char** argv) {
+  u64 size = argc * sizeof(u64);
+  for (int i = 1; i < argc; i++) {
+    size += strlen(argv[i]) + 1;
+  }
+  u64 guest_argv = mmu_map(&m->mmu, 0, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ((i64)guest_argv < 0) return 0;
+
+  u64 addr = guest_argv + argc * sizeof(u64);
+  for (int i = 1; i < argc; i++) {
+    size_t arg_len = strlen(argv[i]) + 1;
+    mmu_write(&m->mmu, addr, (u8*)argv[i], arg_len);
+    mmu_write(&m->mmu, guest_argv + (i - 1) * sizeof(u64), (u8*)&addr,
+              sizeof(u64));
+    addr += arg_len;
+  }
+  return guest_argv;
 }
@@ -2,28 +2,106 @@
 #define RVEMU_MACHINE_H_
 
 #include <assert.h>
+#include <sys/uio.h>
 
+#include "forksrv.h"
+#include "fuzz.h"
 #include "interp.h"
+#include "jit.h"
 #include "mmu.h"
+#include "outbuf.h"
+#include "replay.h"
+#include "system.h"
+#include "trace.h"
+#include "uring.h"
+#include "vfs.h"
 
 #define RVEMU_MACHINE_STACK_SIZE (32 * 1024 * 1024)
+#define RVEMU_MACHINE_MAX_FDS 1024
 
+// The guest's fds at machine_checkpoint: a dup of each host fd, so the
+// guest closing and reopening its own cannot change what they point at.
 typedef struct {
+  int fds[RVEMU_MACHINE_MAX_FDS];  // -1 when the guest fd was closed
+  i64 offsets[RVEMU_MACHINE_MAX_FDS];
+  VfsFd vfds[RVEMU_MACHINE_MAX_FDS];  // for in-memory files
+} MachineFds;
+
+typedef struct Machine {
   State state;
   Mmu mmu;
+  OutBuf outbuf;
+  Uring* uring;          // async file I/O backend, NULL for blocking calls
+  bool syscall_pending;  // a0 is written when the uring request completes
+  bool syscall_opens;    // and is a host fd the guest gets an fd for
+  Trace trace;
+  u64 trace_seq;      // trace record of the pending syscall
+  bool coarse_clock;  // serve time syscalls from the host's coarse clocks
+  Vfs vfs;
+  Replay replay;
+  ForkServer forksrv;
+  const char* snapshot_path;  // written by the guest's SYS_RVEMU_SNAPSHOT
+  State checkpoint;           // restored by machine_reset
+  MachineFds* checkpoint_fds;
+  Fuzz fuzz;
+  bool trap_all_syscalls;  // return every ECALL from machine_step
+  bool halted;             // the guest exited with exit_code
+  int exit_code;
+  int term_signal;  // the signal a faulting process guest died of, or 0
+  bool budgeted;  // machine_step stops once budget instructions have run
+  u64 budget;
+  struct Machine* sched_next;  // parked list of the scheduler's worker
+  System* sys;                 // full-system devices, NULL in user mode
+  Jit jit;
+  struct iovec* iov;  // scratch for vectored syscalls, UIO_MAXIOV long
+  // The host fd behind each guest fd, or -1. Guest fds 0 to 2 are the
+  // stdio it was started with; the rest are files it opened itself, which
+  // the machine closes when it is destroyed.
+  int fds[RVEMU_MACHINE_MAX_FDS];
 } Machine;
 
-void machine_load_program(Machine*, const char*);
+bool machine_init(Machine*);
+
+void machine_destroy(Machine*);
+
+int machine_add_fd(Machine*, int);
+
+bool machine_load_program(Machine*, const char*);
+
+bool machine_load_image(Machine*, const MmuImage*);
 
 void machine_setup(Machine*, int, char**);
 
+u64 machine_alloc_argv(Machine*, int, char**);
+
+bool machine_checkpoint(Machine*);
+
+void machine_reset(Machine*);
+
+u64 machine_fuzz_next(Machine*, int);
+
 ExitReason machine_step(Machine*);
 
+// Lets machine_step run about n more instructions before returning
+// kBudgetExhausted. The budget is charged per block, so a step can overrun
+// it by the length of one block.
+static inline void machine_set_budget(Machine* m, u64 n) {
+  m->budgeted = true;
+  m->budget = n;
+}
+
+static inline void machine_clear_budget(Machine* m) { m->budgeted = false; }
+
 static inline u64 machine_get_xreg(Machine* m, int reg) {
   assert(reg > 0 && reg <= XREG_NUM);
   return m->state.xregs[reg];
 }
 
+// the host fd a guest fd stands for, or -1 when the guest has no such fd
+static inline int machine_host_fd(const Machine* m, u64 fd) {
+  return fd < RVEMU_MACHINE_MAX_FDS ? m->fds[fd] : -1;
+}
+
 static inline void machine_set_xreg(Machine* m, int reg, u64 reg_val) {
   assert(reg > 0 && reg <= XREG_NUM);
   m->state.xregs[reg] = reg_val;
@@ -1,25 +1,457 @@
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "interp.h"
 #include "machine.h"
 #include "reg.h"
+#include "sbi.h"
+#include "scheduler.h"
+#include "serve.h"
+#include "snapshot.h"
 #include "syscall.h"
+#include "system.h"
+#include "utils.h"
+#include "virtio_blk.h"
+#include "virtio_console.h"
 
-int main(int argc, char* argv[]) {
-  assert(argc > 1);
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [options] <program> [args...]\n"
+          "options:\n"
+          "  --huge-pages     back guest memory with transparent huge pages\n"
+          "  --prefault       populate guest memory up front\n"
+          "  --buffer-output  coalesce guest stdout/stderr writes\n"
+          "  --io-uring       issue guest file I/O through io_uring\n"
+          "  --trace FILE     record guest syscalls into a binary ring file\n"
+          "  --trace-size N   number of records kept in the ring\n"
+          "  --coarse-clock   serve guest time syscalls at tick resolution\n"
+          "  --vfs            keep guest files in memory, not on the host\n"
+          "  --vfs-preload PATH\n"
+          "                   map PATH read-only into the in-memory files\n"
+          "  --vfs-allow PREFIX\n"
+          "                   let guest paths under PREFIX reach the host\n"
+          "  --record FILE    log syscall results and guest input to FILE\n"
+          "  --replay FILE    rerun from a --record log without host I/O\n"
+          "  --fork-server SOCKET\n"
+          "                   load once, then fork a run per SOCKET request\n"
+          "  --fork-at-marker fork at the guest's marker hypercall, not entry\n"
+          "  --snapshot FILE  save the machine at the guest's checkpoint call\n"
+          "  --restore FILE   resume a saved machine instead of a program\n"
+          "  --fuzz           feed the guest inputs from afl-fuzz in-process\n"
+          "  --fuzz-corpus DIR\n"
+          "                   feed it each file in DIR instead and report\n"
+          "  --batch FILE     run each line of FILE as a guest command line,\n"
+          "                   all of them sharing a pool of worker threads\n"
+          "  --workers N      worker threads for --batch or --serve, one per\n"
+          "                   CPU if unset\n"
+          "  --serve SOCKET   stay resident and run a guest per request\n"
+          "  --system         boot <program> as a bare-metal image on a\n"
+          "                   virt-like board instead of a Linux process\n"
+          "  --ram MB         RAM of the --system board\n"
+          "  --dtb FILE       device tree handed to the --system image in a1\n"
+          "  --drive FILE     virtio-blk disk image for the --system board\n"
+          "  --sbi            start the --system image in S mode and serve\n"
+          "                   its SBI calls natively, not through firmware\n"
+          "  --jit            compile hot blocks to x86-64 code, keeping the\n"
+          "                   registers they use most in host registers\n",
+          prog);
+  exit(1);
+}
+
+static atomic_uint batch_failed;
+
+static void batch_exit(Machine* m, void* user) {
+  if (m->exit_code != 0) atomic_fetch_add(&batch_failed, 1);
+  machine_destroy(m);
+  free(m);
+}
+
+// Loads every command line of path into its own machine, configured like
+// tmpl, and runs them all on a scheduler. Returns the exit status for rvemu.
+static int run_batch(const Machine* tmpl, const char* path, u32 nr_workers) {
+  FILE* f = fopen(path, "r");
+  if (!f) FATALF("cannot open batch file %s", path);
+
+  Sched sched;
+  if (!sched_init(&sched, nr_workers, tmpl->uring != NULL, batch_exit,
+                  NULL) ||
+      !sched_start(&sched)) {
+    FATAL("cannot start the scheduler");
+  }
+
+  char* line = NULL;
+  size_t cap = 0;
+  while (getline(&line, &cap, f) != -1) {
+    // laid out like main's argv, argv[0] being the emulator
+    char* args[256] = {"rvemu"};
+    int nargs = 1;
+    char* save = NULL;
+    for (char* tok = strtok_r(line, " \t\n", &save);
+         tok && nargs < (int)SIZEOF_ARRAY(args);
+         tok = strtok_r(NULL, " \t\n", &save)) {
+      args[nargs++] = tok;
+    }
+    if (nargs == 1) continue;
+
+    Machine* m = calloc(1, sizeof(Machine));
+    if (!m || !machine_init(m)) FATAL("cannot reserve guest memory");
+    m->mmu.huge_pages = tmpl->mmu.huge_pages;
+    m->mmu.prefault = tmpl->mmu.prefault;
+    m->coarse_clock = tmpl->coarse_clock;
+    m->jit.enabled = tmpl->jit.enabled;
+    if (!machine_load_program(m, args[1])) {
+      fprintf(stderr, "cannot load %s: %s\n", args[1], strerror(errno));
+      atomic_fetch_add(&batch_failed, 1);
+      machine_destroy(m);
+      free(m);
+      continue;
+    }
+    machine_setup(m, nargs, args);
+    sched_submit(&sched, m);
+  }
+  free(line);
+  fclose(f);
 
+  sched_wait(&sched);
+  sched_stop(&sched);
+  return atomic_load(&batch_failed) != 0;
+}
+
+int main(int argc, char* argv[]) {
   Machine m = {0};
-  machine_load_program(&m, argv[1]);
-  machine_setup(&m, argc, argv);
+  if (!machine_init(&m)) {
+    FATAL("cannot reserve guest memory");
+  }
+
+  enum {
+    kOptHugePages = 256,
+    kOptPrefault,
+    kOptBufferOutput,
+    kOptIoUring,
+    kOptTrace,
+    kOptTraceSize,
+    kOptCoarseClock,
+    kOptVfs,
+    kOptVfsPreload,
+    kOptVfsAllow,
+    kOptRecord,
+    kOptReplay,
+    kOptForkServer,
+    kOptForkAtMarker,
+    kOptSnapshot,
+    kOptRestore,
+    kOptFuzz,
+    kOptFuzzCorpus,
+    kOptBatch,
+    kOptWorkers,
+    kOptServe,
+    kOptSystem,
+    kOptRam,
+    kOptDtb,
+    kOptDrive,
+    kOptSbi,
+    kOptJit,
+  };
+
+  static const struct option long_options[] = {
+      {"huge-pages", no_argument, NULL, kOptHugePages},
+      {"prefault", no_argument, NULL, kOptPrefault},
+      {"buffer-output", no_argument, NULL, kOptBufferOutput},
+      {"io-uring", no_argument, NULL, kOptIoUring},
+      {"trace", required_argument, NULL, kOptTrace},
+      {"trace-size", required_argument, NULL, kOptTraceSize},
+      {"coarse-clock", no_argument, NULL, kOptCoarseClock},
+      {"vfs", no_argument, NULL, kOptVfs},
+      {"vfs-preload", required_argument, NULL, kOptVfsPreload},
+      {"vfs-allow", required_argument, NULL, kOptVfsAllow},
+      {"record", required_argument, NULL, kOptRecord},
+      {"replay", required_argument, NULL, kOptReplay},
+      {"fork-server", required_argument, NULL, kOptForkServer},
+      {"fork-at-marker", no_argument, NULL, kOptForkAtMarker},
+      {"snapshot", required_argument, NULL, kOptSnapshot},
+      {"restore", required_argument, NULL, kOptRestore},
+      {"fuzz", no_argument, NULL, kOptFuzz},
+      {"fuzz-corpus", required_argument, NULL, kOptFuzzCorpus},
+      {"batch", required_argument, NULL, kOptBatch},
+      {"workers", required_argument, NULL, kOptWorkers},
+      {"serve", required_argument, NULL, kOptServe},
+      {"system", no_argument, NULL, kOptSystem},
+      {"ram", required_argument, NULL, kOptRam},
+      {"dtb", required_argument, NULL, kOptDtb},
+      {"drive", required_argument, NULL, kOptDrive},
+      {"sbi", no_argument, NULL, kOptSbi},
+      {"jit", no_argument, NULL, kOptJit},
+      {NULL, 0, NULL, 0},
+  };
+
+  const char* trace_path = NULL;
+  const char* restore_path = NULL;
+  bool fuzz = false;
+  const char* fuzz_corpus = NULL;
+  const char* batch_path = NULL;
+  const char* serve_path = NULL;
+  bool system = false;
+  u64 ram_size = RVEMU_SYSTEM_RAM_DEFAULT;
+  const char* dtb_path = NULL;
+  const char* drive_path = NULL;
+  bool sbi = false;
+  u32 nr_workers = 0;
+  u64 trace_size = RVEMU_TRACE_DEFAULT_RECORDS;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "+h", long_options, NULL)) != -1) {
+    switch (opt) {
+      case kOptHugePages:
+        m.mmu.huge_pages = true;
+        break;
+      case kOptPrefault:
+        m.mmu.prefault = true;
+        break;
+      case kOptBufferOutput:
+        m.outbuf.enabled = true;  // started once the guest is set up
+        break;
+      case kOptIoUring: {
+        static Uring ring;
+        if (uring_init(&ring, RVEMU_URING_ENTRIES)) {
+          m.uring = &ring;
+        } else {
+          fprintf(stderr,
+                  "warning: io_uring unavailable, using blocking I/O\n");
+        }
+        break;
+      }
+      case kOptTrace:
+        trace_path = optarg;
+        break;
+      case kOptTraceSize:
+        trace_size = strtoull(optarg, NULL, 0);
+        break;
+      case kOptCoarseClock:
+        m.coarse_clock = true;
+        break;
+      case kOptVfs:
+        m.vfs.enabled = true;
+        break;
+      case kOptVfsPreload:
+        if (!vfs_preload(&m.vfs, optarg)) {
+          FATALF("cannot preload %s", optarg);
+        }
+        break;
+      case kOptVfsAllow:
+        if (!vfs_allow(&m.vfs, optarg)) {
+          FATAL("too many --vfs-allow prefixes");
+        }
+        break;
+      case kOptRecord:
+      case kOptReplay:
+        if (!replay_open(&m.replay, optarg,
+                         opt == kOptRecord ? kReplayRecord : kReplayPlay)) {
+          FATALF("cannot open replay log %s", optarg);
+        }
+        break;
+      case kOptForkServer:
+        if (!forksrv_listen(&m.forksrv, optarg)) {
+          FATALF("cannot listen on %s: %s", optarg, strerror(errno));
+        }
+        break;
+      case kOptForkAtMarker:
+        m.forksrv.at_marker = true;
+        break;
+      case kOptSnapshot:
+        m.snapshot_path = optarg;
+        break;
+      case kOptRestore:
+        restore_path = optarg;
+        break;
+      case kOptFuzz:
+        fuzz = true;
+        break;
+      case kOptFuzzCorpus:
+        fuzz = true;
+        fuzz_corpus = optarg;
+        break;
+      case kOptBatch:
+        batch_path = optarg;
+        break;
+      case kOptServe:
+        serve_path = optarg;
+        break;
+      case kOptSystem:
+        system = true;
+        break;
+      case kOptRam:
+        ram_size = strtoull(optarg, NULL, 0) << 20;
+        if (ram_size == 0) usage(argv[0]);
+        break;
+      case kOptDtb:
+        dtb_path = optarg;
+        break;
+      case kOptDrive:
+        drive_path = optarg;
+        break;
+      case kOptSbi:
+        sbi = true;
+        break;
+      case kOptJit:
+        m.jit.enabled = true;
+        break;
+      case kOptWorkers:
+        nr_workers = strtoul(optarg, NULL, 0);
+        if (nr_workers == 0) usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if ((optind >= argc && !restore_path && !batch_path && !serve_path) ||
+      trace_size == 0) {
+    usage(argv[0]);
+  }
+
+  if (batch_path || serve_path) {
+    // these keep per-process state or files that one guest owns
+    if (m.vfs.enabled || m.replay.mode != kReplayOff || m.forksrv.enabled ||
+        m.snapshot_path || restore_path || fuzz || trace_path ||
+        m.outbuf.enabled || system || (batch_path && serve_path)) {
+      FATAL("--batch and --serve only combine with memory, clock and "
+            "io_uring options");
+    }
+    if (nr_workers == 0) nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (batch_path) exit(run_batch(&m, batch_path, nr_workers));
+
+    static Server srv;
+    if (!serve_init(&srv, serve_path, nr_workers, &m)) {
+      FATALF("cannot serve on %s: %s", serve_path, strerror(errno));
+    }
+    serve_loop(&srv);
+  }
+
+  if (system) {
+    // everything else assumes a Linux process with syscalls
+    if (m.vfs.enabled || m.replay.mode != kReplayOff || m.forksrv.enabled ||
+        m.snapshot_path || restore_path || fuzz || trace_path ||
+        m.outbuf.enabled || m.uring) {
+      FATAL("--system only combines with memory options");
+    }
+    static System sys;
+    if (!system_init(&sys, &m, ram_size)) {
+      FATAL("cannot set up the system board");
+    }
+    if (!system_load(&sys, argv[optind])) {
+      FATALF("cannot load %s: %s", argv[optind], strerror(errno));
+    }
+    if (dtb_path && !system_load_dtb(&sys, dtb_path)) {
+      FATALF("cannot load device tree %s", dtb_path);
+    }
+    if (sbi) sbi_init(&sys);
+    static VirtioBlk blk;
+    if (drive_path && !virtio_blk_init(&blk, &sys, 0, drive_path)) {
+      FATALF("cannot open drive %s: %s", drive_path, strerror(errno));
+    }
+    static VirtioConsole console;
+    if (!virtio_console_init(&console, &sys, 1, machine_host_fd(&m, 0),
+                             machine_host_fd(&m, 1))) {
+      FATAL("cannot set up the console");
+    }
+    exit(system_run(&m));
+  }
+
+  // results must be final when a syscall returns to be logged or replayed
+  if (m.replay.mode != kReplayOff && m.uring) {
+    FATAL("--io-uring cannot be combined with --record or --replay");
+  }
+  // every run would share one submission ring or one log
+  if (m.forksrv.enabled && (m.uring || m.replay.mode != kReplayOff)) {
+    FATAL("--fork-server cannot be combined with --io-uring or replay logs");
+  }
+  // a restored guest is past its entry point
+  if (restore_path && m.forksrv.enabled && !m.forksrv.at_marker) {
+    FATAL("--restore with --fork-server needs --fork-at-marker");
+  }
+
+  if (fuzz && !fuzz_init(&m.fuzz, fuzz_corpus)) {
+    FATAL(fuzz_corpus ? "cannot open the fuzz corpus"
+                      : "--fuzz needs to run under afl-fuzz");
+  }
+  if (fuzz && m.replay.mode != kReplayOff) {
+    FATAL("--fuzz cannot be combined with --record or --replay");
+  }
+  // coverage is taken at block exits, and a trace loops without any
+  if (fuzz && m.jit.enabled) {
+    FATAL("--fuzz cannot be combined with --jit");
+  }
+
+  if (trace_path && !trace_open(&m.trace, trace_path, trace_size)) {
+    FATALF("cannot create trace file %s: %s", trace_path, strerror(errno));
+  }
+
+  // the guest sees argv starting at the program path
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (restore_path) {
+    if (!snapshot_restore(&m, restore_path)) {
+      FATALF("cannot restore snapshot %s", restore_path);
+    }
+  } else {
+    if (!machine_load_program(&m, argv[1])) {
+      FATALF("cannot load %s: %s", argv[1], strerror(errno));
+    }
+    if (m.forksrv.enabled && !forksrv_set_program(&m.forksrv, argv[1])) {
+      FATALF("cannot stat %s: %s", argv[1], strerror(errno));
+    }
+    if (m.forksrv.enabled && !m.forksrv.at_marker) {
+      ForkRequest req = forksrv_serve(&m.forksrv);
+      machine_setup(&m, req.argc, req.argv);
+    } else {
+      machine_setup(&m, argc, argv);
+    }
+  }
+  // after any fork for a request, so the flusher runs in the guest's process
+  if (m.outbuf.enabled) outbuf_init(&m.outbuf);
+
+  // a crashing fuzz run only ends that run
+  static MmuFault host_fault;
+  if (m.fuzz.enabled) {
+    host_fault.mmu = &m.mmu;
+    if (sigsetjmp(host_fault.jmp, 0)) {
+      machine_set_xreg(&m, XREG_A0, machine_fuzz_next(&m, host_fault.signal));
+    }
+    mmu_host_fault = &host_fault;
+  }
 
   while (true) {
     ExitReason reason = machine_step(&m);
+    if (reason == kHalt) {
+      // the guest died of a fault, so we die as it would have natively
+      outbuf_flush(&m.outbuf);
+      signal(m.term_signal, SIG_DFL);
+      raise(m.term_signal);
+      exit(m.exit_code);
+    }
     assert(reason == kECall);
 
     u64 syscall = machine_get_xreg(&m, XREG_A7);
     u64 ret = do_syscall(&m, syscall);
-    machine_set_xreg(&m, XREG_A0, ret);
+    if (m.halted) {
+      exit(m.exit_code);
+    }
+    if (m.syscall_pending) {
+      // a single guest has nothing else to run while its request is in flight
+      do_syscall_complete(m.uring, 1);
+    } else {
+      machine_set_xreg(&m, XREG_A0, ret);
+    }
   }
 
   return 0;
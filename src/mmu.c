@@ -1,25 +1,28 @@
+// REG_RIP and the rest of the ucontext register names
+#define _GNU_SOURCE
+
 #include "mmu.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 #include "elfdef.h"
 #include "utils.h"
 
-static void load_prog_header(ElfProgHeader* elf_prog_header_p,
-                             ElfHeader* elf_header_p, i64 i, FILE* fp) {
-  if (fseek(fp, elf_header_p->e_phoff + elf_header_p->e_phentsize * i,
-            SEEK_SET) != 0) {
-    FATAL("Seek file failed");
-  }
-
-  if (fread((void*)elf_prog_header_p, 1, sizeof(ElfProgHeader), fp) !=
-      sizeof(ElfProgHeader)) {
-    FATAL("File too small");
-  }
+static bool load_prog_header(ElfProgHeader* elf_prog_header_p,
+                             ElfHeader* elf_header_p, i64 i, int fd) {
+  return pread(fd, elf_prog_header_p, sizeof(ElfProgHeader),
+               elf_header_p->e_phoff + elf_header_p->e_phentsize * i) ==
+         sizeof(ElfProgHeader);
 }
 
 static int flags_to_mmap_prot(u32 flags) {
@@ -27,14 +30,60 @@ static int flags_to_mmap_prot(u32 flags) {
          (flags & PF_X ? PROT_EXEC : 0);
 }
 
-static void mmu_load_segment(Mmu* mmu, ElfProgHeader* elf_prog_header_p,
+static int mmu_map_flags(Mmu* mmu) { return mmu->prefault ? MAP_POPULATE : 0; }
+
+static void mmu_advise(Mmu* mmu, u64 host_addr, u64 len) {
+  if (!mmu->huge_pages) return;
+  u64 start = ROUNDUP(host_addr, RVEMU_MMU_HUGE_PAGE_SIZE);
+  u64 end = ROUNDDOWN(host_addr + len, RVEMU_MMU_HUGE_PAGE_SIZE);
+  if (start < end) {
+    madvise((void*)start, end - start, MADV_HUGEPAGE);
+  }
+}
+
+// Reserves the machine's whole guest address space up front. Guest memory
+// is then only ever mapped MAP_FIXED inside it, and "unmapping" puts the
+// reservation back, so the host never places its own mappings there.
+static void mmu_catch_faults(void);
+
+bool mmu_init(Mmu* mmu) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, mmu_catch_faults);
+
+  u64 len = RVEMU_MMU_GUEST_LIMIT + RVEMU_MMU_GUARD_SIZE +
+            RVEMU_MMU_HUGE_PAGE_SIZE;
+  void* base = mmap(NULL, len, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) return false;
+  // huge pages need the same alignment on the host as in the guest
+  mmu->mem_base = ROUNDUP((u64)base, RVEMU_MMU_HUGE_PAGE_SIZE);
+  u64 head = mmu->mem_base - (u64)base;
+  if (head > 0) {
+    munmap(base, head);
+  }
+  u64 end = mmu->mem_base + RVEMU_MMU_GUEST_LIMIT + RVEMU_MMU_GUARD_SIZE;
+  munmap((void*)end, RVEMU_MMU_HUGE_PAGE_SIZE - head);
+  return true;
+}
+
+static void mmu_release(Mmu* mmu, u64 addr, u64 len) {
+  mmap(mmu_host(mmu, addr), len, PROT_NONE,
+       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+static bool mmu_load_segment(Mmu* mmu, const ElfProgHeader* elf_prog_header_p,
                              int fd) {
   int page_size = getpagesize();
+  if (elf_prog_header_p->p_vaddr >= RVEMU_MMU_GUEST_LIMIT ||
+      elf_prog_header_p->p_memsz >
+          RVEMU_MMU_GUEST_LIMIT - elf_prog_header_p->p_vaddr) {
+    return false;
+  }
 
   u64 offset = elf_prog_header_p->p_offset;
   u64 aligned_offset = ROUNDDOWN(offset, page_size);
 
-  u64 vaddr = TO_HOST(elf_prog_header_p->p_vaddr);
+  u64 vaddr = (u64)mmu_host(mmu, elf_prog_header_p->p_vaddr);
   u64 aligned_vaddr = ROUNDDOWN(vaddr, page_size);
 
   u64 filesz = elf_prog_header_p->p_filesz + (vaddr - aligned_vaddr);
@@ -43,74 +92,550 @@ static void mmu_load_segment(Mmu* mmu, ElfProgHeader* elf_prog_header_p,
   int prot = flags_to_mmap_prot(elf_prog_header_p->p_flags);
 
   u64 addr = (u64)mmap((void*)aligned_vaddr, filesz, prot,
-                       MAP_PRIVATE | MAP_FIXED, fd, aligned_offset);
-  assert(addr == aligned_vaddr);
+                       MAP_PRIVATE | MAP_FIXED | mmu_map_flags(mmu), fd,
+                       aligned_offset);
+  if (addr != aligned_vaddr) return false;
 
   u64 remaining_bss = ROUNDUP(memsz, page_size) - ROUNDUP(filesz, page_size);
   if (remaining_bss > 0) {
-    u64 addr = (u64)mmap((void*)aligned_vaddr + ROUNDUP(filesz, page_size),
-                         remaining_bss, prot,
-                         MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0);
-    assert(addr == aligned_vaddr + ROUNDUP(filesz, page_size));
+    u64 addr = (u64)mmap(
+        (void*)aligned_vaddr + ROUNDUP(filesz, page_size), remaining_bss, prot,
+        MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | mmu_map_flags(mmu), -1, 0);
+    if (addr != aligned_vaddr + ROUNDUP(filesz, page_size)) return false;
+    mmu_advise(mmu, addr, remaining_bss);
   }
 
   mmu->host_alloc =
       MAX(mmu->host_alloc, (aligned_vaddr + ROUNDUP(memsz, page_size)));
-  mmu->base = mmu->alloc = TO_GUEST(mmu->host_alloc);
+  mmu->base = mmu->alloc = TO_GUEST(mmu->mem_base, mmu->host_alloc);
+  return true;
 }
 
-void mmu_load_elf(Mmu* mmu, int fd) {
+// Returns false, with errno set, for files that are not a loadable riscv64
+// ELF. The image keeps using fd, which stays the caller's to close.
+bool mmu_open_image(MmuImage* image, int fd) {
   u8 buffer[sizeof(ElfHeader)];
-  FILE* fp = fdopen(fd, "rb");
-  if (fread(buffer, 1, sizeof(ElfHeader), fp) != sizeof(ElfHeader)) {
-    FATAL("File too small");
+  ElfHeader* elf_header_p = (ElfHeader*)buffer;
+  if (pread(fd, buffer, sizeof(ElfHeader), 0) != sizeof(ElfHeader) ||
+      *(u32*)elf_header_p != *(u32*)ELFMAG ||
+      elf_header_p->e_machine != EM_RISCV ||
+      elf_header_p->e_ident[EI_CLASS] != ELFCLASS64) {
+    errno = ENOEXEC;
+    return false;
   }
 
-  ElfHeader* elf_header_p = (ElfHeader*)buffer;
+  image->fd = fd;
+  image->entry = (u64)elf_header_p->e_entry;
+  image->num_segments = 0;
 
-  if (*(u32*)elf_header_p != *(u32*)ELFMAG) {
-    FATAL("Bad elf file");
+  ElfProgHeader elf_prog_header = {0};
+  for (i64 i = 0; i < elf_header_p->e_phnum; ++i) {
+    if (!load_prog_header(&elf_prog_header, elf_header_p, i, fd)) {
+      errno = ENOEXEC;
+      return false;
+    }
+    if (elf_prog_header.p_type != PT_LOAD) continue;
+    if (image->num_segments == RVEMU_MMU_MAX_SEGMENTS) {
+      errno = ENOEXEC;
+      return false;
+    }
+    image->segments[image->num_segments++] = elf_prog_header;
   }
+  return true;
+}
 
-  if (elf_header_p->e_machine != EM_RISCV ||
-      elf_header_p->e_ident[EI_CLASS] != ELFCLASS64) {
-    FATAL("Only riscv64 elf is supported");
+// Returns false with errno set when a segment does not fit the guest.
+bool mmu_map_image(Mmu* mmu, const MmuImage* image) {
+  mmu->entry = image->entry;
+  for (int i = 0; i < image->num_segments; i++) {
+    if (!mmu_load_segment(mmu, &image->segments[i], image->fd)) {
+      errno = ENOMEM;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool mmu_load_elf(Mmu* mmu, int fd) {
+  MmuImage image;
+  return mmu_open_image(&image, fd) && mmu_map_image(mmu, &image);
+}
+
+static int mmu_find_region(const MmuDirty* dirty, u64 addr) {
+  int lo = 0, hi = dirty->num_regions;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    const MmuRegion* r = &dirty->regions[mid];
+    if (addr < r->addr) {
+      hi = mid;
+    } else if (addr >= r->addr + r->len) {
+      lo = mid + 1;
+    } else {
+      return mid;
+    }
   }
+  return -1;
+}
 
-  mmu->entry = (u64)elf_header_p->e_entry;
+// Copies a checkpoint page into its slot before its first change and leaves
+// it writable. Returns false for pages outside the checkpoint, or already
+// saved, or (with writable_only) not writable at the checkpoint.
+static bool mmu_save_page(Mmu* mmu, u64 addr, bool writable_only) {
+  MmuDirty* dirty = &mmu->dirty;
+  int page_size = getpagesize();
+  addr = ROUNDDOWN(addr, page_size);
 
-  ElfProgHeader elf_prog_header = {0};
-  for (i64 i = 0; i < elf_header_p->e_phnum; ++i) {
-    load_prog_header(&elf_prog_header, elf_header_p, i, fp);
-    if (elf_prog_header.p_type == PT_LOAD) {
-      mmu_load_segment(mmu, &elf_prog_header, fd);
+  int i = mmu_find_region(dirty, addr);
+  if (i < 0) return false;
+  const MmuRegion* r = &dirty->regions[i];
+  if (writable_only && !(r->prot & PROT_WRITE)) return false;
+  u64 slot = dirty->first_slot[i] + (addr - r->addr) / page_size;
+  if (dirty->is_dirty[slot]) return false;
+
+  mprotect(mmu_host(mmu, addr), page_size, r->prot | PROT_READ);
+  memcpy(dirty->saved + slot * page_size, mmu_host(mmu, addr), page_size);
+  dirty->is_dirty[slot] = true;
+  dirty->dirty[dirty->num_dirty++] = addr;
+  return true;
+}
+
+_Thread_local MmuFault* mmu_guest_fault;
+_Thread_local MmuFault* mmu_host_fault;
+static struct sigaction host_action[NSIG];  // what we took over
+
+static void mmu_fault_context(MmuFault* fault, const ucontext_t* uc) {
+#if defined(__x86_64__)
+  static const int gregs[16] = {
+      REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+      REG_R8,  REG_R9,  REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+  };
+  fault->host_pc = uc->uc_mcontext.gregs[REG_RIP];
+  for (int i = 0; i < 16; i++) {
+    fault->host_regs[i] = uc->uc_mcontext.gregs[gregs[i]];
+  }
+#endif
+}
+
+static void mmu_fault_handler(int sig, siginfo_t* info, void* ucontext) {
+  u64 host_addr = (u64)info->si_addr;
+  MmuFault* fault = mmu_guest_fault ? mmu_guest_fault : mmu_host_fault;
+  Mmu* mmu = fault ? fault->mmu : NULL;
+  bool in_window = mmu && host_addr - mmu->mem_base <
+                              RVEMU_MMU_GUEST_LIMIT + RVEMU_MMU_GUARD_SIZE;
+  if (sig == SIGSEGV && in_window && mmu->dirty.active &&
+      mmu_save_page(mmu, TO_GUEST(mmu->mem_base, host_addr), true)) {
+    return;  // the faulting store is retried on the now writable page
+  }
+  if (in_window) {
+    // the address as wrapped into the window by TO_HOST
+    fault->addr = TO_GUEST(mmu->mem_base, host_addr);
+    fault->signal = sig;
+    mmu_fault_context(fault, ucontext);
+    siglongjmp(fault->jmp, 1);
+  }
+
+  // not the guest's, so it goes to whatever handled it before us
+  const struct sigaction* host = &host_action[sig];
+  if (host->sa_flags & SA_SIGINFO) {
+    host->sa_sigaction(sig, info, ucontext);
+  } else if (host->sa_handler != SIG_DFL && host->sa_handler != SIG_IGN) {
+    host->sa_handler(sig);
+  } else {
+    // the retried access kills the process, so nothing is lost for good
+    signal(sig, SIG_DFL);
+  }
+}
+
+// Takes over SIGSEGV and SIGBUS for guest faults and dirty tracking. There
+// is no blocking, as the handler either returns or leaves for good.
+static void mmu_catch_faults(void) {
+  struct sigaction sa = {.sa_sigaction = mmu_fault_handler,
+                         .sa_flags = SA_SIGINFO | SA_NODEFER};
+  sigaction(SIGSEGV, &sa, &host_action[SIGSEGV]);
+  sigaction(SIGBUS, &sa, &host_action[SIGBUS]);
+}
+
+// Saves every checkpoint page in a range the guest is about to unmap or map
+// over, so a reset can put the range back.
+static void mmu_replace(Mmu* mmu, u64 addr, u64 len) {
+  MmuDirty* dirty = &mmu->dirty;
+  if (!dirty->active) return;
+
+  int page_size = getpagesize();
+  for (int i = 0; i < dirty->num_regions; i++) {
+    const MmuRegion* r = &dirty->regions[i];
+    u64 start = MAX(addr, r->addr);
+    u64 end = MIN(addr + len, r->addr + r->len);
+    if (start >= end) continue;
+
+    for (u64 page = start; page < end; page += page_size) {
+      mmu_save_page(mmu, page, false);
+    }
+    dirty->replaced = realloc(dirty->replaced, (dirty->num_replaced + 1) *
+                                                   sizeof(MmuRegion));
+    dirty->replaced[dirty->num_replaced++] = (MmuRegion){start, end - start};
+  }
+}
+
+// unmaps whatever part of [start, end) was not mapped at the checkpoint
+static void mmu_unmap_new(Mmu* mmu, u64 start, u64 end) {
+  const MmuDirty* dirty = &mmu->dirty;
+  for (int i = 0; i < dirty->num_regions && start < end; i++) {
+    const MmuRegion* r = &dirty->regions[i];
+    if (r->addr + r->len <= start) continue;
+    if (r->addr > start) {
+      mmu_release(mmu, start, MIN(r->addr, end) - start);
+    }
+    start = r->addr + r->len;
+  }
+  if (start < end) {
+    mmu_release(mmu, start, end - start);
+  }
+}
+
+// the mmu's buffer for mmu_regions, allocated on first use
+static MmuRegion* mmu_scratch(Mmu* mmu) {
+  if (!mmu->scratch) {
+    mmu->scratch = malloc(RVEMU_MMU_MAX_REGIONS * sizeof(MmuRegion));
+  }
+  return mmu->scratch;
+}
+
+static void mmu_dirty_free(Mmu* mmu) {
+  MmuDirty* dirty = &mmu->dirty;
+  if (!dirty->active) return;
+  munmap(dirty->saved, dirty->first_slot[dirty->num_regions] * getpagesize());
+  for (int i = 0; i < dirty->num_regions; i++) {
+    if (dirty->fds[i] != -1) close(dirty->fds[i]);
+  }
+  free(dirty->fds);
+  free(dirty->regions);
+  free(dirty->first_slot);
+  free(dirty->is_dirty);
+  free(dirty->dirty);
+  free(dirty->replaced);
+  dirty->active = false;
+}
+
+// Opens the file behind each file-backed checkpoint region, so a reset can
+// map a range the guest replaced from it again. A file that cannot be
+// opened any more leaves its region to be put back as anonymous memory.
+static void mmu_open_backing(Mmu* mmu) {
+  MmuDirty* dirty = &mmu->dirty;
+  for (int i = 0; i < dirty->num_regions; i++) {
+    dirty->fds[i] = -1;
+  }
+  FILE* fp = fopen("/proc/self/maps", "r");
+  if (!fp) return;
+
+  char line[PATH_MAX + 128];
+  while (fgets(line, sizeof(line), fp)) {
+    u64 start;
+    int path_at = 0;
+    if (sscanf(line, "%lx-%*x %*s %*x %*s %*u %n", &start, &path_at) != 1 ||
+        path_at == 0 || line[path_at] != '/') {
+      continue;
+    }
+    int i = mmu_find_region(dirty, TO_GUEST(mmu->mem_base, start));
+    if (i < 0 || dirty->regions[i].anonymous ||
+        start != (u64)mmu_host(mmu, dirty->regions[i].addr)) {
+      continue;
     }
+    line[strcspn(line, "\n")] = '\0';
+    const MmuRegion* r = &dirty->regions[i];
+    bool rw = r->shared && (r->prot & PROT_WRITE);
+    dirty->fds[i] = open(line + path_at, (rw ? O_RDWR : O_RDONLY) | O_CLOEXEC);
   }
+  fclose(fp);
 }
 
+bool mmu_checkpoint(Mmu* mmu) {
+  MmuRegion* regions = mmu_scratch(mmu);
+  int n = regions ? mmu_regions(mmu, regions, RVEMU_MMU_MAX_REGIONS) : -1;
+  if (n < 0) return false;
+
+  MmuDirty* dirty = &mmu->dirty;
+  int page_size = getpagesize();
+  mmu_dirty_free(mmu);
+
+  *dirty = (MmuDirty){
+      .regions = malloc(n * sizeof(MmuRegion)),
+      .first_slot = malloc((n + 1) * sizeof(u64)),
+      .fds = malloc(n * sizeof(int)),
+      .num_regions = n,
+      .alloc = mmu->alloc,
+      .host_alloc = mmu->host_alloc,
+  };
+  memcpy(dirty->regions, regions, n * sizeof(MmuRegion));
+  u64 slots = 0;
+  for (int i = 0; i < n; i++) {
+    dirty->first_slot[i] = slots;
+    slots += regions[i].len / page_size;
+  }
+  dirty->first_slot[n] = slots;
+  mmu_open_backing(mmu);
+
+  // the arena is only address space until pages are actually saved
+  dirty->saved = mmap(NULL, slots * page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  dirty->is_dirty = calloc(slots, 1);
+  dirty->dirty = malloc(slots * sizeof(u64));
+  if (dirty->saved == MAP_FAILED) {
+    FATAL("cannot reserve checkpoint pages");
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (regions[i].prot & PROT_WRITE) {
+      mprotect(mmu_host(mmu, regions[i].addr), regions[i].len,
+               regions[i].prot & ~PROT_WRITE);
+    }
+  }
+  dirty->active = true;
+  return true;
+}
+
+// Puts the guest address space back as it was at mmu_checkpoint: mappings
+// made since are dropped, replaced ranges remapped with the protection and
+// file they had, and dirty pages copied back and write-protected again.
+void mmu_reset(Mmu* mmu) {
+  MmuDirty* dirty = &mmu->dirty;
+  assert(dirty->active);
+  int page_size = getpagesize();
+
+  // allocated by mmu_checkpoint already
+  MmuRegion* current = mmu->scratch;
+  int n = mmu_regions(mmu, current, RVEMU_MMU_MAX_REGIONS);
+  for (int i = 0; i < n; i++) {
+    mmu_unmap_new(mmu, current[i].addr, current[i].addr + current[i].len);
+  }
+
+  for (int k = 0; k < dirty->num_replaced; k++) {
+    const MmuRegion* replaced = &dirty->replaced[k];
+    int i = mmu_find_region(dirty, replaced->addr);
+    const MmuRegion* r = &dirty->regions[i];
+    int fd = dirty->fds[i];
+    int flags = MAP_FIXED | (fd != -1 && r->shared ? MAP_SHARED : MAP_PRIVATE);
+    if (fd == -1) flags |= MAP_ANONYMOUS;
+    u64 offset = fd == -1 ? 0 : r->offset + (replaced->addr - r->addr);
+    // writes stay tracked, and the saved pages are copied back below
+    mmap(mmu_host(mmu, replaced->addr), replaced->len,
+         r->prot & ~PROT_WRITE, flags, fd, offset);
+  }
+  dirty->num_replaced = 0;
+
+  for (u64 k = 0; k < dirty->num_dirty; k++) {
+    u64 addr = dirty->dirty[k];
+    int i = mmu_find_region(dirty, addr);
+    const MmuRegion* r = &dirty->regions[i];
+    u64 slot = dirty->first_slot[i] + (addr - r->addr) / page_size;
+
+    void* page = mmu_host(mmu, addr);
+    mprotect(page, page_size, r->prot | PROT_READ | PROT_WRITE);
+    memcpy(page, dirty->saved + slot * page_size, page_size);
+    mprotect(page, page_size, r->prot & ~PROT_WRITE);
+    dirty->is_dirty[slot] = false;
+  }
+  dirty->num_dirty = 0;
+
+  mmu->alloc = dirty->alloc;
+  mmu->host_alloc = dirty->host_alloc;
+}
+
+// The host kernel cannot take a write fault for us, so buffers a syscall
+// fills are saved and unprotected before it runs.
+void mmu_prepare_write(Mmu* mmu, u64 addr, u64 len) {
+  if (!mmu->dirty.active || len == 0) return;
+  int page_size = getpagesize();
+  for (u64 page = ROUNDDOWN(addr, page_size); page < addr + len;
+       page += page_size) {
+    mmu_save_page(mmu, page, true);
+  }
+}
+
+// Copies len bytes to guest addr, or returns false, with whatever part
+// fitted written, when the range is not mapped writable. The fault that
+// tells is caught here, so good pointers need no check up front.
+bool mmu_copy_to_guest(Mmu* mmu, u64 addr, const void* src, u64 len) {
+  MmuFault fault = {.mmu = mmu};
+  MmuFault* armed = mmu_guest_fault;
+  if (sigsetjmp(fault.jmp, 0)) {
+    mmu_guest_fault = armed;
+    return false;
+  }
+  mmu_guest_fault = &fault;
+  memcpy(mmu_host(mmu, addr), src, len);
+  mmu_guest_fault = armed;
+  return true;
+}
+
+// Moves the break by size and returns the old one, or (u64)-ENOMEM with
+// the break left where it was when the heap cannot go there.
 u64 mmu_alloc(Mmu* mmu, i64 size) {
   int page_size = getpagesize();
   u64 base = mmu->alloc;
   assert(base >= mmu->base);
+  if (size < 0 ? (u64)-size > base - mmu->base
+               : (u64)size > RVEMU_MMU_MMAP_BASE - base) {
+    return (u64)-ENOMEM;
+  }
 
-  mmu->alloc += size;
-  assert(mmu->alloc >= mmu->base);
-
-  if (size > 0 && mmu->alloc > TO_GUEST(mmu->host_alloc)) {
-    if (mmap((void*)mmu->host_alloc, ROUNDUP(size, page_size),
-             PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1,
+  if (size > 0 && base + size > TO_GUEST(mmu->mem_base, mmu->host_alloc)) {
+    // with THP, grow in whole huge pages so each extension can be backed by
+    // 2M pages instead of faulting in 4K at a time
+    u64 len = ROUNDUP(size, mmu->huge_pages ? RVEMU_MMU_HUGE_PAGE_SIZE
+                                            : page_size);
+    if (TO_GUEST(mmu->mem_base, mmu->host_alloc) + len >
+            RVEMU_MMU_MMAP_BASE ||
+        mmap((void*)mmu->host_alloc, len, PROT_READ | PROT_WRITE,
+             MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | mmu_map_flags(mmu), -1,
              0) == MAP_FAILED) {
-      FATAL("mmap failed");
-    }
-    mmu->host_alloc += ROUNDUP(size, page_size);
-  } else if (size < 0 &&
-             ROUNDUP(mmu->alloc, page_size) < TO_GUEST(mmu->host_alloc)) {
-    u64 len = TO_GUEST(mmu->host_alloc) - ROUNDUP(mmu->alloc, page_size);
-    if (munmap((void*)ROUNDUP(mmu->alloc, page_size), len) == -1) {
-      FATAL(strerror(errno));
+      return (u64)-ENOMEM;
     }
+    mmu_advise(mmu, mmu->host_alloc, len);
+    mmu->host_alloc += len;
+  }
+  mmu->alloc += size;
+  if (size < 0 && ROUNDUP(mmu->alloc, page_size) <
+                             TO_GUEST(mmu->mem_base, mmu->host_alloc)) {
+    u64 start = ROUNDUP(mmu->alloc, page_size);
+    u64 len = TO_GUEST(mmu->mem_base, mmu->host_alloc) - start;
+    mmu_replace(mmu, start, len);
+    mmu_release(mmu, start, len);
     mmu->host_alloc -= len;
   }
 
   return base;
 }
+
+// The lowest free range of len at or above RVEMU_MMU_MMAP_BASE, so ranges
+// the guest unmapped are used again, or 0 when there is none.
+static u64 mmu_find_free(Mmu* mmu, u64 len) {
+  MmuRegion* regions = mmu_scratch(mmu);
+  int n = regions ? mmu_regions(mmu, regions, RVEMU_MMU_MAX_REGIONS) : -1;
+  if (n < 0) return 0;
+  u64 addr = RVEMU_MMU_MMAP_BASE;
+  for (int i = 0; i < n && regions[i].addr < addr + len; i++) {
+    addr = MAX(addr, regions[i].addr + regions[i].len);
+  }
+  return len <= RVEMU_MMU_GUEST_LIMIT - addr ? addr : 0;
+}
+
+// whether any guest mapping overlaps [addr, addr + len)
+static bool mmu_mapped(Mmu* mmu, u64 addr, u64 len) {
+  MmuRegion* regions = mmu_scratch(mmu);
+  int n = regions ? mmu_regions(mmu, regions, RVEMU_MMU_MAX_REGIONS) : -1;
+  bool mapped = n < 0;  // taken, when it cannot be told
+  for (int i = 0; i < n && !mapped; i++) {
+    mapped = regions[i].addr < addr + len &&
+             addr < regions[i].addr + regions[i].len;
+  }
+  return mapped;
+}
+
+u64 mmu_map(Mmu* mmu, u64 addr, u64 len, int prot, int flags, int fd,
+            u64 offset) {
+  int page_size = getpagesize();
+  if (len == 0 || offset % page_size != 0) {
+    return (u64)-EINVAL;
+  }
+  if (len > RVEMU_MMU_GUEST_LIMIT) {
+    return (u64)-ENOMEM;
+  }
+  len = ROUNDUP(len, page_size);
+
+  // like segments, file-backed regions are mapped straight from the host fd
+  // into the guest range, so guest accesses hit the page cache with no copy
+  bool fixed = flags & (MAP_FIXED | MAP_FIXED_NOREPLACE);
+  if (fixed) {
+    if (addr % page_size != 0) {
+      return (u64)-EINVAL;
+    }
+    if (addr >= RVEMU_MMU_GUEST_LIMIT || len > RVEMU_MMU_GUEST_LIMIT - addr) {
+      return (u64)-ENOMEM;
+    }
+    // the host sees the whole window as mapped, so this is our check
+    if ((flags & MAP_FIXED_NOREPLACE) && mmu_mapped(mmu, addr, len)) {
+      return (u64)-EEXIST;
+    }
+    mmu_replace(mmu, addr, len);
+  } else {
+    addr = mmu_find_free(mmu, len);
+    if (addr == 0) {
+      return (u64)-ENOMEM;
+    }
+  }
+
+  flags = (flags & ~MAP_FIXED_NOREPLACE) | MAP_FIXED | mmu_map_flags(mmu);
+  u64 host_addr = (u64)mmap(mmu_host(mmu, addr), len, prot, flags, fd, offset);
+  if (host_addr == (u64)MAP_FAILED) {
+    return (u64)-errno;
+  }
+
+  if (flags & MAP_ANONYMOUS) {
+    mmu_advise(mmu, host_addr, len);
+  }
+
+  return addr;
+}
+
+// Lists the guest's mappings in address order, as the host kernel sees them,
+// so regions created by segments, mmu_alloc and mmu_map are all covered.
+int mmu_regions(Mmu* mmu, MmuRegion* regions, int max) {
+  FILE* fp = fopen("/proc/self/maps", "r");
+  if (!fp) return -1;
+
+  int n = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), fp)) {
+    u64 start, end, offset, inode;
+    char perms[5];
+    if (sscanf(line, "%lx-%lx %4s %lx %*s %lu", &start, &end, perms, &offset,
+               &inode) != 5) {
+      continue;
+    }
+    // the bare reservation reads as unmapped to the guest
+    bool reserved = perms[0] == '-' && perms[1] == '-' && perms[2] == '-' &&
+                    inode == 0;
+    if (start < mmu->mem_base ||
+        end > mmu->mem_base + RVEMU_MMU_GUEST_LIMIT || reserved) {
+      continue;
+    }
+    if (n == max) {
+      n = -1;
+      break;
+    }
+    regions[n++] = (MmuRegion){
+        .addr = TO_GUEST(mmu->mem_base, start),
+        .len = end - start,
+        .prot = (perms[0] == 'r' ? PROT_READ : 0) |
+                (perms[1] == 'w' ? PROT_WRITE : 0) |
+                (perms[2] == 'x' ? PROT_EXEC : 0),
+        .anonymous = inode == 0,
+        .shared = perms[3] == 's',
+        .offset = offset,
+    };
+  }
+  fclose(fp);
+  return n;
+}
+
+int mmu_unmap(Mmu* mmu, u64 addr, u64 len) {
+  int page_size = getpagesize();
+  if (addr % page_size != 0 || len == 0 || len > RVEMU_MMU_GUEST_LIMIT) {
+    return -EINVAL;
+  }
+  len = ROUNDUP(len, page_size);
+  if (addr >= RVEMU_MMU_GUEST_LIMIT || len > RVEMU_MMU_GUEST_LIMIT - addr) {
+    return -EINVAL;
+  }
+  mmu_replace(mmu, addr, len);
+  mmu_release(mmu, addr, len);
+  return 0;
+}
+
+void mmu_destroy(Mmu* mmu) {
+  mmu_dirty_free(mmu);
+  free(mmu->scratch);
+  munmap((void*)mmu->mem_base,
+         RVEMU_MMU_GUEST_LIMIT + RVEMU_MMU_GUARD_SIZE);
+}
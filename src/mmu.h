@@ -1,17 +1,124 @@
 #ifndef RVEMU_MMU_H_
 #define RVEMU_MMU_H_
 
+#include <setjmp.h>
+#include <stdbool.h>
+
+#include "elfdef.h"
 #include "types.h"
+#include "utils.h"
+
+#define RVEMU_MMU_MMAP_BASE 0x0000000400000000ULL
+#define RVEMU_MMU_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// size of each machine's guest address space; small enough that thousands
+// of machines fit in one host process
+#define RVEMU_MMU_GUEST_LIMIT (1ULL << 35)
+// PROT_NONE after the window, for accesses that start inside and run off it
+#define RVEMU_MMU_GUARD_SIZE RVEMU_MMU_HUGE_PAGE_SIZE
+#define RVEMU_MMU_MAX_REGIONS 4096
+#define RVEMU_MMU_MAX_SEGMENTS 16
+
+typedef struct {
+  u64 addr;
+  u64 len;
+  int prot;
+  bool anonymous;
+  bool shared;
+  u64 offset;  // into the file behind it
+} MmuRegion;
+
+// Guest pages written since mmu_checkpoint. Writable pages start out
+// write-protected; the first write faults, copies the page into its slot of
+// saved and unprotects it, so a reset only copies back what was touched.
+typedef struct {
+  bool active;
+  MmuRegion* regions;  // every mapping at the checkpoint, in address order
+  u64* first_slot;     // slot of each region's first page
+  int* fds;            // of each region's file, or -1 when it has none
+  int num_regions;
+  u8* saved;     // a page per slot
+  u8* is_dirty;  // per slot
+  u64* dirty;    // guest addresses of dirty pages, in the order saved
+  u64 num_dirty;
+  MmuRegion* replaced;  // checkpoint ranges unmapped or mapped over since
+  int num_replaced;
+  u64 alloc;
+  u64 host_alloc;
+} MmuDirty;
+
+// A parsed ELF, kept with its open fd so it can be mapped into any number
+// of machines without reading its headers again.
+typedef struct {
+  int fd;
+  u64 entry;
+  int num_segments;
+  ElfProgHeader segments[RVEMU_MMU_MAX_SEGMENTS];  // the PT_LOAD ones
+} MmuImage;
 
 typedef struct {
+  u64 mem_base;  // host address of guest address 0
   u64 entry;
   u64 host_alloc;
   u64 alloc;
   u64 base;
+  bool huge_pages;  // back anonymous guest memory with THP
+  bool prefault;    // populate guest mappings up front
+  MmuDirty dirty;
+  MmuRegion* scratch;  // RVEMU_MMU_MAX_REGIONS long, for mmu_regions
 } Mmu;
 
-void mmu_load_elf(Mmu*, int);
+bool mmu_init(Mmu*);
+
+void mmu_destroy(Mmu*);
+
+bool mmu_load_elf(Mmu*, int);
+
+bool mmu_open_image(MmuImage*, int);
+
+bool mmu_map_image(Mmu*, const MmuImage*);
 
 u64 mmu_alloc(Mmu*, i64);
 
+u64 mmu_map(Mmu*, u64, u64, int, int, int, u64);
+
+int mmu_unmap(Mmu*, u64, u64);
+
+int mmu_regions(Mmu*, MmuRegion*, int);
+
+static inline void* mmu_host(const Mmu* mmu, u64 addr) {
+  return (void*)TO_HOST(mmu->mem_base, addr);
+}
+
+// A SIGSEGV or SIGBUS taken while this thread runs guest code. Writes to
+// pages of the guest's checkpoint only need tracking and are retried. For
+// any other fault the handler fills in addr and signal and jumps back to
+// jmp, and since interpreted instructions only move state.pc on once they
+// are done, state.pc is still the faulting instruction. Jitted code is
+// found out from host_pc and the host registers at the fault instead, see
+// jit_recover.
+typedef struct {
+  sigjmp_buf jmp;
+  Mmu* mmu;  // of the guest running
+  u64 addr;  // guest address of the access
+  int signal;
+  u64 host_pc;
+  u64 host_regs[16];  // in x86-64 encoding order, rax to r15
+} MmuFault;
+
+// set by machine_step for the guest this thread is running, NULL otherwise
+extern _Thread_local MmuFault* mmu_guest_fault;
+
+// where a fault on guest memory outside guest code resumes, such as one on
+// a bad pointer a fuzzed guest passed to a syscall; other host faults, and
+// all of them while this is NULL, are left to the host
+extern _Thread_local MmuFault* mmu_host_fault;
+
+bool mmu_checkpoint(Mmu*);
+
+void mmu_reset(Mmu*);
+
+void mmu_prepare_write(Mmu*, u64, u64);
+
+bool mmu_copy_to_guest(Mmu*, u64, const void*, u64);
+
 #endif  // RVEMU_MMU_H_
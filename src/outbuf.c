@@ -0,0 +1,146 @@
+#include "outbuf.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+static void outbuf_flush_locked(OutBuf* ob) {
+  size_t done = 0;
+  while (done < ob->len) {
+    ssize_t n = write(ob->fd, ob->data + done, ob->len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;  // nobody left to report the error to
+    done += n;
+  }
+  ob->len = 0;
+}
+
+// flushes whatever has been pending for RVEMU_OUTBUF_FLUSH_MS, so a guest
+// that prints and then computes for a long time is not left silent
+static void* outbuf_flusher(void* arg) {
+  OutBuf* ob = (OutBuf*)arg;
+  pthread_mutex_lock(&ob->lock);
+  while (!ob->stopping) {
+    while (ob->len == 0 && !ob->stopping) {
+      pthread_cond_wait(&ob->cond, &ob->lock);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += RVEMU_OUTBUF_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    int err = 0;
+    while (ob->len > 0 && err != ETIMEDOUT && !ob->stopping) {
+      err = pthread_cond_timedwait(&ob->cond, &ob->lock, &deadline);
+    }
+    outbuf_flush_locked(ob);
+  }
+  pthread_mutex_unlock(&ob->lock);
+  return NULL;
+}
+
+static void outbuf_start(OutBuf* ob) {
+  if (pthread_create(&ob->flusher, NULL, outbuf_flusher, ob) != 0) {
+    FATAL("failed to start output flusher");
+  }
+}
+
+// A fork copies only the calling thread, so the child of a fork server gets
+// an unlocked buffer and a flusher of its own.
+static OutBuf* forked_outbuf;
+
+static void outbuf_prepare_fork(void) {
+  if (forked_outbuf) pthread_mutex_lock(&forked_outbuf->lock);
+}
+
+static void outbuf_parent_fork(void) {
+  if (forked_outbuf) pthread_mutex_unlock(&forked_outbuf->lock);
+}
+
+static void outbuf_child_fork(void) {
+  if (!forked_outbuf) return;
+  pthread_mutex_unlock(&forked_outbuf->lock);
+  outbuf_start(forked_outbuf);
+}
+
+static void outbuf_register_fork(void) {
+  pthread_atfork(outbuf_prepare_fork, outbuf_parent_fork, outbuf_child_fork);
+}
+
+void outbuf_init(OutBuf* ob) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ob->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&ob->lock, NULL);
+
+  ob->len = 0;
+  ob->stopping = false;
+  ob->enabled = true;
+  outbuf_start(ob);
+
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, outbuf_register_fork);
+  if (!forked_outbuf) forked_outbuf = ob;
+}
+
+i64 outbuf_writev(OutBuf* ob, int fd, const struct iovec* iov, int iovcnt) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  pthread_mutex_lock(&ob->lock);
+  if (ob->len > 0 && (ob->fd != fd || ob->len + total > RVEMU_OUTBUF_SIZE)) {
+    outbuf_flush_locked(ob);
+  }
+
+  if (total > RVEMU_OUTBUF_SIZE) {
+    pthread_mutex_unlock(&ob->lock);
+    ssize_t n = writev(fd, iov, iovcnt);
+    return n < 0 ? -errno : n;
+  }
+
+  if (ob->len == 0) {
+    pthread_cond_signal(&ob->cond);
+  }
+  ob->fd = fd;
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(ob->data + ob->len, iov[i].iov_base, iov[i].iov_len);
+    ob->len += iov[i].iov_len;
+  }
+  pthread_mutex_unlock(&ob->lock);
+  return total;
+}
+
+void outbuf_flush(OutBuf* ob) {
+  if (!ob->enabled) return;
+  pthread_mutex_lock(&ob->lock);
+  if (ob->len > 0) {
+    outbuf_flush_locked(ob);
+  }
+  pthread_mutex_unlock(&ob->lock);
+}
+
+// Stops and joins the flusher, then writes out whatever is still pending.
+void outbuf_destroy(OutBuf* ob) {
+  if (!ob->enabled) return;
+  pthread_mutex_lock(&ob->lock);
+  ob->stopping = true;
+  pthread_cond_signal(&ob->cond);
+  pthread_mutex_unlock(&ob->lock);
+  pthread_join(ob->flusher, NULL);
+
+  outbuf_flush_locked(ob);
+  if (forked_outbuf == ob) forked_outbuf = NULL;
+  pthread_cond_destroy(&ob->cond);
+  pthread_mutex_destroy(&ob->lock);
+  ob->enabled = false;
+}
@@ -0,0 +1,40 @@
+#ifndef RVEMU_OUTBUF_H_
+#define RVEMU_OUTBUF_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "types.h"
+
+#define RVEMU_OUTBUF_SIZE (64 * 1024)
+#define RVEMU_OUTBUF_FLUSH_MS 50
+
+// Coalesces guest writes to stdout/stderr into one host write. Pending bytes
+// always belong to a single fd, so switching between fd 1 and fd 2 flushes
+// first and the relative order of the two streams is preserved.
+typedef struct {
+  bool enabled;
+  bool stopping;  // tells the flusher to exit
+  int fd;
+  size_t len;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t flusher;
+  u8 data[RVEMU_OUTBUF_SIZE];
+} OutBuf;
+
+void outbuf_init(OutBuf*);
+
+i64 outbuf_writev(OutBuf*, int, const struct iovec*, int);
+
+void outbuf_flush(OutBuf*);
+
+void outbuf_destroy(OutBuf*);
+
+static inline bool outbuf_owns(const OutBuf* ob, int fd) {
+  return ob->enabled && (fd == 1 || fd == 2);
+}
+
+#endif  // RVEMU_OUTBUF_H_
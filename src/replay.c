@@ -0,0 +1,193 @@
+#include "replay.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "syscall.h"
+#include "utils.h"
+
+typedef enum {
+  kOutNone,
+  kOutFixed,  // size bytes at the pointer in arg
+  kOutRet,    // ret bytes at the pointer in arg
+  kOutIov,    // ret bytes spread over the iovec array in arg
+  kOutMmap,   // the contents of a file-backed mapping at ret
+} ReplayOutputKind;
+
+typedef struct {
+  ReplayOutputKind kind;
+  int arg;
+  u64 size;
+} ReplayOutput;
+
+// Guest memory each syscall may write, which is what a replay has to put
+// back. Calls missing here only return a value.
+static const ReplayOutput replay_outputs[][2] = {
+    [SYS_READ] = {{kOutRet, 1}},
+    [SYS_PREAD] = {{kOutRet, 1}},
+    [SYS_READV] = {{kOutIov, 1}},
+    [SYS_PREADV] = {{kOutIov, 1}},
+    [SYS_FSTAT] = {{kOutFixed, 1, 128}},
+    [SYS_CLOCK_GETTIME] = {{kOutFixed, 1, 16}},
+    [SYS_CLOCK_GETRES] = {{kOutFixed, 1, 16}},
+    [SYS_GETTIMEOFDAY] = {{kOutFixed, 0, 16}, {kOutFixed, 1, 8}},
+    [SYS_TIMES] = {{kOutFixed, 0, 32}},
+    [SYS_MMAP] = {{kOutMmap}},
+};
+
+bool replay_open(Replay* replay, const char* path, ReplayMode mode) {
+  replay->fp = fopen(path, mode == kReplayRecord ? "wb" : "rb");
+  if (!replay->fp) return false;
+  setvbuf(replay->fp, NULL, _IOFBF, 1 << 20);
+
+  u64 magic = RVEMU_REPLAY_MAGIC;
+  if (mode == kReplayRecord) {
+    fwrite(&magic, sizeof(magic), 1, replay->fp);
+  } else if (fread(&magic, sizeof(magic), 1, replay->fp) != 1 ||
+             magic != RVEMU_REPLAY_MAGIC) {
+    fclose(replay->fp);
+    replay->fp = NULL;
+    return false;
+  }
+  replay->mode = mode;
+  return true;
+}
+
+// These only change emulator state or print the guest's output, so a replay
+// runs them for real and their logged result becomes a check.
+bool replay_reexecutes(u64 nr, const u64* args) {
+  switch (nr) {
+    case SYS_BRK:
+    case SYS_MUNMAP:
+    case SYS_EXIT:
+    case SYS_EXIT_GROUP:
+      return true;
+    case SYS_WRITE:
+    case SYS_WRITEV:
+      return args[0] == 1 || args[0] == 2;
+    default:
+      return false;
+  }
+}
+
+// Pages of a file mapping past the end of the file fault when touched, so
+// only the part backed by the file is logged.
+static u64 mapped_file_len(const u64* args) {
+  struct stat st;
+  if (fstat(args[4], &st) < 0 || !S_ISREG(st.st_mode)) return args[1];
+  if ((u64)st.st_size <= args[5]) return 0;
+  return MIN(args[1], ROUNDUP(st.st_size - args[5], getpagesize()));
+}
+
+// Lists in replay->chunks the guest memory a call wrote given its result,
+// or with RVEMU_REPLAY_ANY_RET everything it may write, before it runs.
+int replay_outputs_of(Replay* replay, Mmu* mmu, u64 nr, const u64* args,
+                      u64 ret) {
+  if (nr >= SIZEOF_ARRAY(replay_outputs)) return 0;
+  if (ret != RVEMU_REPLAY_ANY_RET && (i64)ret < 0) return 0;
+  if (!replay->chunks) {
+    replay->chunks = malloc(RVEMU_REPLAY_MAX_CHUNKS * sizeof(ReplayChunk));
+    if (!replay->chunks) FATAL("cannot allocate replay chunks");
+  }
+  ReplayChunk* chunks = replay->chunks;
+
+  int n = 0;
+  for (int i = 0; i < 2; i++) {
+    const ReplayOutput* out = &replay_outputs[nr][i];
+    u64 addr = args[out->arg];
+    switch (out->kind) {
+      case kOutNone:
+        break;
+      case kOutFixed:
+        if (addr != 0) {
+          chunks[n++] = (ReplayChunk){addr, out->size};
+        }
+        break;
+      case kOutRet:
+        if (ret > 0) {
+          chunks[n++] = (ReplayChunk){addr, MIN(ret, args[2])};
+        }
+        break;
+      case kOutIov: {
+        const u64* iov = (const u64*)mmu_host(mmu, addr);
+        u64 left = ret;
+        for (u64 j = 0; left > 0 && j < args[2] && n < UIO_MAXIOV; j++) {
+          u64 len = MIN(iov[2 * j + 1], left);
+          chunks[n++] = (ReplayChunk){iov[2 * j], len};
+          left -= len;
+        }
+        break;
+      }
+      case kOutMmap:
+        if (ret != RVEMU_REPLAY_ANY_RET && !(args[3] & NEWLIB_MAP_ANONYMOUS)) {
+          chunks[n++] = (ReplayChunk){ret, mapped_file_len(args)};
+        }
+        break;
+    }
+  }
+  return n;
+}
+
+void replay_record(Replay* replay, Mmu* mmu, u64 nr, const u64* args,
+                   u64 ret) {
+  int n = replay_outputs_of(replay, mmu, nr, args, ret);
+  const ReplayChunk* chunks = replay->chunks;
+
+  ReplayEntry entry = {.nr = nr, .ret = ret, .nchunks = n};
+  fwrite(&entry, sizeof(entry), 1, replay->fp);
+  for (int i = 0; i < n; i++) {
+    fwrite(&chunks[i], sizeof(ReplayChunk), 1, replay->fp);
+    fwrite(mmu_host(mmu, chunks[i].addr), 1, chunks[i].len, replay->fp);
+  }
+
+  // make sure the log survives a guest that exits from under us
+  if (nr == SYS_EXIT || nr == SYS_EXIT_GROUP) {
+    fflush(replay->fp);
+  }
+}
+
+u64 replay_play(Replay* replay, Mmu* mmu, u64 nr, const u64* args) {
+  ReplayEntry entry;
+  if (fread(&entry, sizeof(entry), 1, replay->fp) != 1) {
+    FATALF("replay log ended at syscall %lu", nr);
+  }
+  if (entry.nr != nr) {
+    FATALF("replay diverged: guest made syscall %lu, log has %lu", nr,
+           entry.nr);
+  }
+
+  // mappings are recreated at their recorded address, file contents and all,
+  // so later anonymous mappings land exactly where they did when recording
+  if (nr == SYS_MMAP && (i64)entry.ret >= 0) {
+    int page_size = getpagesize();
+    u64 len = ROUNDUP(args[1], page_size);
+    u64 addr = mmu_map(mmu, entry.ret, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (addr != entry.ret) {
+      FATALF("replay cannot map %#lx", entry.ret);
+    }
+  }
+
+  for (u32 i = 0; i < entry.nchunks; i++) {
+    ReplayChunk chunk;
+    if (fread(&chunk, sizeof(chunk), 1, replay->fp) != 1 ||
+        fread(mmu_host(mmu, chunk.addr), 1, chunk.len, replay->fp) !=
+            chunk.len) {
+      FATAL("replay log truncated");
+    }
+  }
+
+  if (nr == SYS_MMAP && (i64)entry.ret >= 0) {
+    mprotect(mmu_host(mmu, entry.ret), ROUNDUP(args[1], getpagesize()),
+             args[2] & (PROT_READ | PROT_WRITE | PROT_EXEC));
+  }
+  return entry.ret;
+}
+
+void replay_destroy(Replay* replay) {
+  if (replay->fp) fclose(replay->fp);
+  free(replay->chunks);
+  *replay = (Replay){.mode = kReplayOff};
+}
@@ -0,0 +1,53 @@
+#ifndef RVEMU_REPLAY_H_
+#define RVEMU_REPLAY_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "mmu.h"
+#include "types.h"
+
+#define RVEMU_REPLAY_MAGIC 0x59414c5045525652ULL  // "RVREPLAY"
+#define RVEMU_REPLAY_MAX_CHUNKS 1025             // UIO_MAXIOV + 1
+#define RVEMU_REPLAY_ANY_RET UINT64_MAX
+
+typedef enum {
+  kReplayOff,
+  kReplayRecord,
+  kReplayPlay,
+} ReplayMode;
+
+// Log layout: the magic, then per syscall a ReplayEntry followed by its
+// chunks, each a ReplayChunk header and the bytes the call left in guest
+// memory at that address.
+typedef struct {
+  u64 nr;
+  u64 ret;
+  u32 nchunks;
+  u32 reserved;
+} ReplayEntry;
+
+typedef struct {
+  u64 addr;
+  u64 len;
+} ReplayChunk;
+
+typedef struct {
+  ReplayMode mode;
+  FILE* fp;
+  ReplayChunk* chunks;  // RVEMU_REPLAY_MAX_CHUNKS long, see replay_outputs_of
+} Replay;
+
+bool replay_open(Replay*, const char*, ReplayMode);
+
+bool replay_reexecutes(u64, const u64*);
+
+int replay_outputs_of(Replay*, Mmu*, u64, const u64*, u64);
+
+void replay_record(Replay*, Mmu*, u64, const u64*, u64);
+
+u64 replay_play(Replay*, Mmu*, u64, const u64*);
+
+void replay_destroy(Replay*);
+
+#endif  // RVEMU_REPLAY_H_
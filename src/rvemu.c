@@ -0,0 +1,136 @@
+// process_vm_readv and process_vm_writev
+#define _GNU_SOURCE
+
+#include "rvemu.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "machine.h"
+#include "reg.h"
+#include "syscall.h"
+
+struct Rvemu {
+  Machine m;
+  RvemuSyscallFn syscall;
+  void* user;
+};
+
+Rvemu* rvemu_create(void) {
+  Rvemu* vm = calloc(1, sizeof(Rvemu));
+  if (!vm) return NULL;
+  if (!machine_init(&vm->m)) {
+    free(vm);
+    return NULL;
+  }
+  return vm;
+}
+
+void rvemu_destroy(Rvemu* vm) {
+  if (!vm) return;
+  machine_destroy(&vm->m);
+  free(vm);
+}
+
+int rvemu_load(Rvemu* vm, const char* path, int argc, char* const* argv) {
+  if (!machine_load_program(&vm->m, path)) return -errno;
+
+  // machine_setup takes main's argv, whose first entry is the emulator
+  char** host_argv = calloc(argc + 2, sizeof(char*));
+  if (!host_argv) return -ENOMEM;
+  host_argv[0] = "rvemu";
+  for (int i = 0; i < argc; i++) {
+    host_argv[i + 1] = argv[i];
+  }
+  machine_setup(&vm->m, argc + 1, host_argv);
+  free(host_argv);
+  return 0;
+}
+
+void rvemu_set_syscall_handler(Rvemu* vm, RvemuSyscallFn fn, void* user) {
+  vm->syscall = fn;
+  vm->user = user;
+  // fast-path syscalls would otherwise never reach the handler
+  vm->m.trap_all_syscalls = fn != NULL;
+}
+
+void rvemu_set_jit(Rvemu* vm, bool enabled) { vm->m.jit.enabled = enabled; }
+
+uint64_t rvemu_default_syscall(Rvemu* vm) {
+  return do_syscall(&vm->m, machine_get_xreg(&vm->m, XREG_A7));
+}
+
+static RvemuStop run(Rvemu* vm) {
+  Machine* m = &vm->m;
+  while (!m->halted) {
+    ExitReason reason = machine_step(m);
+    if (reason == kBudgetExhausted) return RVEMU_BUDGET_EXHAUSTED;
+    if (reason == kHalt) break;  // a fault killed the guest
+
+    u64 syscall = machine_get_xreg(m, XREG_A7);
+    u64 ret = vm->syscall ? vm->syscall(vm, syscall, vm->user)
+                          : do_syscall(m, syscall);
+    if (!m->halted) {
+      machine_set_xreg(m, XREG_A0, ret);
+    }
+  }
+  return RVEMU_HALTED;
+}
+
+int rvemu_run(Rvemu* vm) {
+  machine_clear_budget(&vm->m);
+  run(vm);
+  return vm->m.exit_code;
+}
+
+RvemuStop rvemu_run_for(Rvemu* vm, uint64_t insns) {
+  machine_set_budget(&vm->m, insns);
+  return run(vm);
+}
+
+int rvemu_exit_code(const Rvemu* vm) { return vm->m.exit_code; }
+
+void rvemu_halt(Rvemu* vm, int exit_code) {
+  vm->m.halted = true;
+  vm->m.exit_code = exit_code;
+}
+
+bool rvemu_halted(const Rvemu* vm) { return vm->m.halted; }
+
+uint64_t rvemu_get_reg(const Rvemu* vm, int reg) {
+  return reg > 0 && reg < XREG_NUM ? vm->m.state.xregs[reg] : 0;
+}
+
+void rvemu_set_reg(Rvemu* vm, int reg, uint64_t value) {
+  if (reg > 0 && reg < XREG_NUM) {
+    vm->m.state.xregs[reg] = value;
+  }
+}
+
+uint64_t rvemu_get_pc(const Rvemu* vm) { return vm->m.state.pc; }
+
+void rvemu_set_pc(Rvemu* vm, uint64_t pc) { vm->m.state.pc = pc; }
+
+// The kernel does the copy, so an unmapped guest page comes back as EFAULT
+// instead of a SIGSEGV in the embedding process.
+static int copy_mem(Rvemu* vm, uint64_t addr, void* buf, size_t len,
+                    bool to_guest) {
+  if (addr >= RVEMU_MMU_GUEST_LIMIT || len > RVEMU_MMU_GUEST_LIMIT - addr) {
+    return -EFAULT;
+  }
+  struct iovec local = {buf, len};
+  struct iovec remote = {mmu_host(&vm->m.mmu, addr), len};
+  ssize_t n = to_guest ? process_vm_writev(getpid(), &local, 1, &remote, 1, 0)
+                       : process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+  return n == (ssize_t)len ? 0 : -EFAULT;
+}
+
+int rvemu_read_mem(Rvemu* vm, uint64_t addr, void* buf, size_t len) {
+  return copy_mem(vm, addr, buf, len, false);
+}
+
+int rvemu_write_mem(Rvemu* vm, uint64_t addr, const void* buf, size_t len) {
+  return copy_mem(vm, addr, (void*)buf, len, true);
+}
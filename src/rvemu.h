@@ -0,0 +1,79 @@
+#ifndef RVEMU_RVEMU_H_
+#define RVEMU_RVEMU_H_
+
+// Embedding API of librvemu. Each Rvemu owns a user-mode riscv64 guest with
+// its own address space, so several can live in one process. Calls on one
+// Rvemu must not overlap.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define RVEMU_API __attribute__((visibility("default")))
+#else
+#define RVEMU_API
+#endif
+
+typedef struct Rvemu Rvemu;
+
+// Called for every guest ECALL, with the syscall number from a7 and the
+// arguments in a0-a5. Its result is written to a0. rvemu_default_syscall
+// runs the emulator's own implementation, and rvemu_halt ends the run.
+typedef uint64_t (*RvemuSyscallFn)(Rvemu*, uint64_t nr, void* user);
+
+RVEMU_API Rvemu* rvemu_create(void);
+
+RVEMU_API void rvemu_destroy(Rvemu*);
+
+// Loads a riscv64 ELF and sets up its stack with argv, argv[0] being the
+// program name. Returns 0 or a negative errno.
+RVEMU_API int rvemu_load(Rvemu*, const char* path, int argc,
+                         char* const* argv);
+
+RVEMU_API void rvemu_set_syscall_handler(Rvemu*, RvemuSyscallFn, void* user);
+
+// Compiles hot blocks to x86-64 code, as rvemu --jit does.
+RVEMU_API void rvemu_set_jit(Rvemu*, bool enabled);
+
+RVEMU_API uint64_t rvemu_default_syscall(Rvemu*);
+
+// Runs the guest until it exits or is halted and returns its exit code. A
+// guest killed by a memory fault, illegal instruction or EBREAK exits with
+// 128 plus the signal it would have died of.
+RVEMU_API int rvemu_run(Rvemu*);
+
+typedef enum {
+  RVEMU_HALTED,
+  RVEMU_BUDGET_EXHAUSTED,
+} RvemuStop;
+
+// Runs at most about insns guest instructions. The count is checked at
+// block boundaries, so it may be exceeded by one block. A later call
+// resumes where this one stopped, which makes it usable for timeouts and
+// for time slicing several guests on one thread.
+RVEMU_API RvemuStop rvemu_run_for(Rvemu*, uint64_t insns);
+
+RVEMU_API int rvemu_exit_code(const Rvemu*);
+
+RVEMU_API void rvemu_halt(Rvemu*, int exit_code);
+
+RVEMU_API bool rvemu_halted(const Rvemu*);
+
+// Integer registers are numbered as in the ISA, x0 to x31.
+RVEMU_API uint64_t rvemu_get_reg(const Rvemu*, int reg);
+
+RVEMU_API void rvemu_set_reg(Rvemu*, int reg, uint64_t value);
+
+RVEMU_API uint64_t rvemu_get_pc(const Rvemu*);
+
+RVEMU_API void rvemu_set_pc(Rvemu*, uint64_t pc);
+
+// Copy between guest memory and the caller. Both return 0, or -EFAULT when
+// any part of the range is not mapped in the guest.
+RVEMU_API int rvemu_read_mem(Rvemu*, uint64_t addr, void* buf, size_t len);
+
+RVEMU_API int rvemu_write_mem(Rvemu*, uint64_t addr, const void* buf,
+                              size_t len);
+
+#endif  // RVEMU_RVEMU_H_
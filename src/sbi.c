@@ -0,0 +1,285 @@
+#include "sbi.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "csr.h"
+#include "utils.h"
+
+#define SBI_SPEC_VERSION (2 << 24)  // 2.0
+
+#define SBI_EXT_LEGACY_SET_TIMER 0x00
+#define SBI_EXT_LEGACY_PUTCHAR 0x01
+#define SBI_EXT_LEGACY_GETCHAR 0x02
+#define SBI_EXT_LEGACY_CLEAR_IPI 0x03
+#define SBI_EXT_LEGACY_SEND_IPI 0x04
+#define SBI_EXT_LEGACY_REMOTE_FENCE_I 0x05
+#define SBI_EXT_LEGACY_REMOTE_SFENCE_VMA 0x06
+#define SBI_EXT_LEGACY_REMOTE_SFENCE_VMA_ASID 0x07
+#define SBI_EXT_LEGACY_SHUTDOWN 0x08
+#define SBI_EXT_BASE 0x10
+#define SBI_EXT_TIME 0x54494d45  // "TIME"
+#define SBI_EXT_IPI 0x735049     // "sPI"
+#define SBI_EXT_RFENCE 0x52464e43  // "RFNC"
+#define SBI_EXT_HSM 0x48534d     // "HSM"
+#define SBI_EXT_SRST 0x53525354  // "SRST"
+#define SBI_EXT_DBCN 0x4442434e  // "DBCN"
+
+#define SBI_BASE_GET_SPEC_VERSION 0
+#define SBI_BASE_GET_IMPL_ID 1
+#define SBI_BASE_GET_IMPL_VERSION 2
+#define SBI_BASE_PROBE_EXTENSION 3
+#define SBI_BASE_GET_MVENDORID 4
+#define SBI_BASE_GET_MARCHID 5
+#define SBI_BASE_GET_MIMPID 6
+
+#define SBI_HSM_HART_START 0
+#define SBI_HSM_HART_STOP 1
+#define SBI_HSM_HART_GET_STATUS 2
+#define SBI_HSM_HART_SUSPEND 3
+#define SBI_HSM_STATE_STARTED 0
+
+#define SBI_SRST_RESET_REASON_NONE 0
+
+#define SBI_DBCN_WRITE 0
+#define SBI_DBCN_READ 1
+#define SBI_DBCN_WRITE_BYTE 2
+
+#define SBI_SUCCESS 0
+#define SBI_ERR_FAILED -1
+#define SBI_ERR_NOT_SUPPORTED -2
+#define SBI_ERR_INVALID_PARAM -3
+#define SBI_ERR_INVALID_ADDRESS -5
+#define SBI_ERR_ALREADY_AVAILABLE -6
+
+// traps M-mode firmware would hand straight on to the kernel
+#define SBI_MEDELEG                                                    \
+  (1ULL << 0 | 1ULL << 3 | 1ULL << 8 | 1ULL << 12 | 1ULL << 13 | \
+   1ULL << 15)
+#define SBI_MIDELEG (MIP_SSIP | MIP_STIP | MIP_SEIP)
+
+typedef struct {
+  i64 error;
+  u64 value;
+} SbiRet;
+
+static SbiRet sbi_ok(u64 value) { return (SbiRet){SBI_SUCCESS, value}; }
+
+static SbiRet sbi_err(i64 error) { return (SbiRet){error, 0}; }
+
+// The machine starts in S mode with the delegations firmware would have
+// set up, and its ECALLs are served by do_sbi_call.
+void sbi_init(System* sys) {
+  State* state = &sys->m->state;
+  sys->sbi = true;
+  state->mode = kSupervisor;
+  state->csrs[CSR_MEDELEG] = SBI_MEDELEG;
+  state->csrs[CSR_MIDELEG] = SBI_MIDELEG;
+}
+
+static void set_timer(Machine* m, u64 stime) {
+  m->state.csrs[CSR_MIP] &= ~MIP_STIP;
+  system_set_timer(m->sys, stime);
+}
+
+// We have one hart, so an IPI either reaches hart 0 or no one.
+static SbiRet send_ipi(Machine* m, u64 mask, u64 mask_base) {
+  bool self = mask_base == UINT64_MAX || (mask_base == 0 && (mask & 1));
+  if (!self && mask_base != 0) return sbi_err(SBI_ERR_INVALID_PARAM);
+  if (self) {
+    m->state.csrs[CSR_MIP] |= MIP_SSIP;
+    atomic_store_explicit(&m->state.irq_pending, 1, memory_order_release);
+  }
+  return sbi_ok(0);
+}
+
+static void console_write(Machine* m, const void* buf, u64 len) {
+  int fd = machine_host_fd(m, 1);
+  for (u64 off = 0; off < len;) {
+    ssize_t n = write(fd, (const u8*)buf + off, len - off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return;
+    off += n;
+  }
+}
+
+// Reads up to len bytes of console input without blocking the hart.
+static i64 console_read(Machine* m, void* buf, u64 len) {
+  struct pollfd pfd = {.fd = machine_host_fd(m, 0), .events = POLLIN};
+  if (poll(&pfd, 1, 0) <= 0) return 0;
+  ssize_t n = read(pfd.fd, buf, len);
+  return n < 0 ? -1 : n;
+}
+
+static void power_off(Machine* m, int code) {
+  m->exit_code = code;
+  m->halted = true;
+}
+
+static bool probe(u64 eid) {
+  switch (eid) {
+    case SBI_EXT_LEGACY_SET_TIMER:
+    case SBI_EXT_LEGACY_PUTCHAR:
+    case SBI_EXT_LEGACY_GETCHAR:
+    case SBI_EXT_LEGACY_CLEAR_IPI:
+    case SBI_EXT_LEGACY_SEND_IPI:
+    case SBI_EXT_LEGACY_REMOTE_FENCE_I:
+    case SBI_EXT_LEGACY_REMOTE_SFENCE_VMA:
+    case SBI_EXT_LEGACY_REMOTE_SFENCE_VMA_ASID:
+    case SBI_EXT_LEGACY_SHUTDOWN:
+    case SBI_EXT_BASE:
+    case SBI_EXT_TIME:
+    case SBI_EXT_IPI:
+    case SBI_EXT_RFENCE:
+    case SBI_EXT_HSM:
+    case SBI_EXT_SRST:
+    case SBI_EXT_DBCN:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static SbiRet base_call(u64 fid, u64 arg) {
+  switch (fid) {
+    case SBI_BASE_GET_SPEC_VERSION:
+      return sbi_ok(SBI_SPEC_VERSION);
+    case SBI_BASE_GET_IMPL_ID:
+      return sbi_ok(RVEMU_SBI_IMPL_ID);
+    case SBI_BASE_GET_IMPL_VERSION:
+      return sbi_ok(1);
+    case SBI_BASE_PROBE_EXTENSION:
+      return sbi_ok(probe(arg));
+    case SBI_BASE_GET_MVENDORID:
+    case SBI_BASE_GET_MARCHID:
+    case SBI_BASE_GET_MIMPID:
+      return sbi_ok(0);
+    default:
+      return sbi_err(SBI_ERR_NOT_SUPPORTED);
+  }
+}
+
+static SbiRet hsm_call(Machine* m, u64 fid, u64 hartid) {
+  switch (fid) {
+    case SBI_HSM_HART_START:
+      return sbi_err(hartid == 0 ? SBI_ERR_ALREADY_AVAILABLE
+                                 : SBI_ERR_INVALID_PARAM);
+    case SBI_HSM_HART_STOP:
+      power_off(m, 0);  // the last hart stopping leaves nothing to run
+      return sbi_ok(0);
+    case SBI_HSM_HART_GET_STATUS:
+      return hartid == 0 ? sbi_ok(SBI_HSM_STATE_STARTED)
+                         : sbi_err(SBI_ERR_INVALID_PARAM);
+    case SBI_HSM_HART_SUSPEND:
+      return sbi_ok(0);  // resumes at once, as a spurious wakeup may
+    default:
+      return sbi_err(SBI_ERR_NOT_SUPPORTED);
+  }
+}
+
+// a0 is the length, or the byte for WRITE_BYTE, and a1 and a2 the low and
+// high halves of the buffer's address
+static SbiRet dbcn_call(Machine* m, u64 fid) {
+  const u64* x = m->state.xregs;
+  if (fid == SBI_DBCN_WRITE_BYTE) {
+    u8 c = x[XREG_A0];
+    console_write(m, &c, 1);
+    return sbi_ok(0);
+  }
+  u64 len = x[XREG_A0];
+  void* buf = x[XREG_A2] ? NULL : system_ram(m->sys, x[XREG_A1], len);
+  if (!buf) return sbi_err(SBI_ERR_INVALID_PARAM);
+  switch (fid) {
+    case SBI_DBCN_WRITE:
+      console_write(m, buf, len);
+      return sbi_ok(len);
+    case SBI_DBCN_READ: {
+      i64 n = console_read(m, buf, len);
+      return n < 0 ? sbi_err(SBI_ERR_FAILED) : sbi_ok(n);
+    }
+    default:
+      return sbi_err(SBI_ERR_NOT_SUPPORTED);
+  }
+}
+
+// Serves the ECALL an S-mode guest just made, in place of M-mode firmware.
+// The legacy extensions return a single value in a0, the others an error
+// in a0 and a value in a1.
+void do_sbi_call(Machine* m) {
+  u64* x = m->state.xregs;
+  u64 eid = x[XREG_A7];
+  u64 fid = x[XREG_A6];
+  SbiRet ret;
+  switch (eid) {
+    case SBI_EXT_LEGACY_SET_TIMER:
+      set_timer(m, x[XREG_A0]);
+      x[XREG_A0] = 0;
+      return;
+    case SBI_EXT_LEGACY_PUTCHAR: {
+      u8 c = x[XREG_A0];
+      console_write(m, &c, 1);
+      x[XREG_A0] = 0;
+      return;
+    }
+    case SBI_EXT_LEGACY_GETCHAR: {
+      u8 c;
+      x[XREG_A0] = console_read(m, &c, 1) == 1 ? c : (u64)-1;
+      return;
+    }
+    case SBI_EXT_LEGACY_CLEAR_IPI:
+      m->state.csrs[CSR_MIP] &= ~MIP_SSIP;
+      x[XREG_A0] = 0;
+      return;
+    case SBI_EXT_LEGACY_SEND_IPI: {
+      u64* mask = system_ram(m->sys, x[XREG_A0], sizeof(u64));
+      x[XREG_A0] = send_ipi(m, mask ? *mask : 1, 0).error;
+      return;
+    }
+    case SBI_EXT_LEGACY_REMOTE_FENCE_I:
+    case SBI_EXT_LEGACY_REMOTE_SFENCE_VMA:
+    case SBI_EXT_LEGACY_REMOTE_SFENCE_VMA_ASID:
+      x[XREG_A0] = 0;  // one hart and no TLB, so there is nothing to fence
+      return;
+    case SBI_EXT_LEGACY_SHUTDOWN:
+      power_off(m, 0);
+      return;
+    case SBI_EXT_BASE:
+      ret = base_call(fid, x[XREG_A0]);
+      break;
+    case SBI_EXT_TIME:
+      if (fid == 0) {
+        set_timer(m, x[XREG_A0]);
+        ret = sbi_ok(0);
+      } else {
+        ret = sbi_err(SBI_ERR_NOT_SUPPORTED);
+      }
+      break;
+    case SBI_EXT_IPI:
+      ret = fid == 0 ? send_ipi(m, x[XREG_A0], x[XREG_A1])
+                     : sbi_err(SBI_ERR_NOT_SUPPORTED);
+      break;
+    case SBI_EXT_RFENCE:
+      ret = fid <= 6 ? sbi_ok(0) : sbi_err(SBI_ERR_NOT_SUPPORTED);
+      break;
+    case SBI_EXT_HSM:
+      ret = hsm_call(m, fid, x[XREG_A0]);
+      break;
+    case SBI_EXT_SRST:
+      if (fid == 0) {
+        power_off(m, x[XREG_A1] != SBI_SRST_RESET_REASON_NONE);
+        ret = sbi_ok(0);
+      } else {
+        ret = sbi_err(SBI_ERR_NOT_SUPPORTED);
+      }
+      break;
+    case SBI_EXT_DBCN:
+      ret = dbcn_call(m, fid);
+      break;
+    default:
+      ret = sbi_err(SBI_ERR_NOT_SUPPORTED);
+      break;
+  }
+  x[XREG_A0] = ret.error;
+  x[XREG_A1] = ret.value;
+}
@@ -0,0 +1,14 @@
+#ifndef RVEMU_SBI_H_
+#define RVEMU_SBI_H_
+
+#include "machine.h"
+#include "system.h"
+
+// The SBI implementation id we report, unassigned by the SBI spec.
+#define RVEMU_SBI_IMPL_ID 0x7276
+
+void sbi_init(System*);
+
+void do_sbi_call(Machine*);
+
+#endif  // RVEMU_SBI_H_
@@ -0,0 +1,223 @@
+#include "scheduler.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "syscall.h"
+#include "utils.h"
+
+#define SCHED_QUEUE_INIT 64
+
+static void queue_init(SchedQueue* q) {
+  pthread_mutex_init(&q->lock, NULL);
+  q->cap = SCHED_QUEUE_INIT;
+  q->slots = calloc(q->cap, sizeof(Machine*));
+  if (!q->slots) FATAL("cannot allocate a run queue");
+  q->head = q->tail = 0;
+}
+
+static void queue_push(SchedQueue* q, Machine* m) {
+  pthread_mutex_lock(&q->lock);
+  if (q->tail - q->head == q->cap) {
+    Machine** slots = calloc(q->cap * 2, sizeof(Machine*));
+    if (!slots) FATAL("cannot grow a run queue");
+    for (u32 i = q->head; i != q->tail; i++) {
+      slots[i & (q->cap * 2 - 1)] = q->slots[i & (q->cap - 1)];
+    }
+    free(q->slots);
+    q->slots = slots;
+    q->cap *= 2;
+  }
+  q->slots[q->tail++ & (q->cap - 1)] = m;
+  pthread_mutex_unlock(&q->lock);
+}
+
+// the owner takes the oldest machine, so its queue is served round-robin
+static Machine* queue_pop(SchedQueue* q) {
+  Machine* m = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->head != q->tail) m = q->slots[q->head++ & (q->cap - 1)];
+  pthread_mutex_unlock(&q->lock);
+  return m;
+}
+
+// thieves take the newest, which the owner would reach last
+static Machine* queue_steal(SchedQueue* q) {
+  Machine* m = NULL;
+  if (pthread_mutex_trylock(&q->lock) != 0) return NULL;
+  if (q->head != q->tail) m = q->slots[--q->tail & (q->cap - 1)];
+  pthread_mutex_unlock(&q->lock);
+  return m;
+}
+
+static void sched_enqueue(Sched* s, SchedWorker* w, Machine* m) {
+  queue_push(&w->queue, m);
+  atomic_fetch_add(&s->runnable, 1);
+  pthread_mutex_lock(&s->lock);
+  pthread_cond_signal(&s->work);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static Machine* sched_dequeue(Sched* s, SchedWorker* w) {
+  Machine* m = queue_pop(&w->queue);
+  for (u32 i = 1; !m && i < s->nr_workers; i++) {
+    m = queue_steal(&s->workers[(w->id + i) % s->nr_workers].queue);
+  }
+  if (m) atomic_fetch_sub(&s->runnable, 1);
+  return m;
+}
+
+static void sched_exit(Sched* s, Machine* m) {
+  s->on_exit(m, s->user);
+  if (atomic_fetch_sub(&s->live, 1) == 1) {
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_broadcast(&s->done);
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+// Runs m until its quantum is used up, it exits, or one of its syscalls is
+// left in flight on the worker's ring.
+static void run_slice(SchedWorker* w, Machine* m) {
+  Sched* s = w->sched;
+  m->uring = w->has_ring ? &w->ring : NULL;
+  machine_set_budget(m, s->quantum);
+  while (true) {
+    ExitReason reason = machine_step(m);
+    if (reason == kBudgetExhausted) {
+      sched_enqueue(s, w, m);
+      return;
+    }
+    if (reason == kHalt) {  // a fault killed the guest
+      sched_exit(s, m);
+      return;
+    }
+
+    u64 ret = do_syscall(m, machine_get_xreg(m, XREG_A7));
+    if (m->halted) {
+      sched_exit(s, m);
+      return;
+    }
+    if (m->syscall_pending) {
+      m->sched_next = w->parked;
+      w->parked = m;
+      return;
+    }
+    machine_set_xreg(m, XREG_A0, ret);
+  }
+}
+
+// submits queued requests and moves machines whose request completed back
+// to the run queue
+static void reap_parked(SchedWorker* w) {
+  do_syscall_complete(&w->ring, 0);
+  Machine** link = &w->parked;
+  while (*link) {
+    Machine* m = *link;
+    if (m->syscall_pending) {
+      link = &m->sched_next;
+      continue;
+    }
+    *link = m->sched_next;
+    sched_enqueue(w->sched, w, m);
+  }
+}
+
+static void wait_for_work(SchedWorker* w) {
+  Sched* s = w->sched;
+  pthread_mutex_lock(&s->lock);
+  if (atomic_load(&s->runnable) == 0 && !atomic_load(&s->stopping)) {
+    if (w->parked) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_nsec += RVEMU_SCHED_IDLE_MS * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&s->work, &s->lock, &deadline);
+    } else {
+      pthread_cond_wait(&s->work, &s->lock);
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void* worker_main(void* arg) {
+  SchedWorker* w = (SchedWorker*)arg;
+  Sched* s = w->sched;
+  while (!atomic_load(&s->stopping)) {
+    Machine* m = sched_dequeue(s, w);
+    if (m) run_slice(w, m);
+    if (w->parked) reap_parked(w);
+    if (!m) wait_for_work(w);
+  }
+  return NULL;
+}
+
+// Sets up nr_workers workers, each with its own io_uring when use_uring is
+// set and the kernel has one. on_exit is handed each machine once its guest
+// exits; the machine is the caller's again from then on.
+bool sched_init(Sched* s, u32 nr_workers, bool use_uring,
+                void (*on_exit)(Machine*, void*), void* user) {
+  *s = (Sched){
+      .nr_workers = nr_workers,
+      .quantum = RVEMU_SCHED_QUANTUM,
+      .on_exit = on_exit,
+      .user = user,
+  };
+  s->workers = calloc(nr_workers, sizeof(SchedWorker));
+  if (!s->workers) return false;
+
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&s->work, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&s->done, NULL);
+
+  for (u32 i = 0; i < nr_workers; i++) {
+    SchedWorker* w = &s->workers[i];
+    w->sched = s;
+    w->id = i;
+    queue_init(&w->queue);
+    w->has_ring = use_uring && uring_init(&w->ring, RVEMU_URING_ENTRIES);
+  }
+  return true;
+}
+
+bool sched_start(Sched* s) {
+  for (u32 i = 0; i < s->nr_workers; i++) {
+    SchedWorker* w = &s->workers[i];
+    if (pthread_create(&w->thread, NULL, worker_main, w) != 0) return false;
+  }
+  return true;
+}
+
+// Queues a loaded and set-up machine. Safe to call from any thread.
+void sched_submit(Sched* s, Machine* m) {
+  atomic_fetch_add(&s->live, 1);
+  u32 i = atomic_fetch_add(&s->next_worker, 1) % s->nr_workers;
+  sched_enqueue(s, &s->workers[i], m);
+}
+
+// waits until every submitted machine has exited
+void sched_wait(Sched* s) {
+  pthread_mutex_lock(&s->lock);
+  while (atomic_load(&s->live) != 0) {
+    pthread_cond_wait(&s->done, &s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+void sched_stop(Sched* s) {
+  pthread_mutex_lock(&s->lock);
+  atomic_store(&s->stopping, true);
+  pthread_cond_broadcast(&s->work);
+  pthread_mutex_unlock(&s->lock);
+  for (u32 i = 0; i < s->nr_workers; i++) {
+    pthread_join(s->workers[i].thread, NULL);
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef RVEMU_SCHEDULER_H_
+#define RVEMU_SCHEDULER_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "machine.h"
+#include "types.h"
+
+#define RVEMU_SCHED_QUANTUM 100000  // guest instructions per time slice
+#define RVEMU_SCHED_IDLE_MS 1  // how often an idle worker polls its parked
+
+// Runs many machines on a fixed pool of worker threads. Each worker keeps a
+// run queue of its own, runs the oldest machine in it for one quantum and
+// queues it again, and steals the newest machine from another worker when
+// its queue is empty. A guest whose syscall went out on the worker's
+// io_uring is parked with that worker until the request completes, so the
+// thread moves on to other guests instead of blocking.
+typedef struct {
+  pthread_mutex_t lock;
+  Machine** slots;
+  u32 cap;  // a power of two
+  u32 head;
+  u32 tail;
+} SchedQueue;
+
+typedef struct Sched Sched;
+
+typedef struct {
+  Sched* sched;
+  u32 id;
+  pthread_t thread;
+  SchedQueue queue;
+  Uring ring;
+  bool has_ring;
+  Machine* parked;  // linked through sched_next
+} SchedWorker;
+
+struct Sched {
+  SchedWorker* workers;
+  u32 nr_workers;
+  u64 quantum;
+  atomic_uint next_worker;  // where sched_submit queues next
+  atomic_ulong runnable;    // machines sitting in run queues
+  atomic_ulong live;        // submitted machines that have not exited
+  atomic_bool stopping;
+  pthread_mutex_t lock;  // for the conditions below
+  pthread_cond_t work;
+  pthread_cond_t done;
+  void (*on_exit)(Machine*, void*);  // called on the worker thread
+  void* user;
+};
+
+bool sched_init(Sched*, u32, bool, void (*)(Machine*, void*), void*);
+
+bool sched_start(Sched*);
+
+void sched_submit(Sched*, Machine*);
+
+void sched_wait(Sched*);
+
+void sched_stop(Sched*);
+
+#endif  // RVEMU_SCHEDULER_H_
@@ -0,0 +1,178 @@
+#include "serve.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "forksrv.h"
+#include "utils.h"
+
+typedef struct {
+  Machine m;  // first, so the scheduler's Machine* is the job
+  int conn;
+  int fds[3];
+  ForkRequest req;
+} ServeJob;
+
+static void close_job(ServeJob* job, int status) {
+  i32 reply = status;
+  send(job->conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+  close(job->conn);
+  for (int i = 0; i < 3; i++) {
+    close(job->fds[i]);
+  }
+  free(job->req.strings);
+  free(job->req.argv);
+  free(job);
+}
+
+static void job_exit(Machine* m, void* user) {
+  ServeJob* job = (ServeJob*)m;
+  int status = m->term_signal ? W_EXITCODE(0, m->term_signal)
+                              : W_EXITCODE(m->exit_code & 0xff, 0);
+  machine_destroy(m);
+  close_job(job, status);
+}
+
+static bool same_file(const ServeImage* img, const struct stat* st) {
+  return img->dev == st->st_dev && img->ino == st->st_ino &&
+         img->size == st->st_size &&
+         img->mtime.tv_sec == st->st_mtim.tv_sec &&
+         img->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void free_image(Server* srv, ServeImage** link) {
+  ServeImage* img = *link;
+  *link = img->next;
+  close(img->image.fd);
+  free(img->path);
+  free(img);
+  srv->num_images--;
+}
+
+// Returns the parsed ELF at path, reading it again only if the file has
+// changed since it was cached. Returns NULL with errno set on failure. The
+// cache is kept most recently used first, and the last image goes when it
+// is full; jobs map their image as they start, so none still needs it.
+static const MmuImage* serve_image(Server* srv, const char* path) {
+  struct stat st;
+  if (stat(path, &st) < 0) return NULL;
+
+  for (ServeImage** link = &srv->images; *link; link = &(*link)->next) {
+    ServeImage* img = *link;
+    if (strcmp(img->path, path) != 0) continue;
+    if (!same_file(img, &st)) {
+      free_image(srv, link);
+      break;
+    }
+    *link = img->next;
+    img->next = srv->images;
+    srv->images = img;
+    return &img->image;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  ServeImage* img = calloc(1, sizeof(ServeImage));
+  if (!img || fstat(fd, &st) < 0 || !mmu_open_image(&img->image, fd)) {
+    int err = img ? errno : ENOMEM;
+    free(img);
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+  img->path = strdup(path);
+  img->dev = st.st_dev;
+  img->ino = st.st_ino;
+  img->size = st.st_size;
+  img->mtime = st.st_mtim;
+  img->next = srv->images;
+  srv->images = img;
+  if (++srv->num_images > RVEMU_SERVE_MAX_IMAGES) {
+    ServeImage** link = &srv->images;
+    while ((*link)->next) {
+      link = &(*link)->next;
+    }
+    free_image(srv, link);
+  }
+  return &img->image;
+}
+
+// sets up the job's machine and hands it to the scheduler, or answers the
+// request right away when the program cannot be run
+static void start_job(Server* srv, ServeJob* job) {
+  const char* path = job->req.argv[1];
+  const MmuImage* image = serve_image(srv, path);
+  if (!image) {
+    fprintf(stderr, "cannot load %s: %s\n", path, strerror(errno));
+    close_job(job, W_EXITCODE(127, 0));
+    return;
+  }
+
+  Machine* m = &job->m;
+  if (!machine_init(m)) {
+    close_job(job, W_EXITCODE(127, 0));
+    return;
+  }
+  m->mmu.huge_pages = srv->tmpl->mmu.huge_pages;
+  m->mmu.prefault = srv->tmpl->mmu.prefault;
+  m->coarse_clock = srv->tmpl->coarse_clock;
+  m->jit.enabled = srv->tmpl->jit.enabled;
+  for (int i = 0; i < 3; i++) {
+    m->fds[i] = job->fds[i];
+  }
+  if (!machine_load_image(m, image)) {
+    fprintf(stderr, "cannot load %s: %s\n", path, strerror(errno));
+    machine_destroy(m);
+    close_job(job, W_EXITCODE(127, 0));
+    return;
+  }
+  machine_setup(m, job->req.argc, job->req.argv);
+  sched_submit(&srv->sched, m);
+}
+
+bool serve_init(Server* srv, const char* path, u32 nr_workers,
+                const Machine* tmpl) {
+  *srv = (Server){.tmpl = tmpl};
+  srv->listen_fd = forksrv_bind(path);
+  if (srv->listen_fd < 0) return false;
+  if (!sched_init(&srv->sched, nr_workers, tmpl->uring != NULL, job_exit,
+                  srv) ||
+      !sched_start(&srv->sched)) {
+    close(srv->listen_fd);
+    return false;
+  }
+  return true;
+}
+
+void serve_loop(Server* srv) {
+  // a client or guest pipe going away must not take the daemon with it
+  signal(SIGPIPE, SIG_IGN);
+
+  while (true) {
+    int conn = accept(srv->listen_fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      FATALF("serve accept failed: %s", strerror(errno));
+    }
+    fcntl(conn, F_SETFD, FD_CLOEXEC);
+
+    ServeJob* job = calloc(1, sizeof(ServeJob));
+    if (!job) FATAL("cannot allocate a job");
+    job->conn = conn;
+    if (!forksrv_receive(conn, &job->req, job->fds)) {
+      close(conn);
+      free(job);
+      continue;
+    }
+    if (job->req.argc < 2) {
+      close_job(job, W_EXITCODE(127, 0));
+      continue;
+    }
+    start_job(srv, job);
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef RVEMU_SERVE_H_
+#define RVEMU_SERVE_H_
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "machine.h"
+#include "mmu.h"
+#include "scheduler.h"
+#include "types.h"
+
+#define RVEMU_SERVE_MAX_IMAGES 64
+
+// A resident daemon that runs each request in a fresh machine on a shared
+// scheduler. Requests use the fork server's protocol, with the guest
+// program's path as the first argv string, so rvemu-forkrun works as a
+// client. Parsed ELF images, the worker threads and their io_urings stay
+// up between jobs.
+typedef struct ServeImage {
+  char* path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  MmuImage image;
+  struct ServeImage* next;
+} ServeImage;
+
+typedef struct {
+  int listen_fd;
+  Sched sched;
+  ServeImage* images;  // only touched by the accepting thread
+  int num_images;
+  const Machine* tmpl;  // memory and clock options every job copies
+} Server;
+
+bool serve_init(Server*, const char*, u32, const Machine*);
+
+void serve_loop(Server*);
+
+#endif  // RVEMU_SERVE_H_
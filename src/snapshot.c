@@ -0,0 +1,163 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "reg.h"
+#include "utils.h"
+
+typedef struct {
+  char magic[8];
+  u32 state_size;  // catches snapshots from a build with another State
+  u32 num_regions;
+  State state;
+  u64 entry;
+  u64 heap_end;  // guest address the heap is mapped up to
+  u64 alloc;
+  u64 base;
+} SnapshotHeader;
+
+typedef struct {
+  u64 addr;
+  u64 len;
+  u64 offset;  // of the contents in the file, page-aligned
+  u64 prot;
+} SnapshotRegion;
+
+static bool write_full(int fd, const void* buf, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, (const u8*)buf + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EFAULT) {
+      // a file mapping past the end of its file; the hole reads as zeros
+      done = ROUNDUP(done + 1, getpagesize());
+      continue;
+    }
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+// Anonymous memory is mostly untouched, so all-zero pages are left as holes
+// and the file stays about as sparse as the guest.
+static bool is_zero_page(const u8* page, int page_size) {
+  const u64* words = (const u64*)page;
+  for (int i = 0; i < page_size / 8; i++) {
+    if (words[i] != 0) return false;
+  }
+  return true;
+}
+
+static bool write_sparse(int fd, const u8* data, size_t len, off_t offset) {
+  int page_size = getpagesize();
+  size_t start = 0;
+  for (size_t at = 0; at < len; at += page_size) {
+    if (!is_zero_page(data + at, page_size)) continue;
+    if (start < at &&
+        !write_full(fd, data + start, at - start, offset + start)) {
+      return false;
+    }
+    start = at + page_size;
+  }
+  return start >= len || write_full(fd, data + start, len - start,
+                                    offset + start);
+}
+
+bool snapshot_save(Machine* m, const char* path) {
+  MmuRegion* regions = malloc(RVEMU_MMU_MAX_REGIONS * sizeof(MmuRegion));
+  int n = regions ? mmu_regions(&m->mmu, regions, RVEMU_MMU_MAX_REGIONS) : -1;
+  int fd = n < 0 ? -1 : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    free(regions);
+    return false;
+  }
+
+  SnapshotHeader header = {
+      .magic = RVEMU_SNAPSHOT_MAGIC,
+      .state_size = sizeof(State),
+      .num_regions = n,
+      .state = m->state,
+      .entry = m->mmu.entry,
+      .heap_end = TO_GUEST(m->mmu.mem_base, m->mmu.host_alloc),
+      .alloc = m->mmu.alloc,
+      .base = m->mmu.base,
+  };
+  // the restored run sees its checkpoint call return 1
+  header.state.xregs[XREG_A0] = 1;
+  header.state.mem_base = 0;
+  header.state.mmio_read = NULL;
+  header.state.mmio_write = NULL;
+  header.state.read_time = NULL;
+
+  int page_size = getpagesize();
+  SnapshotRegion* table = calloc(n, sizeof(SnapshotRegion));
+  u64 offset = ROUNDUP(sizeof(header) + n * sizeof(SnapshotRegion), page_size);
+  bool ok = true;
+  for (int i = 0; i < n && ok; i++) {
+    void* host = mmu_host(&m->mmu, regions[i].addr);
+    table[i] = (SnapshotRegion){regions[i].addr, regions[i].len, offset,
+                                regions[i].prot};
+    if (!(regions[i].prot & PROT_READ)) {
+      mprotect(host, regions[i].len, regions[i].prot | PROT_READ);
+    }
+    ok = regions[i].anonymous
+             ? write_sparse(fd, host, regions[i].len, offset)
+             : write_full(fd, host, regions[i].len, offset);
+    if (!(regions[i].prot & PROT_READ)) {
+      mprotect(host, regions[i].len, regions[i].prot);
+    }
+    offset += regions[i].len;
+  }
+
+  ok = ok && write_full(fd, &header, sizeof(header), 0) &&
+       write_full(fd, table, n * sizeof(SnapshotRegion), sizeof(header)) &&
+       ftruncate(fd, offset) == 0;
+  free(table);
+  free(regions);
+  close(fd);
+  return ok;
+}
+
+bool snapshot_restore(Machine* m, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  SnapshotHeader header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, RVEMU_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.state_size != sizeof(State) ||
+      header.heap_end > RVEMU_MMU_MMAP_BASE) {
+    close(fd);
+    return false;
+  }
+
+  size_t table_size = header.num_regions * sizeof(SnapshotRegion);
+  SnapshotRegion* table = malloc(table_size);
+  bool ok = pread(fd, table, table_size, sizeof(header)) == table_size;
+  for (u32 i = 0; i < header.num_regions && ok; i++) {
+    u64 host = (u64)mmu_host(&m->mmu, table[i].addr);
+    ok = table[i].addr + table[i].len <= RVEMU_MMU_GUEST_LIMIT &&
+         (u64)mmap((void*)host, table[i].len, table[i].prot,
+                   MAP_PRIVATE | MAP_FIXED, fd, table[i].offset) == host;
+  }
+  free(table);
+  close(fd);
+  if (!ok) return false;
+
+  // the host addresses are this process's own
+  State state = header.state;
+  state.mem_base = m->mmu.mem_base;
+  state.mmio_read = m->state.mmio_read;
+  state.mmio_write = m->state.mmio_write;
+  state.read_time = m->state.read_time;
+  m->state = state;
+  m->mmu.entry = header.entry;
+  m->mmu.host_alloc = TO_HOST(m->mmu.mem_base, header.heap_end);
+  m->mmu.alloc = header.alloc;
+  m->mmu.base = header.base;
+  return true;
+}
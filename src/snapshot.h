@@ -0,0 +1,19 @@
+#ifndef RVEMU_SNAPSHOT_H_
+#define RVEMU_SNAPSHOT_H_
+
+#include <stdbool.h>
+
+#include "machine.h"
+
+#define RVEMU_SNAPSHOT_MAGIC "RVSNAP03"
+
+// A snapshot holds State, the Mmu bookkeeping and every guest mapping. The
+// mapping contents are stored page-aligned, so a restore maps them straight
+// from the file copy-on-write and only pages the guest touches are read.
+// Host-side state (open fds, in-memory files, the host addresses in State
+// and Mmu) is not part of it.
+bool snapshot_save(Machine*, const char*);
+
+bool snapshot_restore(Machine*, const char*);
+
+#endif  // RVEMU_SNAPSHOT_H_
@@ -1,14 +1,20 @@
 #include "syscall.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "machine.h"
 #include "reg.h"
+#include "snapshot.h"
 #include "types.h"
 #include "utils.h"
 
@@ -35,25 +41,242 @@ static inline int convert_flags(int flags) {
   return hostflags;
 }
 
+static inline int convert_prot(int flags) {
+  int hostflags = 0;
+  __REWRITE_FLAG(PROT_READ);
+  __REWRITE_FLAG(PROT_WRITE);
+  __REWRITE_FLAG(PROT_EXEC);
+  return hostflags;
+}
+
+static inline int convert_mmap_flags(int flags) {
+  int hostflags = 0;
+  __REWRITE_FLAG(MAP_SHARED);
+  __REWRITE_FLAG(MAP_PRIVATE);
+  __REWRITE_FLAG(MAP_FIXED);
+  __REWRITE_FLAG(MAP_ANONYMOUS);
+  __REWRITE_FLAG(MAP_NORESERVE);
+  __REWRITE_FLAG(MAP_POPULATE);
+  __REWRITE_FLAG(MAP_FIXED_NOREPLACE);
+  return hostflags;
+}
+
 #undef __REWRITE_FLAG
 
+// Starts an io_uring request on behalf of the guest and parks the machine
+// until do_syscall_complete() reaps it. Returns NULL when the machine has no
+// ring (or the ring is full), in which case the caller does a blocking call.
+static struct io_uring_sqe* async_sqe(Machine* m, u8 opcode, int host_fd) {
+  if (!m->uring) return NULL;
+  struct io_uring_sqe* sqe = uring_get_sqe(m->uring);
+  if (!sqe) return NULL;
+  sqe->opcode = opcode;
+  sqe->fd = host_fd;
+  sqe->user_data = (u64)m;
+  m->syscall_pending = true;
+  return sqe;
+}
+
+// a host call's result the way the guest kernel returns it, -errno on error
+static u64 host_result(i64 ret) { return ret < 0 ? (u64)-errno : (u64)ret; }
+
+// What the guest gets back from a call that opened host_fd, or failed with
+// -errno: its own fd for the file.
+static u64 guest_fd_result(Machine* m, i64 host_fd) {
+  if (host_fd < 0) return host_fd;
+  int fd = machine_add_fd(m, host_fd);
+  if (fd < 0) {
+    if (vfs_owns(&m->vfs, host_fd)) {
+      vfs_close(&m->vfs, host_fd);
+    } else {
+      close(host_fd);
+    }
+  }
+  return fd;
+}
+
 static u64 handler_exit(Machine* m) {
   u64 ec = machine_get_xreg(m, XREG_A0);
-  exit(ec);  // #include <stdlib.h>
+  if (m->fuzz.started) {
+    return machine_fuzz_next(m, W_EXITCODE(ec & 0xff, 0));
+  }
+  outbuf_flush(&m->outbuf);
+  m->halted = true;
+  m->exit_code = (int)ec;
+  return 0;
 }
 
 static u64 handler_read(Machine* m) {
   u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
   u64 buf = machine_get_xreg(m, XREG_A1);
   u64 nbytes = machine_get_xreg(m, XREG_A2);
-  return read(fd, (void*)TO_HOST(buf), (size_t)nbytes);  // #include <unistd.h>
+  if (vfs_owns(&m->vfs, host_fd)) {
+    struct iovec iov = {.iov_base = mmu_host(&m->mmu, buf), .iov_len = nbytes};
+    return vfs_preadv(&m->vfs, host_fd, &iov, 1, -1);
+  }
+  if (fd == 0) outbuf_flush(&m->outbuf);  // show any prompt before blocking
+  struct io_uring_sqe* sqe = async_sqe(m, IORING_OP_READ, host_fd);
+  if (sqe) {
+    sqe->addr = (u64)mmu_host(&m->mmu, buf);
+    sqe->len = (u32)MIN(nbytes, UINT32_MAX);
+    sqe->off = (u64)-1;  // use and advance the file position
+    return 0;
+  }
+  return host_result(read(host_fd, mmu_host(&m->mmu, buf),
+                          (size_t)nbytes));  // #include <unistd.h>
 }
 
 static u64 handler_write(Machine* m) {
   u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
   u64 buf = machine_get_xreg(m, XREG_A1);
   u64 n = machine_get_xreg(m, XREG_A2);
-  return write(fd, (void*)TO_HOST(buf), (size_t)n);  // #include <unistd.h>
+  struct iovec iov = {.iov_base = mmu_host(&m->mmu, buf), .iov_len = n};
+  if (vfs_owns(&m->vfs, host_fd)) {
+    return vfs_pwritev(&m->vfs, host_fd, &iov, 1, -1);
+  }
+  if (outbuf_owns(&m->outbuf, fd)) {
+    return outbuf_writev(&m->outbuf, host_fd, &iov, 1);
+  }
+  struct io_uring_sqe* sqe = async_sqe(m, IORING_OP_WRITE, host_fd);
+  if (sqe) {
+    sqe->addr = (u64)mmu_host(&m->mmu, buf);
+    sqe->len = (u32)MIN(n, UINT32_MAX);
+    sqe->off = (u64)-1;
+    return 0;
+  }
+  return host_result(write(host_fd, mmu_host(&m->mmu, buf),
+                           (size_t)n));  // #include <unistd.h>
+}
+
+typedef struct {
+  u64 iov_base;
+  u64 iov_len;
+} GuestIovec;
+
+// point host iovecs straight at guest memory, so vectored I/O moves data
+// between the kernel and the guest with no bounce buffer. The host iovecs go
+// in the machine's scratch array, allocated on first use.
+static struct iovec* convert_iovec(Machine* m, u64 addr, u64 iovcnt) {
+  if (iovcnt > UIO_MAXIOV) return NULL;
+  if (!m->iov) {
+    m->iov = malloc(UIO_MAXIOV * sizeof(struct iovec));
+    if (!m->iov) FATAL("cannot allocate iovecs");
+  }
+  GuestIovec* guest_iov = (GuestIovec*)mmu_host(&m->mmu, addr);
+  for (u64 i = 0; i < iovcnt; i++) {
+    m->iov[i].iov_base = mmu_host(&m->mmu, guest_iov[i].iov_base);
+    m->iov[i].iov_len = (size_t)guest_iov[i].iov_len;
+  }
+  return m->iov;
+}
+
+static u64 handler_readv(Machine* m) {
+  u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
+  u64 iov_addr = machine_get_xreg(m, XREG_A1);
+  u64 iovcnt = machine_get_xreg(m, XREG_A2);
+  struct iovec* iov = convert_iovec(m, iov_addr, iovcnt);
+  if (!iov) return (u64)-EINVAL;
+  int n = (int)iovcnt;
+  if (vfs_owns(&m->vfs, host_fd)) {
+    return vfs_preadv(&m->vfs, host_fd, iov, n, -1);
+  }
+  if (fd == 0) outbuf_flush(&m->outbuf);
+  return host_result(readv(host_fd, iov, n));
+}
+
+static u64 handler_writev(Machine* m) {
+  u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
+  u64 iov_addr = machine_get_xreg(m, XREG_A1);
+  u64 iovcnt = machine_get_xreg(m, XREG_A2);
+  struct iovec* iov = convert_iovec(m, iov_addr, iovcnt);
+  if (!iov) return (u64)-EINVAL;
+  int n = (int)iovcnt;
+  if (vfs_owns(&m->vfs, host_fd)) {
+    return vfs_pwritev(&m->vfs, host_fd, iov, n, -1);
+  }
+  if (outbuf_owns(&m->outbuf, fd)) {
+    return outbuf_writev(&m->outbuf, host_fd, iov, n);
+  }
+  return host_result(writev(host_fd, iov, n));
+}
+
+static u64 handler_pread(Machine* m) {
+  u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
+  u64 buf = machine_get_xreg(m, XREG_A1);
+  u64 nbytes = machine_get_xreg(m, XREG_A2);
+  u64 offset = machine_get_xreg(m, XREG_A3);
+  if (vfs_owns(&m->vfs, host_fd)) {
+    struct iovec iov = {.iov_base = mmu_host(&m->mmu, buf), .iov_len = nbytes};
+    return vfs_preadv(&m->vfs, host_fd, &iov, 1, (i64)offset);
+  }
+  struct io_uring_sqe* sqe = async_sqe(m, IORING_OP_READ, host_fd);
+  if (sqe) {
+    sqe->addr = (u64)mmu_host(&m->mmu, buf);
+    sqe->len = (u32)MIN(nbytes, UINT32_MAX);
+    sqe->off = offset;
+    return 0;
+  }
+  return host_result(pread(host_fd, mmu_host(&m->mmu, buf),
+                           (size_t)nbytes, (off_t)offset));
+}
+
+static u64 handler_pwrite(Machine* m) {
+  u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
+  u64 buf = machine_get_xreg(m, XREG_A1);
+  u64 n = machine_get_xreg(m, XREG_A2);
+  u64 offset = machine_get_xreg(m, XREG_A3);
+  if (vfs_owns(&m->vfs, host_fd)) {
+    struct iovec iov = {.iov_base = mmu_host(&m->mmu, buf), .iov_len = n};
+    return vfs_pwritev(&m->vfs, host_fd, &iov, 1, (i64)offset);
+  }
+  // bypasses the buffer, so what was written before must land first
+  if (outbuf_owns(&m->outbuf, fd)) outbuf_flush(&m->outbuf);
+  struct io_uring_sqe* sqe = async_sqe(m, IORING_OP_WRITE, host_fd);
+  if (sqe) {
+    sqe->addr = (u64)mmu_host(&m->mmu, buf);
+    sqe->len = (u32)MIN(n, UINT32_MAX);
+    sqe->off = offset;
+    return 0;
+  }
+  return host_result(pwrite(host_fd, mmu_host(&m->mmu, buf),
+                            (size_t)n, (off_t)offset));
+}
+
+static u64 handler_preadv(Machine* m) {
+  u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
+  u64 iov_addr = machine_get_xreg(m, XREG_A1);
+  u64 iovcnt = machine_get_xreg(m, XREG_A2);
+  u64 offset = machine_get_xreg(m, XREG_A3);
+  struct iovec* iov = convert_iovec(m, iov_addr, iovcnt);
+  if (!iov) return (u64)-EINVAL;
+  int n = (int)iovcnt;
+  if (vfs_owns(&m->vfs, host_fd)) {
+    return vfs_preadv(&m->vfs, host_fd, iov, n, offset);
+  }
+  return host_result(preadv(host_fd, iov, n, (off_t)offset));
+}
+
+static u64 handler_pwritev(Machine* m) {
+  u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
+  u64 iov_addr = machine_get_xreg(m, XREG_A1);
+  u64 iovcnt = machine_get_xreg(m, XREG_A2);
+  u64 offset = machine_get_xreg(m, XREG_A3);
+  struct iovec* iov = convert_iovec(m, iov_addr, iovcnt);
+  if (!iov) return (u64)-EINVAL;
+  int n = (int)iovcnt;
+  if (vfs_owns(&m->vfs, host_fd)) {
+    return vfs_pwritev(&m->vfs, host_fd, iov, n, offset);
+  }
+  if (outbuf_owns(&m->outbuf, fd)) outbuf_flush(&m->outbuf);
+  return host_result(pwritev(host_fd, iov, n, (off_t)offset));
 }
 
 static u64 handler_openat(Machine* m) {
@@ -61,47 +284,341 @@ static u64 handler_openat(Machine* m) {
   u64 file = machine_get_xreg(m, XREG_A1);
   u64 oflag = machine_get_xreg(m, XREG_A2);
   u64 mode = machine_get_xreg(m, XREG_A3);
-  return openat(fd, (char*)TO_HOST(file), convert_flags(oflag),
-                (mode_t)mode);  // #include <fcntl.h>
+  // the vfs resolves relative paths against the cwd only
+  const char* path = (char*)mmu_host(&m->mmu, file);
+  if (m->vfs.enabled && path[0] != '/' && (int)fd != AT_FDCWD) {
+    return (u64)-ENOSYS;
+  }
+  if (!vfs_passthrough(&m->vfs, path)) {
+    return guest_fd_result(
+        m, vfs_open(&m->vfs, path, convert_flags(oflag), mode));
+  }
+  int dirfd = (int)fd == AT_FDCWD ? AT_FDCWD : machine_host_fd(m, fd);
+  struct io_uring_sqe* sqe = async_sqe(m, IORING_OP_OPENAT, dirfd);
+  if (sqe) {
+    sqe->addr = (u64)path;
+    sqe->open_flags = convert_flags(oflag);
+    sqe->len = (u32)mode;
+    m->syscall_opens = true;
+    return 0;
+  }
+  return guest_fd_result(m, host_result(openat(dirfd, path,
+                                               convert_flags(oflag),
+                                               (mode_t)mode)));
+}
+
+static u64 handler_fsync(Machine* m) {
+  u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
+  if (vfs_owns(&m->vfs, host_fd)) return 0;
+  if (async_sqe(m, IORING_OP_FSYNC, host_fd)) return 0;
+  return host_result(fsync(host_fd));  // #include <unistd.h>
 }
 
 static u64 handler_close(Machine* m) {
   u64 fd = machine_get_xreg(m, XREG_A0);
-  if (fd > 2) return close(fd);  // #include <unistd.h>
-  return 0;
+  int host_fd = machine_host_fd(m, fd);
+  if (host_fd < 0) return (u64)-EBADF;
+  // stdio belongs to whoever started the guest
+  if (fd < 3) return 0;
+  m->fds[fd] = -1;
+  if (vfs_owns(&m->vfs, host_fd)) return vfs_close(&m->vfs, host_fd);
+  return host_result(close(host_fd));  // #include <unistd.h>
 }
 
 static u64 handler_lseek(Machine* m) {
   u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
   u64 offset = machine_get_xreg(m, XREG_A1);
   u64 whence = machine_get_xreg(m, XREG_A2);
-  return lseek(fd, (off_t)offset, whence);  // #include <unistd.h>
+  if (vfs_owns(&m->vfs, host_fd)) {
+    return vfs_lseek(&m->vfs, host_fd, offset, whence);
+  }
+  return host_result(lseek(host_fd, (off_t)offset,
+                           whence));  // #include <unistd.h>
+}
+
+static u64 handler_getpid(Machine* m) {
+  return getpid();  // #include <unistd.h>
 }
 
 static u64 handler_brk(Machine* m) {
   u64 addr = machine_get_xreg(m, XREG_A0);
-  if (addr == 0) {
-    addr = m->mmu.alloc;
+  // as on Linux, a break that cannot be moved to stays where it was
+  if (addr < m->mmu.base ||
+      (i64)mmu_alloc(&m->mmu, (i64)(addr - m->mmu.alloc)) < 0) {
+    return m->mmu.alloc;
   }
-  assert(addr >= m->mmu.base);
-  i64 inc = (i64)addr - m->mmu.alloc;
-  mmu_alloc(&m->mmu, inc);
   return addr;
 }
 
+// riscv64 Linux layouts, spelled out rather than borrowed from the host
+typedef struct {
+  u64 st_dev;
+  u64 st_ino;
+  u32 st_mode;
+  u32 st_nlink;
+  u32 st_uid;
+  u32 st_gid;
+  u64 st_rdev;
+  u64 __pad1;
+  i64 st_size;
+  i32 st_blksize;
+  i32 __pad2;
+  i64 st_blocks;
+  i64 st_atime_sec;
+  u64 st_atime_nsec;
+  i64 st_mtime_sec;
+  u64 st_mtime_nsec;
+  i64 st_ctime_sec;
+  u64 st_ctime_nsec;
+  u32 __unused4;
+  u32 __unused5;
+} GuestStat;
+
 static u64 handler_fstat(Machine* m) {
   u64 fd = machine_get_xreg(m, XREG_A0);
+  int host_fd = machine_host_fd(m, fd);
   u64 addr = machine_get_xreg(m, XREG_A1);
-  return fstat(fd, (struct stat*)TO_HOST(addr));  // #include <sys/stat.h>
+  GuestStat gst = {0};
+
+  // the guest's buffer is only written once the fd is known to be good
+  if (vfs_owns(&m->vfs, host_fd)) {
+    const VfsFile* file = m->vfs.fds[host_fd].file;
+    gst.st_mode = S_IFREG | 0644;
+    gst.st_nlink = 1;
+    gst.st_size = file->size;
+    gst.st_blksize = 4096;
+    gst.st_blocks = ROUNDUP(file->size, 512) / 512;
+  } else {
+    struct stat st;
+    // #include <sys/stat.h>
+    if (fstat(host_fd, &st) == -1) return (u64)-errno;
+    gst.st_dev = st.st_dev;
+    gst.st_ino = st.st_ino;
+    gst.st_mode = st.st_mode;
+    gst.st_nlink = st.st_nlink;
+    gst.st_uid = st.st_uid;
+    gst.st_gid = st.st_gid;
+    gst.st_rdev = st.st_rdev;
+    gst.st_size = st.st_size;
+    gst.st_blksize = st.st_blksize;
+    gst.st_blocks = st.st_blocks;
+    gst.st_atime_sec = st.st_atim.tv_sec;
+    gst.st_atime_nsec = st.st_atim.tv_nsec;
+    gst.st_mtime_sec = st.st_mtim.tv_sec;
+    gst.st_mtime_nsec = st.st_mtim.tv_nsec;
+    gst.st_ctime_sec = st.st_ctim.tv_sec;
+    gst.st_ctime_nsec = st.st_ctim.tv_nsec;
+  }
+  if (!mmu_copy_to_guest(&m->mmu, addr, &gst, sizeof(gst))) {
+    return (u64)-EFAULT;
+  }
+  return 0;
+}
+
+typedef struct {
+  i64 tv_sec;
+  i64 tv_nsec;
+} GuestTimespec;
+
+typedef struct {
+  i64 tv_sec;
+  i64 tv_usec;
+} GuestTimeval;
+
+typedef struct {
+  i32 tz_minuteswest;
+  i32 tz_dsttime;
+} GuestTimezone;
+
+typedef struct {
+  i64 tms_utime;
+  i64 tms_stime;
+  i64 tms_cutime;
+  i64 tms_cstime;
+} GuestTms;
+
+#define GUEST_CLK_TCK 100
+
+// glibc serves these clocks from the vDSO, so none of the handlers below
+// enter the host kernel; with --coarse-clock the tick-granular variants are
+// used, which only read the timestamp the kernel last cached
+static clockid_t host_clock(const Machine* m, u64 clock_id) {
+  if (m->coarse_clock) {
+    if (clock_id == CLOCK_REALTIME) return CLOCK_REALTIME_COARSE;
+    if (clock_id == CLOCK_MONOTONIC) return CLOCK_MONOTONIC_COARSE;
+  }
+  return (clockid_t)clock_id;
+}
+
+static i64 timespec_to_ticks(const struct timespec* ts) {
+  return ts->tv_sec * GUEST_CLK_TCK +
+         ts->tv_nsec / (1000000000 / GUEST_CLK_TCK);
+}
+
+static u64 handler_clock_gettime(Machine* m) {
+  u64 clock_id = machine_get_xreg(m, XREG_A0);
+  u64 tp_addr = machine_get_xreg(m, XREG_A1);
+  struct timespec ts;
+  if (clock_gettime(host_clock(m, clock_id), &ts) == -1) {  // #include <time.h>
+    return (u64)-errno;
+  }
+  GuestTimespec tp = {ts.tv_sec, ts.tv_nsec};
+  if (tp_addr != 0 && !mmu_copy_to_guest(&m->mmu, tp_addr, &tp, sizeof(tp))) {
+    return (u64)-EFAULT;
+  }
+  return 0;
+}
+
+static u64 handler_clock_getres(Machine* m) {
+  u64 clock_id = machine_get_xreg(m, XREG_A0);
+  u64 res_addr = machine_get_xreg(m, XREG_A1);
+  struct timespec ts;
+  if (clock_getres(host_clock(m, clock_id), &ts) == -1) {  // #include <time.h>
+    return (u64)-errno;
+  }
+  GuestTimespec res = {ts.tv_sec, ts.tv_nsec};
+  if (res_addr != 0 &&
+      !mmu_copy_to_guest(&m->mmu, res_addr, &res, sizeof(res))) {
+    return (u64)-EFAULT;
+  }
+  return 0;
 }
 
 static u64 handler_gettimeofday(Machine* m) {
   u64 tv_addr = machine_get_xreg(m, XREG_A0);
   u64 tz_addr = machine_get_xreg(m, XREG_A1);
-  struct timeval* tv = (struct timeval*)TO_HOST(tv_addr);
-  struct timezone* tz =
-      (tz_addr != 0) ? (struct timezone*)TO_HOST(tz_addr) : NULL;
-  return gettimeofday(tv, tz);  // #include <sys/time.h>
+  // these run inside machine_step, where a bad pointer must not become a
+  // guest fault at the ECALL
+  if (tv_addr != 0) {
+    struct timespec ts;
+    clock_gettime(host_clock(m, CLOCK_REALTIME), &ts);  // #include <time.h>
+    GuestTimeval tv = {ts.tv_sec, ts.tv_nsec / 1000};
+    if (!mmu_copy_to_guest(&m->mmu, tv_addr, &tv, sizeof(tv))) {
+      return (u64)-EFAULT;
+    }
+  }
+  GuestTimezone tz = {0};
+  if (tz_addr != 0 && !mmu_copy_to_guest(&m->mmu, tz_addr, &tz, sizeof(tz))) {
+    return (u64)-EFAULT;
+  }
+  return 0;
+}
+
+static u64 handler_times(Machine* m) {
+  u64 buf = machine_get_xreg(m, XREG_A0);
+  if (buf != 0) {
+    // process CPU time has no vDSO path, this is the one kernel entry
+    struct timespec cpu;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);  // #include <time.h>
+    GuestTms tms = {.tms_utime = timespec_to_ticks(&cpu)};
+    if (!mmu_copy_to_guest(&m->mmu, buf, &tms, sizeof(tms))) {
+      return (u64)-EFAULT;
+    }
+  }
+  struct timespec now;
+  clock_gettime(host_clock(m, CLOCK_MONOTONIC), &now);
+  return timespec_to_ticks(&now);
+}
+
+// Unmodified preloaded inputs still have their host file, so they are mapped
+// from it like any other file. Anything else is copied into a private
+// anonymous mapping; MAP_SHARED writes then stay private to the mapping.
+static u64 map_vfs_file(Machine* m, u64 addr, u64 len, u64 prot, u64 flags,
+                        int fd, u64 offset) {
+  const VfsFile* file = m->vfs.fds[fd].file;
+  if (file->host_fd != -1) {
+    return mmu_map(&m->mmu, addr, len, convert_prot(prot),
+                   convert_mmap_flags(flags & ~NEWLIB_MAP_SHARED) | MAP_PRIVATE,
+                   file->host_fd, offset);
+  }
+
+  int hostflags = convert_mmap_flags(flags & ~NEWLIB_MAP_SHARED);
+  u64 guest_addr =
+      mmu_map(&m->mmu, addr, len, PROT_READ | PROT_WRITE,
+              hostflags | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ((i64)guest_addr < 0) return guest_addr;
+
+  struct iovec iov = {.iov_base = mmu_host(&m->mmu, guest_addr),
+                      .iov_len = len};
+  vfs_preadv(&m->vfs, fd, &iov, 1, (i64)offset);
+  mprotect(mmu_host(&m->mmu, guest_addr), ROUNDUP(len, getpagesize()),
+           convert_prot(prot));
+  return guest_addr;
+}
+
+static u64 handler_mmap(Machine* m) {
+  u64 addr = machine_get_xreg(m, XREG_A0);
+  u64 len = machine_get_xreg(m, XREG_A1);
+  u64 prot = machine_get_xreg(m, XREG_A2);
+  u64 flags = machine_get_xreg(m, XREG_A3);
+  int host_fd = machine_host_fd(m, machine_get_xreg(m, XREG_A4));
+  u64 offset = machine_get_xreg(m, XREG_A5);
+  if (vfs_owns(&m->vfs, host_fd) && !(flags & NEWLIB_MAP_ANONYMOUS)) {
+    return map_vfs_file(m, addr, len, prot, flags, host_fd, offset);
+  }
+  return mmu_map(&m->mmu, addr, len, convert_prot(prot),
+                 convert_mmap_flags(flags), host_fd, offset);
+}
+
+static u64 handler_munmap(Machine* m) {
+  u64 addr = machine_get_xreg(m, XREG_A0);
+  u64 len = machine_get_xreg(m, XREG_A1);
+  return mmu_unmap(&m->mmu, addr, len);
+}
+
+// The fork-server marker: the guest parks here once its start-up work is
+// done and wakes up in a fresh child per request with a0/a1 = argc/argv.
+static u64 handler_rvemu_forksrv(Machine* m) {
+  if (!m->forksrv.enabled || !m->forksrv.at_marker) return -ENOSYS;
+
+  outbuf_flush(&m->outbuf);
+  ForkRequest req = forksrv_serve(&m->forksrv);
+  u64 argv = machine_alloc_argv(m, req.argc, req.argv);
+  if (argv == 0) return -ENOMEM;
+  machine_set_xreg(m, XREG_A1, argv);
+  return req.argc - 1;
+}
+
+// Checkpoint: saves the machine to the --snapshot file and returns 0. A run
+// started from that file with --restore sees the same call return 1.
+static u64 handler_rvemu_snapshot(Machine* m) {
+  if (!m->snapshot_path) return -ENOSYS;
+
+  outbuf_flush(&m->outbuf);
+  return snapshot_save(m, m->snapshot_path) ? 0 : -EIO;
+}
+
+// Like setjmp: returns 0 once the checkpoint is taken, and the value given
+// to SYS_RVEMU_RESET each time the guest is reset back to it.
+static u64 handler_rvemu_checkpoint(Machine* m) {
+  return machine_checkpoint(m) ? 0 : -ENOMEM;
+}
+
+static u64 handler_rvemu_reset(Machine* m) {
+  if (!m->mmu.dirty.active) return -ENOSYS;
+
+  u64 val = machine_get_xreg(m, XREG_A0);
+  machine_reset(m);
+  return val != 0 ? val : 1;
+}
+
+// Returns the length of the next fuzz input, copied to the buffer in a0. A
+// second call without SYS_RVEMU_FUZZ_END in between ends the run first.
+static u64 handler_rvemu_fuzz_start(Machine* m) {
+  if (!m->fuzz.enabled) return -ENOSYS;
+
+  if (!m->fuzz.started) {
+    m->fuzz.buf = machine_get_xreg(m, XREG_A0);
+    m->fuzz.max_len = machine_get_xreg(m, XREG_A1);
+  }
+  return machine_fuzz_next(m, 0);
+}
+
+static u64 handler_rvemu_fuzz_end(Machine* m) {
+  if (!m->fuzz.started) return -ENOSYS;
+  return machine_fuzz_next(m, 0);
 }
 
 static u64 handler_ni_syscall(Machine* m) {
@@ -112,7 +629,7 @@ static u64 handler_ni_syscall(Machine* m) {
 static u64 (*rv_syscall_handler[])(Machine*) = {
     [SYS_EXIT] = handler_exit,
     [SYS_EXIT_GROUP] = handler_exit,
-    [SYS_GETPID] = handler_ni_syscall,
+    [SYS_GETPID] = handler_getpid,
     [SYS_KILL] = handler_ni_syscall,
     [SYS_TGKILL] = handler_ni_syscall,
     [SYS_READ] = handler_read,
@@ -130,8 +647,11 @@ static u64 (*rv_syscall_handler[])(Machine*) = {
     [SYS_FSTAT] = handler_fstat,
     [SYS_FSTATAT] = handler_ni_syscall,
     [SYS_FACCESSAT] = handler_ni_syscall,
-    [SYS_PREAD] = handler_ni_syscall,
-    [SYS_PWRITE] = handler_ni_syscall,
+    [SYS_PREAD] = handler_pread,
+    [SYS_PWRITE] = handler_pwrite,
+    [SYS_READV] = handler_readv,
+    [SYS_PREADV] = handler_preadv,
+    [SYS_PWRITEV] = handler_pwritev,
     [SYS_UNAME] = handler_ni_syscall,
     [SYS_GETUID] = handler_ni_syscall,
     [SYS_GETEUID] = handler_ni_syscall,
@@ -139,15 +659,16 @@ static u64 (*rv_syscall_handler[])(Machine*) = {
     [SYS_GETEGID] = handler_ni_syscall,
     [SYS_GETTID] = handler_ni_syscall,
     [SYS_SYSINFO] = handler_ni_syscall,
-    [SYS_MMAP] = handler_ni_syscall,
-    [SYS_MUNMAP] = handler_ni_syscall,
+    [SYS_MMAP] = handler_mmap,
+    [SYS_MUNMAP] = handler_munmap,
     [SYS_MREMAP] = handler_ni_syscall,
     [SYS_MPROTECT] = handler_ni_syscall,
     [SYS_PRLIMIT64] = handler_ni_syscall,
     [SYS_RT_SIGACTION] = handler_ni_syscall,
-    [SYS_WRITEV] = handler_ni_syscall,
+    [SYS_WRITEV] = handler_writev,
     [SYS_GETTIMEOFDAY] = handler_gettimeofday,
-    [SYS_TIMES] = handler_ni_syscall,
+    [SYS_TIMES] = handler_times,
+    [SYS_FSYNC] = handler_fsync,
     [SYS_FCNTL] = handler_ni_syscall,
     [SYS_FTRUNCATE] = handler_ni_syscall,
     [SYS_GETDENTS] = handler_ni_syscall,
@@ -159,19 +680,45 @@ static u64 (*rv_syscall_handler[])(Machine*) = {
     [SYS_GETRLIMIT] = handler_ni_syscall,
     [SYS_SETRLIMIT] = handler_ni_syscall,
     [SYS_GETRUSAGE] = handler_ni_syscall,
-    [SYS_CLOCK_GETTIME] = handler_ni_syscall,
+    [SYS_CLOCK_GETTIME] = handler_clock_gettime,
+    [SYS_CLOCK_GETRES] = handler_clock_getres,
     [SYS_SET_TID_ADDRESS] = handler_ni_syscall,
     [SYS_SET_ROBUST_LIST] = handler_ni_syscall,
     [SYS_MADVISE] = handler_ni_syscall,
     [SYS_STATX] = handler_ni_syscall,
 };
 
+// Syscalls that never block and only touch emulator state or the vDSO.
+// machine_step serves these without unwinding to its caller.
+static const bool rv_syscall_fast[] = {
+    [SYS_GETPID] = true,
+    [SYS_BRK] = true,
+    [SYS_CLOCK_GETTIME] = true,
+    [SYS_CLOCK_GETRES] = true,
+    [SYS_GETTIMEOFDAY] = true,
+    [SYS_TIMES] = true,
+};
+
+static u64 (*rv_hypercall_handler[])(Machine*) = {
+    [SYS_RVEMU_FORKSRV - RVEMU_HYPERCALL_BASE] = handler_rvemu_forksrv,
+    [SYS_RVEMU_SNAPSHOT - RVEMU_HYPERCALL_BASE] = handler_rvemu_snapshot,
+    [SYS_RVEMU_CHECKPOINT - RVEMU_HYPERCALL_BASE] = handler_rvemu_checkpoint,
+    [SYS_RVEMU_RESET - RVEMU_HYPERCALL_BASE] = handler_rvemu_reset,
+    [SYS_RVEMU_FUZZ_START - RVEMU_HYPERCALL_BASE] = handler_rvemu_fuzz_start,
+    [SYS_RVEMU_FUZZ_END - RVEMU_HYPERCALL_BASE] = handler_rvemu_fuzz_end,
+};
+
 static u64 handler_sysopen(Machine* m) {
   u64 file = machine_get_xreg(m, XREG_A0);
   u64 oflag = machine_get_xreg(m, XREG_A1);
   u64 mode = machine_get_xreg(m, XREG_A2);
-  return open((char*)TO_HOST(file), convert_flags(oflag),
-              (mode_t)mode);  // #include <fcntl.h>
+  const char* path = (char*)mmu_host(&m->mmu, file);
+  if (!vfs_passthrough(&m->vfs, path)) {
+    return guest_fd_result(
+        m, vfs_open(&m->vfs, path, convert_flags(oflag), mode));
+  }
+  return guest_fd_result(
+      m, host_result(open(path, convert_flags(oflag), (mode_t)mode)));
 }
 
 #define OLD_SYSCALL_THRESHOLD 1024
@@ -187,14 +734,62 @@ static u64 (*rv_old_syscall_handler[])(Machine*) = {
     [SYS_TIME - OLD_SYSCALL_THRESHOLD] = handler_ni_syscall,
 };
 
+// The call's arguments for replay_outputs_of, which looks at the file of a
+// file mapping on the host and so needs the host fd.
+static const u64* replay_args(const Machine* m, u64 syscall, u64 args[6]) {
+  memcpy(args, &m->state.xregs[XREG_A0], 6 * sizeof(u64));
+  if (syscall == SYS_MMAP) args[4] = machine_host_fd(m, args[4]);
+  return args;
+}
+
+// Recording logs what the handler did. Playing feeds the log back instead of
+// running the handler, except for calls that only change emulator state.
+static u64 replay_syscall(Machine* m, u64 syscall, u64 (*handler)(Machine*)) {
+  u64 buf[6];
+  const u64* args = replay_args(m, syscall, buf);
+  if (m->replay.mode == kReplayRecord) {
+    u64 ret = handler(m);
+    replay_record(&m->replay, &m->mmu, syscall, args, ret);
+    return ret;
+  }
+
+  u64 ret = replay_play(&m->replay, &m->mmu, syscall, args);
+  if (replay_reexecutes(syscall, args) && handler(m) != ret) {
+    FATALF("replay diverged at syscall %lu", syscall);
+  }
+  return ret;
+}
+
+// The host kernel writes these buffers itself, and a write-protected
+// checkpoint page would fail the call with EFAULT rather than fault.
+static void prepare_guest_writes(Machine* m, u64 syscall) {
+  u64 args[6];
+  int n = replay_outputs_of(&m->replay, &m->mmu, syscall,
+                            replay_args(m, syscall, args),
+                            RVEMU_REPLAY_ANY_RET);
+  for (int i = 0; i < n; i++) {
+    mmu_prepare_write(&m->mmu, m->replay.chunks[i].addr,
+                      m->replay.chunks[i].len);
+  }
+}
+
 u64 do_syscall(Machine* m, u64 syscall) {
   u64 (*handler)(Machine*) = NULL;
 
+  u64 seq = 0;
+  if (m->trace.header) {
+    seq = trace_begin(&m->trace, syscall, &m->state.xregs[XREG_A0],
+                      m->state.re_enter_pc - 4);
+  }
+
   if (syscall < SIZEOF_ARRAY(rv_syscall_handler)) {
     handler = rv_syscall_handler[syscall];
   } else if (syscall - OLD_SYSCALL_THRESHOLD <
              SIZEOF_ARRAY(rv_old_syscall_handler)) {
     handler = rv_old_syscall_handler[syscall - OLD_SYSCALL_THRESHOLD];
+  } else if (syscall - RVEMU_HYPERCALL_BASE <
+             SIZEOF_ARRAY(rv_hypercall_handler)) {
+    handler = rv_hypercall_handler[syscall - RVEMU_HYPERCALL_BASE];
   } else if (syscall == SYS_GETMAINVARS) {
     handler = handler_ni_syscall;
   }
@@ -203,5 +798,48 @@ u64 do_syscall(Machine* m, u64 syscall) {
     FATALF("unknown syscall: %lu", syscall);
   }
 
-  return handler(m);
+  if (m->mmu.dirty.active) {
+    prepare_guest_writes(m, syscall);
+  }
+
+  u64 ret = m->replay.mode == kReplayOff ? handler(m)
+                                         : replay_syscall(m, syscall, handler);
+  if (seq != 0) {
+    if (m->syscall_pending) {
+      m->trace_seq = seq;
+    } else {
+      trace_end(&m->trace, seq, ret);
+    }
+  }
+  return ret;
+}
+
+void do_syscall_complete(Uring* ring, u32 wait_nr) {
+  uring_submit(ring, wait_nr);
+
+  struct io_uring_cqe* cqe;
+  while ((cqe = uring_peek_cqe(ring)) != NULL) {
+    Machine* m = (Machine*)cqe->user_data;
+    u64 ret = (i64)cqe->res;
+    if (m->syscall_opens) {
+      ret = guest_fd_result(m, cqe->res);
+      m->syscall_opens = false;
+    }
+    machine_set_xreg(m, XREG_A0, ret);
+    m->syscall_pending = false;
+    if (m->trace_seq != 0) {
+      trace_end(&m->trace, m->trace_seq, ret);
+      m->trace_seq = 0;
+    }
+    uring_cqe_seen(ring);
+  }
+}
+
+bool do_syscall_fast(Machine* m) {
+  u64 syscall = m->state.xregs[XREG_A7];
+  if (syscall >= SIZEOF_ARRAY(rv_syscall_fast) || !rv_syscall_fast[syscall]) {
+    return false;
+  }
+  m->state.xregs[XREG_A0] = do_syscall(m, syscall);
+  return true;
 }
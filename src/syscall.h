@@ -1,9 +1,23 @@
 #ifndef RVEMU_SYSCALL_H_
 #define RVEMU_SYSCALL_H_
 
+#include <stdbool.h>
+
 #include "machine.h"
 #include "types.h"
 
+#define NEWLIB_PROT_READ 0x1
+#define NEWLIB_PROT_WRITE 0x2
+#define NEWLIB_PROT_EXEC 0x4
+
+#define NEWLIB_MAP_SHARED 0x01
+#define NEWLIB_MAP_PRIVATE 0x02
+#define NEWLIB_MAP_FIXED 0x10
+#define NEWLIB_MAP_ANONYMOUS 0x20
+#define NEWLIB_MAP_NORESERVE 0x4000
+#define NEWLIB_MAP_POPULATE 0x8000
+#define NEWLIB_MAP_FIXED_NOREPLACE 0x100000
+
 typedef enum {
   SYS_EXIT = 93,
   SYS_EXIT_GROUP = 94,
@@ -27,6 +41,9 @@ typedef enum {
   SYS_FACCESSAT = 48,
   SYS_PREAD = 67,
   SYS_PWRITE = 68,
+  SYS_READV = 65,
+  SYS_PREADV = 69,
+  SYS_PWRITEV = 70,
   SYS_UNAME = 160,
   SYS_GETUID = 174,
   SYS_GETEUID = 175,
@@ -44,6 +61,7 @@ typedef enum {
   SYS_WRITEV = 66,
   SYS_GETTIMEOFDAY = 169,
   SYS_TIMES = 153,
+  SYS_FSYNC = 82,
   SYS_FCNTL = 25,
   SYS_FTRUNCATE = 46,
   SYS_GETDENTS = 61,
@@ -56,6 +74,7 @@ typedef enum {
   SYS_SETRLIMIT = 164,
   SYS_GETRUSAGE = 165,
   SYS_CLOCK_GETTIME = 113,
+  SYS_CLOCK_GETRES = 114,
   SYS_SET_TID_ADDRESS = 96,
   SYS_SET_ROBUST_LIST = 99,
   SYS_MADVISE = 233,
@@ -73,6 +92,22 @@ typedef enum {
   SYS_TIME = 1062,
 } OldSysCallType;
 
+// Emulator hypercalls, numbered above any Linux or newlib syscall.
+#define RVEMU_HYPERCALL_BASE 0x52560000
+
+typedef enum {
+  SYS_RVEMU_FORKSRV = RVEMU_HYPERCALL_BASE,
+  SYS_RVEMU_SNAPSHOT,
+  SYS_RVEMU_CHECKPOINT,
+  SYS_RVEMU_RESET,
+  SYS_RVEMU_FUZZ_START,
+  SYS_RVEMU_FUZZ_END,
+} HyperCallType;
+
 u64 do_syscall(Machine*, u64);
 
+bool do_syscall_fast(Machine*);
+
+void do_syscall_complete(Uring*, u32);
+
 #endif  // RVEMU_SYSCALL_H_
@@ -0,0 +1,483 @@
+#include "system.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "csr.h"
+#include "interp.h"
+#include "machine.h"
+#include "mmu.h"
+#include "sbi.h"
+#include "utils.h"
+
+#define MSTATUS_SIE (1ULL << 1)
+#define MSTATUS_MIE (1ULL << 3)
+#define MSTATUS_SPIE (1ULL << 5)
+#define MSTATUS_MPIE (1ULL << 7)
+#define MSTATUS_SPP (1ULL << 8)
+#define MSTATUS_MPP_SHIFT 11
+
+#define CLINT_MSIP 0x0
+#define CLINT_MTIMECMP 0x4000
+#define CLINT_MTIME 0xbff8
+
+#define PLIC_PENDING 0x1000
+#define PLIC_ENABLE 0x2000
+#define PLIC_ENABLE_STRIDE 0x80
+#define PLIC_CONTEXT 0x200000
+#define PLIC_CONTEXT_STRIDE 0x1000
+
+#define FINISHER_PASS 0x5555
+#define FINISHER_FAIL 0x3333
+
+static Machine* machine_of(State* state) {
+  return (Machine*)((u8*)state - offsetof(Machine, state));
+}
+
+static u64 now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Has the hart look at its interrupts when it next finishes a block, and
+// wakes it if it is waiting for one in WFI. Both this and system_wfi use
+// sequentially consistent accesses, so either the hart sees the doorbell
+// before it sleeps or we see it asleep.
+static void ring_doorbell(System* sys) {
+  atomic_uint* pending = &sys->m->state.irq_pending;
+  atomic_store(pending, 1);
+  if (atomic_load(&sys->hart_asleep)) {
+    syscall(SYS_futex, pending, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+// the size-byte part of a 64-bit register that off points into
+static u64 reg_read(u64 reg, u64 off, int size) {
+  u64 value = reg >> (off & 7) * 8;
+  return size == 8 ? value : value & ((1ULL << size * 8) - 1);
+}
+
+static u64 reg_write(u64 reg, u64 off, u64 value, int size) {
+  int shift = (off & 7) * 8;
+  u64 mask = size == 8 ? UINT64_MAX : ((1ULL << size * 8) - 1) << shift;
+  return (reg & ~mask) | (value << shift & mask);
+}
+
+u64 system_time(const System* sys) {
+  return (now_ns() - sys->start_ns) / (1000000000ULL / RVEMU_SYSTEM_TIMEBASE);
+}
+
+// Sleeps until mtime reaches mtimecmp and rings the doorbell, so the hart
+// never has to compare the two itself while running.
+static void* timer_main(void* arg) {
+  System* sys = (System*)arg;
+  pthread_mutex_lock(&sys->timer_lock);
+  while (true) {
+    u64 now = system_time(sys);
+    if (now >= sys->mtimecmp) {
+      ring_doorbell(sys);
+      pthread_cond_wait(&sys->timer_cond, &sys->timer_lock);
+      continue;
+    }
+    // an hour at most, so a far-off mtimecmp cannot overflow the deadline
+    u64 ticks = MIN(sys->mtimecmp - now, RVEMU_SYSTEM_TIMEBASE * 3600);
+    u64 deadline_ns =
+        now_ns() + ticks * (1000000000ULL / RVEMU_SYSTEM_TIMEBASE);
+    struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000ULL,
+        .tv_nsec = deadline_ns % 1000000000ULL,
+    };
+    pthread_cond_timedwait(&sys->timer_cond, &sys->timer_lock, &deadline);
+  }
+  return NULL;
+}
+
+void system_set_timer(System* sys, u64 mtimecmp) {
+  pthread_mutex_lock(&sys->timer_lock);
+  sys->mtimecmp = mtimecmp;
+  pthread_cond_signal(&sys->timer_cond);
+  pthread_mutex_unlock(&sys->timer_lock);
+  ring_doorbell(sys);  // a pending timer interrupt may have just cleared
+}
+
+static u64 clint_read(void* ctx, u64 off, int size) {
+  System* sys = (System*)ctx;
+  switch (off & ~7ULL) {
+    case CLINT_MSIP:
+      return reg_read(sys->msip, off, size);
+    case CLINT_MTIMECMP:
+      return reg_read(sys->mtimecmp, off, size);
+    case CLINT_MTIME:
+      return reg_read(system_time(sys), off, size);
+    default:
+      return 0;
+  }
+}
+
+static void clint_write(void* ctx, u64 off, u64 value, int size) {
+  System* sys = (System*)ctx;
+  switch (off & ~7ULL) {
+    case CLINT_MSIP:
+      if (off == CLINT_MSIP) {
+        sys->msip = value & 1;
+        ring_doorbell(sys);
+      }
+      return;
+    case CLINT_MTIMECMP:
+      system_set_timer(sys, reg_write(sys->mtimecmp, off, value, size));
+      return;
+    default:
+      return;  // mtime is read-only here
+  }
+}
+
+// the highest-priority source pending for ctx above its threshold, or 0
+static u32 plic_best(const Plic* plic, int ctx) {
+  u32 pending = atomic_load(&plic->level) & ~plic->claimed & plic->enable[ctx];
+  u32 best = 0;
+  u32 best_priority = plic->threshold[ctx];
+  for (u32 id = 1; id < RVEMU_PLIC_SOURCES; id++) {
+    if ((pending >> id & 1) && plic->priority[id] > best_priority) {
+      best = id;
+      best_priority = plic->priority[id];
+    }
+  }
+  return best;
+}
+
+static u64 plic_read(void* ctx, u64 off, int size) {
+  System* sys = (System*)ctx;
+  Plic* plic = &sys->plic;
+  if (off < 4 * RVEMU_PLIC_SOURCES) return plic->priority[off / 4];
+  if (off == PLIC_PENDING) return atomic_load(&plic->level) & ~plic->claimed;
+  if (off >= PLIC_ENABLE && off < PLIC_CONTEXT) {
+    u64 c = (off - PLIC_ENABLE) / PLIC_ENABLE_STRIDE;
+    bool first = (off - PLIC_ENABLE) % PLIC_ENABLE_STRIDE == 0;
+    return c < RVEMU_PLIC_CONTEXTS && first ? plic->enable[c] : 0;
+  }
+  if (off >= PLIC_CONTEXT) {
+    u64 c = (off - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+    u64 reg = (off - PLIC_CONTEXT) % PLIC_CONTEXT_STRIDE;
+    if (c >= RVEMU_PLIC_CONTEXTS) return 0;
+    if (reg == 0) return plic->threshold[c];
+    if (reg == 4) {  // claim
+      u32 id = plic_best(plic, c);
+      plic->claimed |= 1U << id & ~1U;
+      ring_doorbell(sys);
+      return id;
+    }
+  }
+  return 0;
+}
+
+static void plic_write(void* ctx, u64 off, u64 value, int size) {
+  System* sys = (System*)ctx;
+  Plic* plic = &sys->plic;
+  if (off < 4 * RVEMU_PLIC_SOURCES) {
+    plic->priority[off / 4] = value & 7;
+  } else if (off >= PLIC_ENABLE && off < PLIC_CONTEXT) {
+    u64 c = (off - PLIC_ENABLE) / PLIC_ENABLE_STRIDE;
+    bool first = (off - PLIC_ENABLE) % PLIC_ENABLE_STRIDE == 0;
+    if (c < RVEMU_PLIC_CONTEXTS && first) plic->enable[c] = value & ~1U;
+  } else if (off >= PLIC_CONTEXT) {
+    u64 c = (off - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+    u64 reg = (off - PLIC_CONTEXT) % PLIC_CONTEXT_STRIDE;
+    if (c >= RVEMU_PLIC_CONTEXTS) return;
+    if (reg == 0) plic->threshold[c] = value & 7;
+    if (reg == 4 && value < RVEMU_PLIC_SOURCES) {  // complete
+      plic->claimed &= ~(1U << value);
+    }
+  }
+  ring_doorbell(sys);
+}
+
+// Drives a PLIC source's line. Lines are level-triggered, and any thread
+// may call this.
+void system_set_irq(System* sys, u32 id, bool level) {
+  if (level) {
+    atomic_fetch_or(&sys->plic.level, 1U << id);
+  } else {
+    atomic_fetch_and(&sys->plic.level, ~(1U << id));
+  }
+  ring_doorbell(sys);
+}
+
+// SiFive's test finisher, which bare-metal tests write to power off
+static u64 finisher_read(void* ctx, u64 off, int size) { return 0; }
+
+static void finisher_write(void* ctx, u64 off, u64 value, int size) {
+  System* sys = (System*)ctx;
+  u32 status = value & 0xffff;
+  if (off != 0 || (status != FINISHER_PASS && status != FINISHER_FAIL)) {
+    return;
+  }
+  sys->m->exit_code = status == FINISHER_PASS ? 0 : (value >> 16) & 0xffff;
+  sys->m->halted = true;
+  ring_doorbell(sys);
+}
+
+void system_add_device(System* sys, u64 base, u64 size,
+                       u64 (*read)(void*, u64, int),
+                       void (*write)(void*, u64, u64, int), void* ctx) {
+  if (sys->num_devices == RVEMU_SYSTEM_MAX_DEVICES) {
+    FATAL("too many system devices");
+  }
+  sys->devices[sys->num_devices++] = (SystemDevice){
+      .base = base,
+      .size = size,
+      .read = read,
+      .write = write,
+      .ctx = ctx,
+  };
+}
+
+// Host memory for [addr, addr + len) of guest RAM, or NULL when the range
+// is not all RAM. Devices use it for DMA.
+void* system_ram(System* sys, u64 addr, u64 len) {
+  u64 off = addr - RVEMU_SYSTEM_RAM_BASE;
+  if (addr < RVEMU_SYSTEM_RAM_BASE || off > sys->ram_size ||
+      len > sys->ram_size - off) {
+    return NULL;
+  }
+  return mmu_host(&sys->m->mmu, addr);
+}
+
+static SystemDevice* find_device(System* sys, u64 addr) {
+  for (int i = 0; i < sys->num_devices; i++) {
+    SystemDevice* dev = &sys->devices[i];
+    if (addr - dev->base < dev->size) return dev;
+  }
+  return NULL;
+}
+
+// unclaimed addresses below RAM read as zero and ignore writes
+static u64 system_mmio_read(State* state, u64 addr, int size) {
+  SystemDevice* dev = find_device(machine_of(state)->sys, addr);
+  return dev ? dev->read(dev->ctx, addr - dev->base, size) : 0;
+}
+
+static void system_mmio_write(State* state, u64 addr, u64 value, int size) {
+  SystemDevice* dev = find_device(machine_of(state)->sys, addr);
+  if (dev) dev->write(dev->ctx, addr - dev->base, value, size);
+}
+
+static u64 system_read_time(State* state) {
+  return system_time(machine_of(state)->sys);
+}
+
+// Maps ram_size bytes of RAM into m and attaches the CLINT, PLIC and test
+// finisher. The hart starts in M mode with a0 holding its id, 0.
+bool system_init(System* sys, Machine* m, u64 ram_size) {
+  *sys = (System){.m = m, .ram_size = ram_size, .mtimecmp = UINT64_MAX};
+  u64 ram = mmu_map(&m->mmu, RVEMU_SYSTEM_RAM_BASE, ram_size,
+                    PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if (ram != RVEMU_SYSTEM_RAM_BASE) return false;
+
+  m->sys = sys;
+  m->trap_all_syscalls = true;  // every ECALL traps into the guest
+  m->state.mode = kMachine;
+  m->state.mmio_end = RVEMU_SYSTEM_RAM_BASE;
+  m->state.mmio_read = system_mmio_read;
+  m->state.mmio_write = system_mmio_write;
+  m->state.read_time = system_read_time;
+
+  system_add_device(sys, RVEMU_SYSTEM_FINISHER_BASE, 0x1000, finisher_read,
+                    finisher_write, sys);
+  system_add_device(sys, RVEMU_SYSTEM_CLINT_BASE, RVEMU_SYSTEM_CLINT_SIZE,
+                    clint_read, clint_write, sys);
+  system_add_device(sys, RVEMU_SYSTEM_PLIC_BASE, RVEMU_SYSTEM_PLIC_SIZE,
+                    plic_read, plic_write, sys);
+
+  sys->start_ns = now_ns();
+  pthread_mutex_init(&sys->timer_lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sys->timer_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&sys->timer, NULL, timer_main, sys) != 0) return false;
+  pthread_detach(sys->timer);
+  return true;
+}
+
+// Loads a riscv64 ELF at its physical addresses, or anything else as a raw
+// image at the start of RAM, and points the hart at it. Returns false with
+// errno set.
+bool system_load(System* sys, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  Machine* m = sys->m;
+  MmuImage image;
+  bool ok;
+  if (mmu_open_image(&image, fd)) {
+    ok = mmu_map_image(&m->mmu, &image);
+    m->state.pc = image.entry;
+  } else {
+    struct stat st;
+    ok = fstat(fd, &st) == 0;
+    if (ok && (u64)st.st_size > sys->ram_size) {
+      errno = EFBIG;
+      ok = false;
+    }
+    if (ok) {
+      void* ram = mmu_host(&m->mmu, RVEMU_SYSTEM_RAM_BASE);
+      ok = pread(fd, ram, st.st_size, 0) == st.st_size;
+    }
+    m->state.pc = RVEMU_SYSTEM_RAM_BASE;
+  }
+  int err = errno;
+  close(fd);
+  errno = err;
+  return ok;
+}
+
+// Copies a flattened device tree to the end of RAM and passes its address
+// in a1, as firmware and kernels expect.
+bool system_load_dtb(System* sys, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0 && (u64)st.st_size < sys->ram_size;
+  if (ok) {
+    u64 addr =
+        ROUNDDOWN(RVEMU_SYSTEM_RAM_BASE + sys->ram_size - st.st_size, 4096);
+    ok = pread(fd, mmu_host(&sys->m->mmu, addr), st.st_size, 0) ==
+         st.st_size;
+    sys->m->state.xregs[XREG_A1] = addr;
+  }
+  close(fd);
+  return ok;
+}
+
+// Enters the trap handler for cause at state.pc, in S mode when the trap
+// comes from S or U mode and is delegated, in M mode otherwise.
+void system_trap(Machine* m, u64 cause, u64 tval) {
+  State* state = &m->state;
+  u64* csrs = state->csrs;
+  bool interrupt = cause & CAUSE_INTERRUPT;
+  u64 code = cause & ~CAUSE_INTERRUPT;
+  u64 deleg = interrupt ? csrs[CSR_MIDELEG] : csrs[CSR_MEDELEG];
+
+  u64 tvec;
+  if (state->mode <= kSupervisor && (deleg >> code & 1)) {
+    csrs[CSR_SEPC] = state->pc;
+    csrs[CSR_SCAUSE] = cause;
+    csrs[CSR_STVAL] = tval;
+    u64 status =
+        csrs[CSR_MSTATUS] & ~(MSTATUS_SPIE | MSTATUS_SIE | MSTATUS_SPP);
+    if (csrs[CSR_MSTATUS] & MSTATUS_SIE) status |= MSTATUS_SPIE;
+    if (state->mode == kSupervisor) status |= MSTATUS_SPP;
+    csrs[CSR_MSTATUS] = status;
+    state->mode = kSupervisor;
+    tvec = csrs[CSR_STVEC];
+  } else {
+    csrs[CSR_MEPC] = state->pc;
+    csrs[CSR_MCAUSE] = cause;
+    csrs[CSR_MTVAL] = tval;
+    u64 status = csrs[CSR_MSTATUS] &
+                 ~(MSTATUS_MPIE | MSTATUS_MIE | 3ULL << MSTATUS_MPP_SHIFT);
+    if (csrs[CSR_MSTATUS] & MSTATUS_MIE) status |= MSTATUS_MPIE;
+    status |= (u64)(state->mode & 3) << MSTATUS_MPP_SHIFT;
+    csrs[CSR_MSTATUS] = status;
+    state->mode = kMachine;
+    tvec = csrs[CSR_MTVEC];
+  }
+
+  state->pc = tvec & ~3ULL;
+  if ((tvec & 3) == 1 && interrupt) {
+    state->pc += 4 * code;
+  }
+  state->cont = false;
+}
+
+// in the order the privileged spec takes them when several are pending
+static const u64 interrupt_order[] = {11, 3, 7, 9, 1, 5};
+
+// Called between blocks once irq_pending is set: folds device state into
+// mip and takes the highest-priority interrupt that is enabled. Returns
+// true when the machine has halted instead.
+static void update_mip(System* sys, State* state) {
+  u64 mip = state->csrs[CSR_MIP] & ~(MIP_MSIP | MIP_MTIP | MIP_MEIP | MIP_SEIP);
+  if (sys->msip) mip |= MIP_MSIP;
+  // with no firmware to forward it, the timer goes straight to S mode and
+  // stays pending until the next SBI set_timer
+  if (system_time(sys) >= sys->mtimecmp) {
+    mip |= sys->sbi ? MIP_STIP : MIP_MTIP;
+  }
+  if (plic_best(&sys->plic, 0)) mip |= MIP_MEIP;
+  if (plic_best(&sys->plic, 1)) mip |= MIP_SEIP;
+  state->csrs[CSR_MIP] = mip;
+}
+
+bool system_interrupt(Machine* m) {
+  State* state = &m->state;
+  atomic_exchange_explicit(&state->irq_pending, 0, memory_order_acquire);
+  System* sys = m->sys;
+  if (!sys) return false;
+  if (m->halted) return true;
+
+  update_mip(sys, state);
+  u64 mip = state->csrs[CSR_MIP];
+
+  u64 pending = mip & state->csrs[CSR_MIE];
+  u64 mideleg = state->csrs[CSR_MIDELEG];
+  u64 mstatus = state->csrs[CSR_MSTATUS];
+  u64 enabled = 0;
+  if (state->mode < kMachine || (mstatus & MSTATUS_MIE)) {
+    enabled = pending & ~mideleg;
+  }
+  if (!enabled && (state->mode < kSupervisor ||
+                   (state->mode == kSupervisor && (mstatus & MSTATUS_SIE)))) {
+    enabled = pending & mideleg;
+  }
+
+  for (u64 i = 0; enabled && i < SIZEOF_ARRAY(interrupt_order); i++) {
+    if (enabled >> interrupt_order[i] & 1) {
+      system_trap(m, CAUSE_INTERRUPT | interrupt_order[i], 0);
+      break;
+    }
+  }
+  return false;
+}
+
+// Idles the hart in WFI until an interrupt is pending in mie, enabled
+// globally or not, as the spec has it. The timer thread rings the doorbell
+// at mtimecmp, so sleeping on irq_pending covers the timer as well as the
+// devices. The doorbell is left rung for system_interrupt to take over.
+void system_wfi(Machine* m) {
+  System* sys = m->sys;
+  State* state = &m->state;
+  atomic_store(&sys->hart_asleep, true);
+  while (!m->halted) {
+    if (atomic_exchange(&state->irq_pending, 0)) update_mip(sys, state);
+    if (state->csrs[CSR_MIP] & state->csrs[CSR_MIE]) break;
+    syscall(SYS_futex, &state->irq_pending, FUTEX_WAIT_PRIVATE, 0, NULL,
+            NULL, 0);
+  }
+  atomic_store(&sys->hart_asleep, false);
+  atomic_store(&state->irq_pending, 1);
+}
+
+// Runs the hart until the guest powers off and returns the exit code.
+int system_run(Machine* m) {
+  while (!m->halted) {
+    if (machine_step(m) != kECall) continue;
+    if (m->sys->sbi && m->state.mode == kSupervisor) {
+      do_sbi_call(m);
+      continue;
+    }
+    m->state.pc -= 4;  // the exception is taken at the ECALL itself
+    system_trap(m, CAUSE_ECALL_FROM_U + (m->state.mode & 3), 0);
+  }
+  return m->exit_code;
+}
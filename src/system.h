@@ -0,0 +1,89 @@
+#ifndef RVEMU_SYSTEM_H_
+#define RVEMU_SYSTEM_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "types.h"
+
+// Physical memory map, laid out like QEMU's virt board.
+#define RVEMU_SYSTEM_FINISHER_BASE 0x00100000ULL
+#define RVEMU_SYSTEM_CLINT_BASE 0x02000000ULL
+#define RVEMU_SYSTEM_CLINT_SIZE 0x10000ULL
+#define RVEMU_SYSTEM_PLIC_BASE 0x0c000000ULL
+#define RVEMU_SYSTEM_PLIC_SIZE 0x4000000ULL
+#define RVEMU_SYSTEM_RAM_BASE 0x80000000ULL
+#define RVEMU_SYSTEM_RAM_DEFAULT (128ULL << 20)
+
+#define RVEMU_SYSTEM_TIMEBASE 10000000ULL  // mtime ticks per second
+#define RVEMU_SYSTEM_MAX_DEVICES 16
+#define RVEMU_PLIC_SOURCES 32  // ids 1 to 31, 0 meaning none
+#define RVEMU_PLIC_CONTEXTS 2  // hart 0 in M mode, then in S mode
+
+typedef struct Machine Machine;
+
+// A memory-mapped device. Offsets are from base, and size is 1, 2, 4 or 8.
+typedef struct {
+  u64 base;
+  u64 size;
+  u64 (*read)(void*, u64, int);
+  void (*write)(void*, u64, u64, int);
+  void* ctx;
+} SystemDevice;
+
+typedef struct {
+  u32 priority[RVEMU_PLIC_SOURCES];
+  atomic_uint level;  // interrupt lines as the devices drive them
+  u32 claimed;        // claimed and not yet completed
+  u32 enable[RVEMU_PLIC_CONTEXTS];
+  u32 threshold[RVEMU_PLIC_CONTEXTS];
+} Plic;
+
+// Full-system mode: one hart that starts in M mode at the loaded image,
+// with RAM at RVEMU_SYSTEM_RAM_BASE and devices below it. Devices and the
+// timer thread only ever raise the State's irq_pending word; the hart folds
+// device state into mip when it next finishes a block, so the interpreter
+// pays for interrupts with a single relaxed load per block.
+typedef struct {
+  Machine* m;
+  u64 ram_size;
+  u64 start_ns;  // host CLOCK_MONOTONIC at mtime 0
+  SystemDevice devices[RVEMU_SYSTEM_MAX_DEVICES];
+  int num_devices;
+  u32 msip;
+  u64 mtimecmp;  // written by the hart, read by the timer thread
+  pthread_mutex_t timer_lock;
+  pthread_cond_t timer_cond;
+  pthread_t timer;
+  Plic plic;
+  bool sbi;  // S-mode ECALLs go to do_sbi_call, not to M-mode firmware
+  atomic_bool hart_asleep;  // in WFI, so ringing the doorbell must wake it
+} System;
+
+bool system_init(System*, Machine*, u64);
+
+bool system_load(System*, const char*);
+
+bool system_load_dtb(System*, const char*);
+
+void system_add_device(System*, u64, u64, u64 (*)(void*, u64, int),
+                       void (*)(void*, u64, u64, int), void*);
+
+void system_set_irq(System*, u32, bool);
+
+u64 system_time(const System*);
+
+void* system_ram(System*, u64, u64);
+
+void system_set_timer(System*, u64);
+
+void system_trap(Machine*, u64, u64);
+
+bool system_interrupt(Machine*);
+
+void system_wfi(Machine*);
+
+int system_run(Machine*);
+
+#endif  // RVEMU_SYSTEM_H_
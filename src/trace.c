@@ -0,0 +1,75 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static u64 trace_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns false with errno set when the file cannot be made.
+bool trace_open(Trace* trace, const char* path, u64 capacity) {
+  if (capacity == 0 || capacity > (INT64_MAX - RVEMU_TRACE_HEADER_SIZE) /
+                                      sizeof(TraceRecord)) {
+    errno = EOVERFLOW;
+    return false;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return false;
+
+  size_t size = RVEMU_TRACE_HEADER_SIZE + capacity * sizeof(TraceRecord);
+  if (ftruncate(fd, size) == -1) {
+    close(fd);
+    return false;
+  }
+
+  u8* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return false;
+
+  trace->header = (TraceHeader*)base;
+  trace->records = (TraceRecord*)(base + RVEMU_TRACE_HEADER_SIZE);
+  trace->header->magic = RVEMU_TRACE_MAGIC;
+  trace->header->record_size = sizeof(TraceRecord);
+  trace->header->capacity = capacity;
+  trace->header->head = 0;
+  return true;
+}
+
+// The record is written before the handler runs, so a call that never
+// returns (exit, or a crash inside the handler) still shows up in the ring.
+u64 trace_begin(Trace* trace, u64 nr, const u64* args, u64 pc) {
+  u64 seq = __atomic_add_fetch(&trace->header->head, 1, __ATOMIC_RELAXED);
+  TraceRecord* rec = &trace->records[(seq - 1) % trace->header->capacity];
+  rec->seq = seq;
+  rec->nr = nr;
+  for (int i = 0; i < 6; i++) {
+    rec->args[i] = args[i];
+  }
+  rec->ret = 0;
+  rec->pc = pc;
+  rec->timestamp_ns = trace_now_ns();
+  rec->duration_ns = RVEMU_TRACE_PENDING;
+  return seq;
+}
+
+void trace_end(Trace* trace, u64 seq, u64 ret) {
+  TraceRecord* rec = &trace->records[(seq - 1) % trace->header->capacity];
+  if (rec->seq != seq) return;  // overwritten while the call was in flight
+  rec->ret = ret;
+  rec->duration_ns = trace_now_ns() - rec->timestamp_ns;
+}
+
+void trace_destroy(Trace* trace) {
+  if (!trace->header) return;
+  munmap(trace->header, RVEMU_TRACE_HEADER_SIZE +
+                            trace->header->capacity * sizeof(TraceRecord));
+  trace->header = NULL;
+  trace->records = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef RVEMU_TRACE_H_
+#define RVEMU_TRACE_H_
+
+#include <stdbool.h>
+
+#include "types.h"
+
+#define RVEMU_TRACE_MAGIC 0x3145434152545652ULL  // "RVTRACE1"
+#define RVEMU_TRACE_HEADER_SIZE 4096
+#define RVEMU_TRACE_DEFAULT_RECORDS (64 * 1024)
+#define RVEMU_TRACE_PENDING UINT64_MAX
+
+// The trace file is a header page followed by a ring of fixed-size records,
+// mmap'd shared so the kernel keeps it even if the emulator dies mid-run.
+typedef struct {
+  u64 magic;
+  u64 record_size;
+  u64 capacity;
+  // records ever written, bumped atomically since fork-server children all
+  // append to the one ring; the slot of record n is (n - 1) % capacity
+  u64 head;
+} TraceHeader;
+
+typedef struct {
+  u64 seq;  // 1-based, 0 marks a slot that was never written
+  u64 nr;
+  u64 args[6];
+  u64 ret;
+  u64 pc;
+  u64 timestamp_ns;
+  u64 duration_ns;  // RVEMU_TRACE_PENDING until the call returns
+} TraceRecord;
+
+typedef struct {
+  TraceHeader* header;  // NULL when tracing is off
+  TraceRecord* records;
+} Trace;
+
+bool trace_open(Trace*, const char*, u64);
+
+u64 trace_begin(Trace*, u64, const u64*, u64);
+
+void trace_end(Trace*, u64, u64);
+
+void trace_destroy(Trace*);
+
+#endif  // RVEMU_TRACE_H_
@@ -0,0 +1,119 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+static int io_uring_setup(u32 entries, struct io_uring_params* p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, u32 to_submit, u32 min_complete,
+                          u32 flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+bool uring_init(Uring* ring, u32 entries) {
+  struct io_uring_params p = {0};
+  int fd = io_uring_setup(entries, &p);
+  if (fd < 0) return false;
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(u32);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size = cq_size = MAX(sq_size, cq_size);
+  }
+
+  u8* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  u8* cq = sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+  }
+  struct io_uring_sqe* sqes =
+      mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+           IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  ring->fd = fd;
+  ring->sq_entries = p.sq_entries;
+  ring->sq_head = (u32*)(sq + p.sq_off.head);
+  ring->sq_tail = (u32*)(sq + p.sq_off.tail);
+  ring->sq_mask = (u32*)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (u32*)(sq + p.sq_off.array);
+  ring->sqes = sqes;
+  ring->sqe_tail = *ring->sq_tail;
+  ring->cq_head = (u32*)(cq + p.cq_off.head);
+  ring->cq_tail = (u32*)(cq + p.cq_off.tail);
+  ring->cq_mask = (u32*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  ring->inflight = 0;
+  ring->owned = false;
+  return true;
+}
+
+static void uring_check_owner(Uring* ring) {
+  pthread_t self = pthread_self();
+  if (!ring->owned) {
+    ring->owner = self;
+    ring->owned = true;
+  } else if (!pthread_equal(ring->owner, self)) {
+    FATAL("io_uring used from a second thread");
+  }
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+  uring_check_owner(ring);
+  u32 head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sqe_tail - head == ring->sq_entries) {
+    // the queue is full of unsubmitted entries, push them out first
+    if (uring_submit(ring, 0) < 0) return NULL;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head == ring->sq_entries) return NULL;
+  }
+
+  u32 idx = ring->sqe_tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[idx] = idx;
+  ring->sqe_tail++;
+  return sqe;
+}
+
+int uring_submit(Uring* ring, u32 wait_nr) {
+  uring_check_owner(ring);
+  u32 to_submit = ring->sqe_tail - *ring->sq_tail;
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  if (to_submit == 0 && wait_nr == 0) return 0;
+
+  int ret;
+  do {
+    ret = io_uring_enter(ring->fd, to_submit, wait_nr,
+                         wait_nr ? IORING_ENTER_GETEVENTS : 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret > 0) {
+    ring->inflight += ret;
+  }
+  return ret;
+}
+
+struct io_uring_cqe* uring_peek_cqe(Uring* ring) {
+  u32 head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring* ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+  ring->inflight--;
+}
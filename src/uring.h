@@ -0,0 +1,48 @@
+#ifndef RVEMU_URING_H_
+#define RVEMU_URING_H_
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "types.h"
+
+#define RVEMU_URING_ENTRIES 256
+
+// A minimal io_uring wrapper over the raw syscalls. Entries taken with
+// uring_get_sqe() are only handed to the kernel by uring_submit(), so any
+// number of guest requests queued in between go out in one io_uring_enter.
+//
+// There is no locking: a ring belongs to the first thread that queues on it,
+// the main thread for a lone guest or a scheduler worker for its own ring,
+// and use from any other thread is fatal. Completions carry -errno in res,
+// as the blocking fallbacks of the syscall handlers return.
+typedef struct {
+  int fd;
+  u32 sq_entries;
+  u32* sq_head;
+  u32* sq_tail;
+  u32* sq_mask;
+  u32* sq_array;
+  struct io_uring_sqe* sqes;
+  u32 sqe_tail;
+  u32* cq_head;
+  u32* cq_tail;
+  u32* cq_mask;
+  struct io_uring_cqe* cqes;
+  u32 inflight;
+  bool owned;
+  pthread_t owner;
+} Uring;
+
+bool uring_init(Uring*, u32);
+
+struct io_uring_sqe* uring_get_sqe(Uring*);
+
+int uring_submit(Uring*, u32);
+
+struct io_uring_cqe* uring_peek_cqe(Uring*);
+
+void uring_cqe_seen(Uring*);
+
+#endif  // RVEMU_URING_H_
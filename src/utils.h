@@ -13,12 +13,13 @@
 #define ROUNDDOWN(x, k) ((x) & -(k))
 #define ROUNDUP(x, k) (((x) + (k)-1) & -(k))
 #define MIN(x, y) ((y) > (x) ? (x) : (y))
-#define MAX(x, y) ((y) < (y) ? (x) : (y))
+#define MAX(x, y) ((y) < (x) ? (x) : (y))
 
-#define GUEST_MEMORY_OFFSET 0x0000088800000000ULL
-
-#define TO_HOST(addr) (addr + GUEST_MEMORY_OFFSET)
-#define TO_GUEST(addr) (addr - GUEST_MEMORY_OFFSET)
+// Guest memory lives at a per-machine base, see mmu_init. Addresses wrap
+// around the window of RVEMU_MMU_GUEST_LIMIT bytes (in mmu.h), so a wild
+// one still lands in the machine's own memory.
+#define TO_HOST(base, addr) (((addr) & (RVEMU_MMU_GUEST_LIMIT - 1)) + (base))
+#define TO_GUEST(base, addr) ((addr) - (base))
 
 #define SIZEOF_ARRAY(a) (sizeof(a) / sizeof(a[0]))
 
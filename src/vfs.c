@@ -0,0 +1,383 @@
+#include "vfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// Writes path to out as an absolute path with no ".", ".." or repeated
+// slashes. Returns false when it does not fit in PATH_MAX.
+static bool vfs_normalize(const char* path, char out[PATH_MAX]) {
+  char full[PATH_MAX];
+  if (path[0] == '/') {
+    if (strlen(path) >= sizeof(full)) return false;
+    strcpy(full, path);
+  } else {
+    if (!getcwd(full, sizeof(full))) return false;
+    size_t n = strlen(full);
+    if (n + 1 + strlen(path) >= sizeof(full)) return false;
+    full[n] = '/';
+    strcpy(full + n + 1, path);
+  }
+
+  size_t len = 0;
+  for (const char* p = full; *p;) {
+    while (*p == '/') p++;
+    const char* end = p;
+    while (*end && *end != '/') end++;
+    size_t n = end - p;
+    if (n == 2 && p[0] == '.' && p[1] == '.') {
+      while (len > 0 && out[--len] != '/') continue;
+    } else if (n > 0 && !(n == 1 && p[0] == '.')) {
+      out[len++] = '/';  // never longer than full, so this fits
+      memcpy(out + len, p, n);
+      len += n;
+    }
+    p = end;
+  }
+  if (len == 0) out[len++] = '/';
+  out[len] = '\0';
+  return true;
+}
+
+// whether normalized path is prefix itself or inside it
+static bool vfs_under(const char* path, const char* prefix) {
+  size_t n = strlen(prefix);
+  if (n == 1) return true;  // "/"
+  return strncmp(path, prefix, n) == 0 && (path[n] == '/' || path[n] == '\0');
+}
+
+static VfsFile* vfs_lookup(const Vfs* vfs, const char* path) {
+  for (int i = 0; i < vfs->num_files; i++) {
+    if (strcmp(vfs->files[i]->path, path) == 0) {
+      return vfs->files[i];
+    }
+  }
+  return NULL;
+}
+
+static VfsFile* vfs_create(Vfs* vfs, const char* path) {
+  if (vfs->num_files == RVEMU_VFS_MAX_FILES) return NULL;
+  VfsFile* file = calloc(1, sizeof(VfsFile));
+  file->path = strdup(path);
+  file->host_fd = -1;
+  vfs->files[vfs->num_files++] = file;
+  return file;
+}
+
+static void vfs_release(VfsFile* file) {
+  if (file->host_fd != -1) {
+    if (file->size > 0) {
+      munmap(file->data, file->size);
+    }
+    close(file->host_fd);
+    file->host_fd = -1;
+  } else {
+    free(file->data);
+  }
+  file->data = NULL;
+  file->capacity = 0;
+}
+
+static void vfs_free_file(VfsFile* file) {
+  vfs_release(file);
+  free(file->path);
+  free(file);
+}
+
+// Fills to with a copy of from's contents, mapping a preloaded input again
+// rather than copying it.
+static bool vfs_copy(VfsFile* to, const VfsFile* from) {
+  to->data = NULL;
+  to->size = from->size;
+  to->capacity = from->size;
+  to->host_fd = -1;
+  if (from->host_fd != -1) {
+    to->host_fd = fcntl(from->host_fd, F_DUPFD_CLOEXEC, 0);
+    if (to->host_fd == -1) return false;
+    if (from->size > 0) {
+      to->data = mmap(NULL, from->size, PROT_READ, MAP_PRIVATE, to->host_fd, 0);
+      if (to->data == MAP_FAILED) {
+        close(to->host_fd);
+        to->host_fd = -1;
+        to->data = NULL;
+        return false;
+      }
+    }
+  } else if (from->size > 0) {
+    to->data = malloc(from->size);
+    if (!to->data) return false;
+    memcpy(to->data, from->data, from->size);
+  }
+  return true;
+}
+
+// copy-on-write for preloaded inputs, and room to grow for everything else
+static bool vfs_reserve(VfsFile* file, u64 size) {
+  if (file->host_fd == -1 && size <= file->capacity) return true;
+
+  u64 capacity = MIN(file->capacity * 2, RVEMU_VFS_MAX_FILE_SIZE);
+  capacity = MAX(MAX(capacity, size), 4096);
+  u8* data = malloc(capacity);
+  if (!data) return false;
+  if (file->size > 0) {
+    memcpy(data, file->data, file->size);
+  }
+
+  vfs_release(file);
+  file->data = data;
+  file->capacity = capacity;
+  return true;
+}
+
+bool vfs_preload(Vfs* vfs, const char* path) {
+  char name[PATH_MAX];
+  if (!vfs_normalize(path, name)) return false;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return false;
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return false;
+  }
+
+  // map rather than read, so hundreds of guests share one page cache copy
+  u8* data = NULL;
+  if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+  }
+
+  // a path preloaded again replaces what it had
+  VfsFile* file = vfs_lookup(vfs, name);
+  if (file) {
+    vfs_release(file);
+  } else {
+    file = vfs_create(vfs, name);
+  }
+  if (!file) {
+    if (data) munmap(data, st.st_size);
+    close(fd);
+    return false;
+  }
+  file->data = data;
+  file->size = st.st_size;
+  file->capacity = st.st_size;
+  file->host_fd = fd;
+  vfs->enabled = true;
+  return true;
+}
+
+bool vfs_allow(Vfs* vfs, const char* prefix) {
+  char name[PATH_MAX];
+  if (vfs->num_allowed == RVEMU_VFS_MAX_ALLOWED ||
+      !vfs_normalize(prefix, name)) {
+    return false;
+  }
+  vfs->allowed[vfs->num_allowed++] = strdup(name);
+  vfs->enabled = true;
+  return true;
+}
+
+bool vfs_passthrough(const Vfs* vfs, const char* path) {
+  if (!vfs->enabled) return true;
+  char name[PATH_MAX];
+  if (!vfs_normalize(path, name) || vfs_lookup(vfs, name)) return false;
+  for (int i = 0; i < vfs->num_allowed; i++) {
+    if (vfs_under(name, vfs->allowed[i])) return true;
+  }
+  return false;
+}
+
+int vfs_open(Vfs* vfs, const char* path, int flags, int mode) {
+  char name[PATH_MAX];
+  if (!vfs_normalize(path, name)) return -ENAMETOOLONG;
+  VfsFile* file = vfs_lookup(vfs, name);
+  if (file && (flags & O_CREAT) && (flags & O_EXCL)) return -EEXIST;
+  if (!file && !(flags & O_CREAT)) return -ENOENT;
+
+  int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -errno;
+  if (fd >= RVEMU_VFS_MAX_FDS) {
+    close(fd);
+    return -EMFILE;
+  }
+
+  if (!file) {
+    file = vfs_create(vfs, name);
+    if (!file) {
+      close(fd);
+      return -ENOSPC;
+    }
+  }
+
+  if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+    if (file->host_fd != -1) {
+      vfs_release(file);
+    }
+    file->size = 0;
+    file->changed = true;
+  }
+
+  vfs->fds[fd] = (VfsFd){.file = file, .offset = 0, .flags = flags};
+  return fd;
+}
+
+int vfs_close(Vfs* vfs, int fd) {
+  vfs->fds[fd].file = NULL;
+  return close(fd);
+}
+
+i64 vfs_preadv(Vfs* vfs, int fd, const struct iovec* iov, int iovcnt,
+               i64 offset) {
+  VfsFd* vfd = &vfs->fds[fd];
+  if ((vfd->flags & O_ACCMODE) == O_WRONLY) return -EBADF;
+
+  u64 pos = offset < 0 ? vfd->offset : (u64)offset;
+  u64 done = 0;
+  for (int i = 0; i < iovcnt && pos < vfd->file->size; i++) {
+    u64 n = MIN(iov[i].iov_len, vfd->file->size - pos);
+    memcpy(iov[i].iov_base, vfd->file->data + pos, n);
+    pos += n;
+    done += n;
+  }
+
+  if (offset < 0) {
+    vfd->offset = pos;
+  }
+  return done;
+}
+
+i64 vfs_pwritev(Vfs* vfs, int fd, const struct iovec* iov, int iovcnt,
+                i64 offset) {
+  VfsFd* vfd = &vfs->fds[fd];
+  if ((vfd->flags & O_ACCMODE) == O_RDONLY) return -EBADF;
+
+  u64 total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  u64 pos = offset < 0 ? vfd->offset : (u64)offset;
+  if (offset < 0 && (vfd->flags & O_APPEND)) {
+    pos = vfd->file->size;
+  }
+  if (total == 0) return 0;
+  // the gap up to pos is allocated too, so it counts against the limit
+  if (total > RVEMU_VFS_MAX_FILE_SIZE ||
+      pos > RVEMU_VFS_MAX_FILE_SIZE - total) {
+    return -EFBIG;
+  }
+  if (!vfs_reserve(vfd->file, pos + total)) return -ENOSPC;
+
+  VfsFile* file = vfd->file;
+  file->changed = true;
+  if (pos > file->size) {
+    memset(file->data + file->size, 0, pos - file->size);
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(file->data + pos, iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  file->size = MAX(file->size, pos);
+
+  if (offset < 0) {
+    vfd->offset = pos;
+  }
+  return total;
+}
+
+i64 vfs_lseek(Vfs* vfs, int fd, i64 offset, int whence) {
+  VfsFd* vfd = &vfs->fds[fd];
+  i64 base = 0;
+  switch (whence) {
+    case SEEK_SET:
+      base = 0;
+      break;
+    case SEEK_CUR:
+      base = vfd->offset;
+      break;
+    case SEEK_END:
+      base = vfd->file->size;
+      break;
+    default:
+      return -EINVAL;
+  }
+  if (base + offset < 0) return -EINVAL;
+  vfd->offset = base + offset;
+  return vfd->offset;
+}
+
+static void vfs_free_saved(Vfs* vfs) {
+  if (!vfs->saved) return;
+  for (int i = 0; i < vfs->num_saved; i++) {
+    vfs_release(&vfs->saved[i]);
+  }
+  free(vfs->saved);
+  vfs->saved = NULL;
+  vfs->num_saved = 0;
+}
+
+// Copies the contents of every file, for vfs_reset to put back the ones
+// the guest changes. Fds are the machine's to save.
+bool vfs_checkpoint(Vfs* vfs) {
+  vfs_free_saved(vfs);
+  if (!vfs->enabled) return true;
+  VfsFile* saved = calloc(vfs->num_files + 1, sizeof(VfsFile));
+  if (!saved) return false;
+  vfs->saved = saved;
+  for (int i = 0; i < vfs->num_files; i++) {
+    if (!vfs_copy(&saved[i], vfs->files[i])) {
+      vfs_free_saved(vfs);
+      return false;
+    }
+    vfs->num_saved++;
+    vfs->files[i]->changed = false;
+  }
+  return true;
+}
+
+// Drops the files created since vfs_checkpoint and puts back the contents
+// of those changed since. Their fds must be closed already.
+void vfs_reset(Vfs* vfs) {
+  if (!vfs->saved) return;
+  for (int i = vfs->num_saved; i < vfs->num_files; i++) {
+    vfs_free_file(vfs->files[i]);
+  }
+  vfs->num_files = vfs->num_saved;
+  for (int i = 0; i < vfs->num_files; i++) {
+    VfsFile* file = vfs->files[i];
+    if (!file->changed) continue;
+    vfs_release(file);
+    if (!vfs_copy(file, &vfs->saved[i])) {
+      FATAL("cannot put back the in-memory files");
+    }
+    file->changed = false;
+  }
+}
+
+// Closes the guest's in-memory fds and frees every file.
+void vfs_destroy(Vfs* vfs) {
+  for (int fd = 0; fd < RVEMU_VFS_MAX_FDS; fd++) {
+    if (vfs->fds[fd].file) vfs_close(vfs, fd);
+  }
+  vfs_free_saved(vfs);
+  for (int i = 0; i < vfs->num_files; i++) {
+    vfs_free_file(vfs->files[i]);
+  }
+  for (int i = 0; i < vfs->num_allowed; i++) {
+    free(vfs->allowed[i]);
+  }
+  vfs->num_files = 0;
+  vfs->num_allowed = 0;
+  vfs->enabled = false;
+}
@@ -0,0 +1,75 @@
+#ifndef RVEMU_VFS_H_
+#define RVEMU_VFS_H_
+
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "types.h"
+
+#define RVEMU_VFS_MAX_FILES 1024
+#define RVEMU_VFS_MAX_FDS 1024
+#define RVEMU_VFS_MAX_ALLOWED 64
+#define RVEMU_VFS_MAX_FILE_SIZE (1ULL << 30)  // writes past it get -EFBIG
+
+// An in-memory file. Preloaded inputs point at a read-only host mapping
+// until the guest first writes them, then they get a private copy.
+typedef struct {
+  char* path;
+  u8* data;
+  u64 size;
+  u64 capacity;
+  int host_fd;  // backing file of a preloaded, unmodified input, or -1
+  bool changed;  // since vfs_checkpoint
+} VfsFile;
+
+typedef struct {
+  VfsFile* file;  // NULL when the fd is not an in-memory file
+  u64 offset;
+  int flags;
+} VfsFd;
+
+// Optional in-process filesystem. Once enabled, guest opens are served from
+// memory, except for paths under an allowed prefix which go to the host.
+// Paths are made absolute against the cwd and cleaned of ".", ".." and
+// repeated slashes before they are compared, without following symlinks.
+// Every in-memory fd also holds a host fd on /dev/null and goes by that
+// number, so it sits in the machine's fd table like any other host fd and
+// fds is indexed by it directly.
+typedef struct {
+  bool enabled;
+  VfsFile* files[RVEMU_VFS_MAX_FILES];
+  int num_files;
+  char* allowed[RVEMU_VFS_MAX_ALLOWED];  // normalized
+  int num_allowed;
+  VfsFd fds[RVEMU_VFS_MAX_FDS];
+  VfsFile* saved;  // the contents of files at vfs_checkpoint, or NULL
+  int num_saved;
+} Vfs;
+
+bool vfs_preload(Vfs*, const char*);
+
+bool vfs_allow(Vfs*, const char*);
+
+bool vfs_passthrough(const Vfs*, const char*);
+
+int vfs_open(Vfs*, const char*, int, int);
+
+int vfs_close(Vfs*, int);
+
+i64 vfs_preadv(Vfs*, int, const struct iovec*, int, i64);
+
+i64 vfs_pwritev(Vfs*, int, const struct iovec*, int, i64);
+
+i64 vfs_lseek(Vfs*, int, i64, int);
+
+bool vfs_checkpoint(Vfs*);
+
+void vfs_reset(Vfs*);
+
+void vfs_destroy(Vfs*);
+
+static inline bool vfs_owns(const Vfs* vfs, u64 fd) {
+  return vfs->enabled && fd < RVEMU_VFS_MAX_FDS && vfs->fds[fd].file;
+}
+
+#endif  // RVEMU_VFS_H_
@@ -0,0 +1,228 @@
+#include "virtio.h"
+
+#include <stddef.h>
+
+#include "utils.h"
+
+#define VIRTIO_MAGIC 0x74726976  // "virt"
+#define VIRTIO_VENDOR 0x554d4551  // "QEMU", which guests already know
+
+#define VIRTIO_MMIO_MAGIC 0x000
+#define VIRTIO_MMIO_VERSION 0x004
+#define VIRTIO_MMIO_DEVICE_ID 0x008
+#define VIRTIO_MMIO_VENDOR_ID 0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES 0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES 0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL 0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX 0x034
+#define VIRTIO_MMIO_QUEUE_NUM 0x038
+#define VIRTIO_MMIO_QUEUE_READY 0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY 0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS 0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK 0x064
+#define VIRTIO_MMIO_STATUS 0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW 0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH 0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW 0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH 0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW 0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH 0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION 0x0fc
+#define VIRTIO_MMIO_CONFIG 0x100
+
+#define VIRTIO_INT_USED_RING 1
+
+static Virtq* selected_queue(VirtioDevice* dev) {
+  return dev->queue_sel < dev->num_queues ? &dev->queues[dev->queue_sel]
+                                          : NULL;
+}
+
+static void set_low(u64* reg, u64 value) {
+  *reg = (*reg & ~0xffffffffULL) | (value & 0xffffffff);
+}
+
+static void set_high(u64* reg, u64 value) {
+  *reg = (*reg & 0xffffffff) | value << 32;
+}
+
+static void virtio_reset(VirtioDevice* dev) {
+  dev->driver_features = 0;
+  dev->status = 0;
+  dev->interrupt_status = 0;
+  for (u32 i = 0; i < dev->num_queues; i++) {
+    dev->queues[i] = (Virtq){0};
+  }
+  system_set_irq(dev->sys, dev->irq, false);
+}
+
+static u64 virtio_read_locked(VirtioDevice* dev, u64 off, int size) {
+  Virtq* q = selected_queue(dev);
+  if (off >= VIRTIO_MMIO_CONFIG) {
+    return dev->config_read(dev, off - VIRTIO_MMIO_CONFIG, size);
+  }
+  switch (off) {
+    case VIRTIO_MMIO_MAGIC:
+      return VIRTIO_MAGIC;
+    case VIRTIO_MMIO_VERSION:
+      return 2;
+    case VIRTIO_MMIO_DEVICE_ID:
+      return dev->device_id;
+    case VIRTIO_MMIO_VENDOR_ID:
+      return VIRTIO_VENDOR;
+    case VIRTIO_MMIO_DEVICE_FEATURES:
+      return dev->device_features_sel < 2
+                 ? (u32)(dev->features >> 32 * dev->device_features_sel)
+                 : 0;
+    case VIRTIO_MMIO_QUEUE_NUM_MAX:
+      return q ? RVEMU_VIRTIO_QUEUE_MAX : 0;
+    case VIRTIO_MMIO_QUEUE_READY:
+      return q && q->ready;
+    case VIRTIO_MMIO_INTERRUPT_STATUS:
+      return dev->interrupt_status;
+    case VIRTIO_MMIO_STATUS:
+      return dev->status;
+    case VIRTIO_MMIO_CONFIG_GENERATION:
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+static u64 virtio_read(void* ctx, u64 off, int size) {
+  VirtioDevice* dev = (VirtioDevice*)ctx;
+  pthread_mutex_lock(&dev->lock);
+  u64 value = virtio_read_locked(dev, off, size);
+  pthread_mutex_unlock(&dev->lock);
+  return value;
+}
+
+static void virtio_write_locked(VirtioDevice* dev, u64 off, u64 value) {
+  Virtq* q = selected_queue(dev);
+  switch (off) {
+    case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+      dev->device_features_sel = value;
+      return;
+    case VIRTIO_MMIO_DRIVER_FEATURES:
+      if (dev->driver_features_sel == 0) set_low(&dev->driver_features, value);
+      if (dev->driver_features_sel == 1) set_high(&dev->driver_features, value);
+      return;
+    case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+      dev->driver_features_sel = value;
+      return;
+    case VIRTIO_MMIO_QUEUE_SEL:
+      dev->queue_sel = value;
+      return;
+    case VIRTIO_MMIO_QUEUE_NUM:
+      if (q && value <= RVEMU_VIRTIO_QUEUE_MAX && !(value & (value - 1))) {
+        q->num = value;
+      }
+      return;
+    case VIRTIO_MMIO_QUEUE_READY:
+      if (q) q->ready = value & 1;
+      return;
+    case VIRTIO_MMIO_QUEUE_NOTIFY:
+      if (value < dev->num_queues && dev->queues[value].ready) {
+        dev->notify(dev, &dev->queues[value]);
+      }
+      return;
+    case VIRTIO_MMIO_INTERRUPT_ACK:
+      dev->interrupt_status &= ~value;
+      system_set_irq(dev->sys, dev->irq, dev->interrupt_status != 0);
+      return;
+    case VIRTIO_MMIO_STATUS:
+      if (value == 0) {
+        virtio_reset(dev);
+      } else {
+        dev->status = value;
+      }
+      return;
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:
+      if (q) set_low(&q->desc, value);
+      return;
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+      if (q) set_high(&q->desc, value);
+      return;
+    case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+      if (q) set_low(&q->driver, value);
+      return;
+    case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+      if (q) set_high(&q->driver, value);
+      return;
+    case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+      if (q) set_low(&q->device, value);
+      return;
+    case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+      if (q) set_high(&q->device, value);
+      return;
+    default:
+      return;  // config space is read-only here
+  }
+}
+
+static void virtio_write(void* ctx, u64 off, u64 value, int size) {
+  VirtioDevice* dev = (VirtioDevice*)ctx;
+  pthread_mutex_lock(&dev->lock);
+  virtio_write_locked(dev, off, value);
+  pthread_mutex_unlock(&dev->lock);
+}
+
+// Puts the device in virtio-mmio slot n of the board.
+void virtio_attach(VirtioDevice* dev, System* sys, int slot) {
+  dev->sys = sys;
+  dev->irq = slot + 1;
+  pthread_mutex_init(&dev->lock, NULL);
+  system_add_device(sys, RVEMU_VIRTIO_BASE + slot * RVEMU_VIRTIO_STRIDE,
+                    RVEMU_VIRTIO_STRIDE, virtio_read, virtio_write, dev);
+}
+
+// Takes the next chain the driver made available and translates up to
+// max of its buffers into bufs. Returns the number of buffers, 0 when the
+// queue is empty, or -1 for a chain that does not fit guest RAM, which the
+// caller should still hand back with virtq_push.
+int virtq_pop(VirtioDevice* dev, Virtq* q, VirtqBuf* bufs, int max,
+              u16* head) {
+  System* sys = dev->sys;
+  u16* avail = system_ram(sys, q->driver, 4 + 2 * q->num);
+  VirtqDesc* descs = system_ram(sys, q->desc, sizeof(VirtqDesc) * q->num);
+  if (!avail || !descs || q->num == 0) return 0;
+
+  u16 avail_idx = __atomic_load_n(&avail[1], __ATOMIC_ACQUIRE);
+  if (q->last_avail == avail_idx) return 0;
+  *head = avail[2 + q->last_avail++ % q->num] % q->num;
+
+  int n = 0;
+  u16 i = *head;
+  for (u32 steps = 0; steps < q->num; steps++) {
+    const VirtqDesc* desc = &descs[i];
+    if (n == max) return -1;
+    u8* data = system_ram(sys, desc->addr, desc->len);
+    if (!data) return -1;
+    bufs[n++] = (VirtqBuf){
+        .data = data,
+        .len = desc->len,
+        .writable = desc->flags & VIRTQ_DESC_F_WRITE,
+    };
+    if (!(desc->flags & VIRTQ_DESC_F_NEXT)) return n;
+    i = desc->next % q->num;
+  }
+  return -1;  // a loop in the chain
+}
+
+// Hands a chain back to the driver with len bytes written into it. The
+// caller raises one interrupt for a whole batch with virtio_interrupt.
+void virtq_push(VirtioDevice* dev, Virtq* q, u16 head, u32 len) {
+  u8* used = system_ram(dev->sys, q->device, 4 + 8 * q->num);
+  if (!used) return;
+  u16* used_idx = (u16*)(used + 2);
+  u32* elem = (u32*)(used + 4 + 8 * (*used_idx % q->num));
+  elem[0] = head;
+  elem[1] = len;
+  __atomic_store_n(used_idx, *used_idx + 1, __ATOMIC_RELEASE);
+}
+
+void virtio_interrupt(VirtioDevice* dev) {
+  dev->interrupt_status |= VIRTIO_INT_USED_RING;
+  system_set_irq(dev->sys, dev->irq, true);
+}
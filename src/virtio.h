@@ -0,0 +1,77 @@
+#ifndef RVEMU_VIRTIO_H_
+#define RVEMU_VIRTIO_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "system.h"
+#include "types.h"
+
+// virtio-mmio slots, laid out like QEMU's virt board: slot n sits at
+// BASE + n * STRIDE and drives PLIC source n + 1.
+#define RVEMU_VIRTIO_BASE 0x10001000ULL
+#define RVEMU_VIRTIO_STRIDE 0x1000ULL
+#define RVEMU_VIRTIO_MAX_QUEUES 2
+#define RVEMU_VIRTIO_QUEUE_MAX 256
+
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+
+typedef struct {
+  u64 addr;
+  u32 len;
+  u16 flags;
+  u16 next;
+} VirtqDesc;
+
+// A split virtqueue as the driver set it up, in guest physical addresses.
+typedef struct {
+  u32 num;
+  bool ready;
+  u64 desc;
+  u64 driver;  // the available ring
+  u64 device;  // the used ring
+  u16 last_avail;
+} Virtq;
+
+// One buffer of a descriptor chain, already translated to host memory.
+typedef struct {
+  u8* data;
+  u32 len;
+  bool writable;
+} VirtqBuf;
+
+// The virtio-mmio (version 2) transport. Devices embed it first and fill
+// in device_id, features and the two callbacks; the transport handles
+// feature negotiation, queue setup and interrupts. Register accesses and
+// the callbacks run under lock, which device threads take as well before
+// touching a queue.
+typedef struct VirtioDevice {
+  System* sys;
+  pthread_mutex_t lock;
+  u32 device_id;
+  u32 irq;
+  u32 num_queues;
+  u64 features;  // offered to the driver
+  u64 driver_features;
+  u32 device_features_sel;
+  u32 driver_features_sel;
+  u32 queue_sel;
+  u32 status;
+  u32 interrupt_status;
+  Virtq queues[RVEMU_VIRTIO_MAX_QUEUES];
+  u64 (*config_read)(struct VirtioDevice*, u64, int);
+  void (*notify)(struct VirtioDevice*, Virtq*);  // the driver kicked a queue
+} VirtioDevice;
+
+void virtio_attach(VirtioDevice*, System*, int);
+
+int virtq_pop(VirtioDevice*, Virtq*, VirtqBuf*, int, u16*);
+
+void virtq_push(VirtioDevice*, Virtq*, u16, u32);
+
+void virtio_interrupt(VirtioDevice*);
+
+#endif  // RVEMU_VIRTIO_H_
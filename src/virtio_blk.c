@@ -0,0 +1,166 @@
+#include "virtio_blk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define VIRTIO_ID_BLOCK 2
+
+#define VIRTIO_BLK_F_RO (1ULL << 5)
+#define VIRTIO_BLK_F_FLUSH (1ULL << 9)
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_GET_ID 8
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+#define VIRTIO_BLK_ID_BYTES 20
+#define VIRTIO_BLK_MAX_BUFS 130  // header, 128 segments and the status byte
+
+typedef struct {
+  u32 type;
+  u32 reserved;
+  u64 sector;
+} VirtioBlkHeader;
+
+static u64 blk_config_read(VirtioDevice* dev, u64 off, int size) {
+  VirtioBlk* blk = (VirtioBlk*)dev;
+  u64 capacity = blk->size / VIRTIO_BLK_SECTOR_SIZE;
+  if (off < 8) {
+    u64 value = capacity >> off * 8;
+    return size == 8 ? value : value & ((1ULL << size * 8) - 1);
+  }
+  return 0;
+}
+
+// moves one data buffer at pos in the image; false on an I/O error
+static bool blk_transfer(VirtioBlk* blk, const VirtqBuf* buf, u64 pos,
+                         bool to_image) {
+  if (blk->image) {
+    if (to_image) {
+      memcpy(blk->image + pos, buf->data, buf->len);
+    } else {
+      memcpy(buf->data, blk->image + pos, buf->len);
+    }
+    return true;
+  }
+  ssize_t n = to_image ? pwrite(blk->fd, buf->data, buf->len, pos)
+                       : pread(blk->fd, buf->data, buf->len, pos);
+  return n == buf->len;
+}
+
+// Serves one request and returns its status, with *written set to the
+// bytes put into guest buffers besides the status byte.
+static u8 blk_request(VirtioBlk* blk, const VirtqBuf* bufs, int n,
+                      u32* written) {
+  const VirtqBuf* data = &bufs[1];
+  int num_data = n - 2;
+  VirtioBlkHeader header;
+  memcpy(&header, bufs[0].data, sizeof(header));
+
+  switch (header.type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT: {
+      bool out = header.type == VIRTIO_BLK_T_OUT;
+      if (out && blk->read_only) return VIRTIO_BLK_S_IOERR;
+      u64 pos = header.sector * VIRTIO_BLK_SECTOR_SIZE;
+      if (header.sector > blk->size / VIRTIO_BLK_SECTOR_SIZE) {
+        return VIRTIO_BLK_S_IOERR;
+      }
+      for (int i = 0; i < num_data; i++) {
+        if (data[i].writable == out || data[i].len > blk->size - pos ||
+            !blk_transfer(blk, &data[i], pos, out)) {
+          return VIRTIO_BLK_S_IOERR;
+        }
+        pos += data[i].len;
+        if (!out) *written += data[i].len;
+      }
+      return VIRTIO_BLK_S_OK;
+    }
+    case VIRTIO_BLK_T_FLUSH: {
+      int err = blk->image ? msync(blk->image, blk->size, MS_SYNC)
+                           : fsync(blk->fd);
+      return err == 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+    }
+    case VIRTIO_BLK_T_GET_ID: {
+      if (num_data < 1 || !data[0].writable) return VIRTIO_BLK_S_IOERR;
+      u32 len = MIN(data[0].len, VIRTIO_BLK_ID_BYTES);
+      memset(data[0].data, 0, len);
+      memcpy(data[0].data, "rvemu", MIN(len, 5));
+      *written += len;
+      return VIRTIO_BLK_S_OK;
+    }
+    default:
+      return VIRTIO_BLK_S_UNSUPP;
+  }
+}
+
+// Serves everything queued since the last kick and then raises a single
+// interrupt for the whole batch.
+static void blk_notify(VirtioDevice* dev, Virtq* q) {
+  VirtioBlk* blk = (VirtioBlk*)dev;
+  VirtqBuf bufs[VIRTIO_BLK_MAX_BUFS];
+  u16 head;
+  bool served = false;
+  int n;
+  while ((n = virtq_pop(dev, q, bufs, VIRTIO_BLK_MAX_BUFS, &head)) != 0) {
+    u32 written = 0;
+    const VirtqBuf* status = &bufs[MAX(n, 1) - 1];
+    bool valid = n >= 2 && bufs[0].len >= sizeof(VirtioBlkHeader) &&
+                 status->writable && status->len >= 1;
+    if (valid) {
+      status->data[status->len - 1] = blk_request(blk, bufs, n, &written);
+      written++;
+    }
+    virtq_push(dev, q, head, written);
+    served = true;
+  }
+  if (served) virtio_interrupt(dev);
+}
+
+// Opens the image at path read-write, or read-only if that is all the host
+// allows, and puts the device in virtio-mmio slot.
+bool virtio_blk_init(VirtioBlk* blk, System* sys, int slot, const char* path) {
+  *blk = (VirtioBlk){0};
+  blk->fd = open(path, O_RDWR | O_CLOEXEC);
+  if (blk->fd < 0 && (errno == EACCES || errno == EROFS)) {
+    blk->fd = open(path, O_RDONLY | O_CLOEXEC);
+    blk->read_only = true;
+  }
+  if (blk->fd < 0) return false;
+
+  struct stat st;
+  if (fstat(blk->fd, &st) < 0) {
+    int err = errno;
+    close(blk->fd);
+    blk->fd = -1;
+    errno = err;
+    return false;
+  }
+  blk->size = ROUNDDOWN((u64)st.st_size, VIRTIO_BLK_SECTOR_SIZE);
+
+  if (blk->size > 0) {
+    int prot = PROT_READ | (blk->read_only ? 0 : PROT_WRITE);
+    void* image = mmap(NULL, blk->size, prot, MAP_SHARED, blk->fd, 0);
+    blk->image = image == MAP_FAILED ? NULL : image;
+  }
+
+  VirtioDevice* dev = &blk->dev;
+  dev->device_id = VIRTIO_ID_BLOCK;
+  dev->num_queues = 1;
+  dev->features = VIRTIO_F_VERSION_1 | VIRTIO_BLK_F_FLUSH |
+                  (blk->read_only ? VIRTIO_BLK_F_RO : 0);
+  dev->config_read = blk_config_read;
+  dev->notify = blk_notify;
+  virtio_attach(dev, sys, slot);
+  return true;
+}
@@ -0,0 +1,24 @@
+#ifndef RVEMU_VIRTIO_BLK_H_
+#define RVEMU_VIRTIO_BLK_H_
+
+#include <stdbool.h>
+
+#include "system.h"
+#include "types.h"
+#include "virtio.h"
+
+// A virtio block device backed by a host image. The image is mapped
+// shared, so requests are plain copies between guest RAM and the mapping
+// and the page cache does the writing back; images that cannot be mapped
+// fall back to pread and pwrite.
+typedef struct {
+  VirtioDevice dev;  // first, so the transport's callbacks can cast back
+  int fd;
+  u8* image;  // NULL when not mapped
+  u64 size;
+  bool read_only;
+} VirtioBlk;
+
+bool virtio_blk_init(VirtioBlk*, System*, int, const char*);
+
+#endif  // RVEMU_VIRTIO_BLK_H_
@@ -0,0 +1,127 @@
+#include "virtio_console.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define VIRTIO_ID_CONSOLE 3
+
+#define CONSOLE_RX_QUEUE 0
+#define CONSOLE_TX_QUEUE 1
+#define CONSOLE_MAX_BUFS 64
+
+static u64 console_config_read(VirtioDevice* dev, u64 off, int size) {
+  return 0;  // no size, no multiport and no emergency write
+}
+
+static void console_flush(VirtioConsole* con) {
+  u32 off = 0;
+  while (off < con->tx_len) {
+    ssize_t n = write(con->out_fd, con->tx + off, con->tx_len - off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;  // the host side is gone; drop the output
+    off += n;
+  }
+  con->tx_len = 0;
+}
+
+static void console_transmit(VirtioConsole* con, Virtq* q) {
+  VirtqBuf bufs[CONSOLE_MAX_BUFS];
+  u16 head;
+  bool served = false;
+  int n;
+  while ((n = virtq_pop(&con->dev, q, bufs, CONSOLE_MAX_BUFS, &head)) != 0) {
+    for (int i = 0; i < n; i++) {
+      if (bufs[i].writable) continue;
+      for (u32 off = 0; off < bufs[i].len;) {
+        if (con->tx_len == RVEMU_CONSOLE_TX_BUF) console_flush(con);
+        u32 len = MIN(bufs[i].len - off, RVEMU_CONSOLE_TX_BUF - con->tx_len);
+        memcpy(con->tx + con->tx_len, bufs[i].data + off, len);
+        con->tx_len += len;
+        off += len;
+      }
+    }
+    virtq_push(&con->dev, q, head, 0);
+    served = true;
+  }
+  console_flush(con);
+  if (served) virtio_interrupt(&con->dev);
+}
+
+// Moves pending host input into whatever receive buffers the driver has
+// posted. Called with the device lock held.
+static void console_receive(VirtioConsole* con) {
+  Virtq* q = &con->dev.queues[CONSOLE_RX_QUEUE];
+  VirtqBuf bufs[CONSOLE_MAX_BUFS];
+  u16 head;
+  bool served = false;
+  while (q->ready && con->rx_off < con->rx_len) {
+    int n = virtq_pop(&con->dev, q, bufs, CONSOLE_MAX_BUFS, &head);
+    if (n == 0) break;
+    u32 written = 0;
+    for (int i = 0; i < n && con->rx_off < con->rx_len; i++) {
+      if (!bufs[i].writable) continue;
+      u32 len = MIN(bufs[i].len, con->rx_len - con->rx_off);
+      memcpy(bufs[i].data, con->rx + con->rx_off, len);
+      con->rx_off += len;
+      written += len;
+    }
+    virtq_push(&con->dev, q, head, written);
+    served = true;
+  }
+  if (served) virtio_interrupt(&con->dev);
+  if (con->rx_off == con->rx_len) pthread_cond_signal(&con->rx_drained);
+}
+
+static void console_notify(VirtioDevice* dev, Virtq* q) {
+  VirtioConsole* con = (VirtioConsole*)dev;
+  if (q == &dev->queues[CONSOLE_TX_QUEUE]) {
+    console_transmit(con, q);
+  } else {
+    console_receive(con);
+  }
+}
+
+// Reads host input one chunk at a time, waiting for the guest to take all
+// of a chunk before reading the next.
+static void* console_reader_main(void* arg) {
+  VirtioConsole* con = (VirtioConsole*)arg;
+  while (true) {
+    ssize_t n = read(con->in_fd, con->rx, RVEMU_CONSOLE_RX_BUF);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return NULL;
+
+    pthread_mutex_lock(&con->dev.lock);
+    con->rx_off = 0;
+    con->rx_len = n;
+    console_receive(con);
+    while (con->rx_off < con->rx_len) {
+      pthread_cond_wait(&con->rx_drained, &con->dev.lock);
+    }
+    pthread_mutex_unlock(&con->dev.lock);
+  }
+}
+
+// Puts a console on in_fd and out_fd in virtio-mmio slot.
+bool virtio_console_init(VirtioConsole* con, System* sys, int slot, int in_fd,
+                         int out_fd) {
+  *con = (VirtioConsole){0};
+  con->in_fd = in_fd;
+  con->out_fd = out_fd;
+  pthread_cond_init(&con->rx_drained, NULL);
+
+  VirtioDevice* dev = &con->dev;
+  dev->device_id = VIRTIO_ID_CONSOLE;
+  dev->num_queues = 2;
+  dev->features = VIRTIO_F_VERSION_1;
+  dev->config_read = console_config_read;
+  dev->notify = console_notify;
+  virtio_attach(dev, sys, slot);
+
+  if (pthread_create(&con->reader, NULL, console_reader_main, con) != 0) {
+    return false;
+  }
+  pthread_detach(con->reader);
+  return true;
+}
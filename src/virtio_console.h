@@ -0,0 +1,33 @@
+#ifndef RVEMU_VIRTIO_CONSOLE_H_
+#define RVEMU_VIRTIO_CONSOLE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "system.h"
+#include "types.h"
+#include "virtio.h"
+
+#define RVEMU_CONSOLE_TX_BUF 16384
+#define RVEMU_CONSOLE_RX_BUF 4096
+
+// A single-port virtio console on the host's stdio. Output is gathered
+// from every buffer of a kick into tx and written with one write(2), so a
+// line of guest output costs one MMIO exit rather than one per byte. A
+// reader thread feeds host input into the guest's receive buffers.
+typedef struct {
+  VirtioDevice dev;  // first, so the transport's callbacks can cast back
+  int in_fd;
+  int out_fd;
+  u8 tx[RVEMU_CONSOLE_TX_BUF];
+  u32 tx_len;
+  u8 rx[RVEMU_CONSOLE_RX_BUF];  // host input not yet in guest buffers
+  u32 rx_off;
+  u32 rx_len;
+  pthread_cond_t rx_drained;
+  pthread_t reader;
+} VirtioConsole;
+
+bool virtio_console_init(VirtioConsole*, System*, int, int, int);
+
+#endif  // RVEMU_VIRTIO_CONSOLE_H_
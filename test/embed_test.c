@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rvemu.h"
+
+#define CHECK(cond)                                              \
+  do {                                                           \
+    if (!(cond)) {                                               \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      return 1;                                                  \
+    }                                                            \
+  } while (0)
+
+static int doubled;
+
+static uint64_t handle_syscall(Rvemu* vm, uint64_t nr, void* user) {
+  if (nr != 0x1000) return rvemu_default_syscall(vm);
+  doubled++;
+  return rvemu_get_reg(vm, 10) * 2;
+}
+
+// Runs test/guest/embed.s through the library the way an embedder would:
+// in time slices, with a syscall of its own, reading guest memory.
+static int test_embed(char* prog) {
+  Rvemu* vm = rvemu_create();
+  CHECK(vm);
+  CHECK(rvemu_load(vm, prog, 1, &prog) == 0);
+  rvemu_set_syscall_handler(vm, handle_syscall, NULL);
+
+  int slices = 1;
+  while (rvemu_run_for(vm, 1000) == RVEMU_BUDGET_EXHAUSTED) {
+    CHECK(!rvemu_halted(vm));
+    slices++;
+  }
+  CHECK(rvemu_halted(vm));
+  CHECK(rvemu_exit_code(vm) == 42);
+  CHECK(doubled == 1);
+  CHECK(slices > 10);
+
+  // the guest's code is mapped, nothing below it or past the window is
+  uint32_t word = 0;
+  CHECK(rvemu_read_mem(vm, 0x10000, &word, sizeof(word)) == 0);
+  CHECK(word != 0);
+  CHECK(rvemu_write_mem(vm, 0x10000, &word, sizeof(word)) == 0);
+  CHECK(rvemu_read_mem(vm, 0, &word, sizeof(word)) == -EFAULT);
+  CHECK(rvemu_write_mem(vm, 0, &word, sizeof(word)) == -EFAULT);
+  CHECK(rvemu_read_mem(vm, UINT64_MAX - 1, &word, sizeof(word)) == -EFAULT);
+
+  rvemu_destroy(vm);
+  return 0;
+}
+
+typedef struct {
+  char data[4096];
+  size_t len;
+  int slices;  // rvemu_run_for calls it took
+} Output;
+
+// collects what the guest writes instead of letting it reach stdout
+static uint64_t capture_write(Rvemu* vm, uint64_t nr, void* user) {
+  if (nr != 64) return rvemu_default_syscall(vm);
+  Output* out = user;
+  uint64_t len = rvemu_get_reg(vm, 12);
+  if (len > sizeof(out->data) - out->len) return -ENOSPC;
+  if (rvemu_read_mem(vm, rvemu_get_reg(vm, 11), out->data + out->len, len)) {
+    return -EFAULT;
+  }
+  out->len += len;
+  return len;
+}
+
+// Runs prog in slices of budget instructions, or in one go for a budget of
+// 0, and collects its output.
+static int run_budgeted(char* prog, bool jit, uint64_t budget, Output* out) {
+  Rvemu* vm = rvemu_create();
+  CHECK(vm);
+  CHECK(rvemu_load(vm, prog, 1, &prog) == 0);
+  rvemu_set_jit(vm, jit);
+  rvemu_set_syscall_handler(vm, capture_write, out);
+  if (budget == 0) {
+    rvemu_run(vm);
+  } else {
+    out->slices = 1;
+    while (rvemu_run_for(vm, budget) == RVEMU_BUDGET_EXHAUSTED) {
+      out->slices++;
+    }
+  }
+  CHECK(rvemu_halted(vm));
+  CHECK(rvemu_exit_code(vm) == 0);
+  rvemu_destroy(vm);
+  return 0;
+}
+
+// Stopping and resuming test/guest/jit.s at every budget, interpreted and
+// inside jitted loops, must not change what it computes. Its loop runs
+// about 480000 instructions, so every budget but the last has to stop it
+// many times.
+static int test_budget(char* prog) {
+  static Output want, got;
+  CHECK(run_budgeted(prog, false, 0, &want) == 0);
+  CHECK(want.len == 520);
+
+  const uint64_t budgets[] = {1, 2, 7, 100, 1000, 100000};
+  for (int jit = 0; jit < 2; jit++) {
+    for (size_t i = 0; i < sizeof(budgets) / sizeof(budgets[0]); i++) {
+      got.len = 0;
+      CHECK(run_budgeted(prog, jit, budgets[i], &got) == 0);
+      CHECK(budgets[i] > 1000 || got.slices > 100);
+      if (got.len != want.len || memcmp(got.data, want.data, want.len) != 0) {
+        fprintf(stderr, "output differs with budget %lu%s\n", budgets[i],
+                jit ? " and --jit" : "");
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc == 3 && strcmp(argv[1], "embed") == 0) return test_embed(argv[2]);
+  if (argc == 3 && strcmp(argv[1], "budget") == 0) return test_budget(argv[2]);
+  fprintf(stderr, "usage: %s embed|budget <program>\n", argv[0]);
+  return 1;
+}
@@ -0,0 +1,144 @@
+# Boots on the --system board with a --drive of two sectors, the second
+# starting with "virtblk!", and reads that sector through a one-request
+# virtio-blk driver. Powers off through the test finisher with the number
+# of the first check that fails, or 0.
+
+_start:
+  li t6, 1
+  la t0, fail
+  csrrw zero, mtvec, t0  # no trap is expected
+  li s0, 0x10001000  # virtio-mmio slot 0
+
+  # 1: a virtio-mmio block device
+  lw t0, 0(s0)
+  li t1, 0x74726976  # "virt"
+  bne t0, t1, fail
+  lw t0, 8(s0)
+  li t1, 2
+  bne t0, t1, fail
+
+  # 2: it takes VIRTIO_F_VERSION_1
+  li t6, 2
+  sw zero, 0x70(s0)  # reset
+  li t0, 3  # ACKNOWLEDGE | DRIVER
+  sw t0, 0x70(s0)
+  li t0, 1
+  sw t0, 0x24(s0)
+  sw t0, 0x20(s0)  # feature bit 32
+  li t0, 11  # | FEATURES_OK
+  sw t0, 0x70(s0)
+  lw t0, 0x70(s0)
+  andi t0, t0, 8
+  beqz t0, fail
+
+  # 3: queue 0 holds at least 8
+  li t6, 3
+  sw zero, 0x30(s0)
+  lw t0, 0x34(s0)
+  li t1, 8
+  bltu t0, t1, fail
+  sw t1, 0x38(s0)
+  la t0, desc
+  sw t0, 0x80(s0)
+  srli t0, t0, 32
+  sw t0, 0x84(s0)
+  la t0, avail
+  sw t0, 0x90(s0)
+  srli t0, t0, 32
+  sw t0, 0x94(s0)
+  la t0, used
+  sw t0, 0xa0(s0)
+  srli t0, t0, 32
+  sw t0, 0xa4(s0)
+  li t0, 1
+  sw t0, 0x44(s0)
+  li t0, 15  # | DRIVER_OK
+  sw t0, 0x70(s0)
+
+  # header, data and status, chained
+  la s1, desc
+  la t0, header
+  sd t0, 0(s1)
+  li t0, 16
+  sw t0, 8(s1)
+  li t0, 1  # NEXT
+  sh t0, 12(s1)
+  sh t0, 14(s1)
+  la t0, data
+  sd t0, 16(s1)
+  li t0, 512
+  sw t0, 24(s1)
+  li t0, 3  # NEXT | WRITE
+  sh t0, 28(s1)
+  li t0, 2
+  sh t0, 30(s1)
+  la t0, status
+  sd t0, 32(s1)
+  li t0, 1
+  sw t0, 40(s1)
+  li t0, 2  # WRITE
+  sh t0, 44(s1)
+  la t0, avail
+  sh zero, 4(t0)
+  li t1, 1
+  sh t1, 2(t0)
+  sw zero, 0x50(s0)  # notify queue 0
+
+  # 4: the request completes
+  li t6, 4
+  la s2, used
+  li t2, 1000000
+poll:
+  lhu t0, 2(s2)
+  bnez t0, done
+  addi t2, t2, -1
+  bnez t2, poll
+  j fail
+done:
+  lw t0, 4(s2)
+  bnez t0, fail
+  lw t0, 8(s2)
+  li t1, 513
+  bne t0, t1, fail
+
+  # 5: successfully, with the second sector's data
+  li t6, 5
+  la t0, status
+  lbu t0, 0(t0)
+  bnez t0, fail
+  la t0, data
+  ld t0, 0(t0)
+  li t1, 0x216b6c6274726976  # "virtblk!"
+  bne t0, t1, fail
+
+  li t0, 0x100000  # test finisher
+  li t1, 0x5555
+  sw t1, 0(t0)
+hang:
+  j hang
+
+fail:
+  li t0, 0x100000
+  slli t1, t6, 16
+  li t2, 0x3333
+  or t1, t1, t2
+  sw t1, 0(t0)
+  j hang
+
+.align 4
+desc:
+  .space 128
+avail:
+  .space 24
+.align 2
+used:
+  .space 72
+.align 3
+header:
+  .word 0  # VIRTIO_BLK_T_IN
+  .word 0
+  .dword 1  # sector
+data:
+  .space 512
+status:
+  .word 0xff
@@ -0,0 +1,147 @@
+# Takes a checkpoint with SYS_RVEMU_CHECKPOINT, then writes memory, grows
+# the heap, maps a page and maps over its shared mapping of the file data
+# before SYS_RVEMU_RESET(5) takes it back. Run in a directory holding data,
+# a page starting with "file". Exits with the number of the first check
+# that fails, or 0.
+
+_start:
+  # 1: the file mapping
+  li t6, 1
+  li a0, -100  # AT_FDCWD
+  la a1, path
+  li a2, 2  # O_RDWR
+  li a3, 0
+  li a7, 56
+  ecall
+  bltz a0, fail
+  mv s1, a0
+  li a0, 0
+  li a1, 4096
+  li a2, 3  # PROT_READ | PROT_WRITE
+  li a3, 1  # MAP_SHARED
+  mv a4, s1
+  li a5, 0
+  li a7, 222
+  ecall
+  li t0, 0x800000000
+  bgeu a0, t0, fail
+  mv s2, a0
+
+  li a0, 0
+  li a7, 214
+  ecall
+  mv s3, a0
+  la s4, val
+  li t0, 1
+  sd t0, 0(s4)
+
+  li a7, 0x52560002  # SYS_RVEMU_CHECKPOINT
+  ecall
+  li t6, 2
+  bltz a0, fail
+  bnez a0, reset
+
+  # everything the reset has to undo
+  li t0, 2
+  sd t0, 0(s4)
+  li t0, 0x100000
+  add a0, s3, t0
+  li a7, 214
+  ecall
+  sd t0, 0(s3)
+  li a0, 0x200000000
+  li a1, 4096
+  li a2, 3
+  li a3, 0x32  # MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS
+  li a4, -1
+  li a5, 0
+  li a7, 222
+  ecall
+  mv a0, s2
+  li a1, 4096
+  li a2, 3
+  li a3, 0x32
+  li a4, -1
+  li a5, 0
+  li a7, 222
+  ecall
+  bne a0, s2, fail
+  li t0, 120  # 'x'
+  sb t0, 0(s2)
+  li a0, 5
+  li a7, 0x52560003  # SYS_RVEMU_RESET
+  ecall
+  li t6, 3
+  j fail
+
+reset:
+  # 4: back from the reset with its value
+  li t6, 4
+  li t0, 5
+  bne a0, t0, fail
+
+  # 5: a dirty page
+  li t6, 5
+  ld t1, 0(s4)
+  li t0, 1
+  bne t1, t0, fail
+
+  # 6: the break
+  li t6, 6
+  li a0, 0
+  li a7, 214
+  ecall
+  bne a0, s3, fail
+
+  # 7: the new mapping is gone
+  li t6, 7
+  li a0, 0x200000000
+  li a1, 4096
+  li a2, 3
+  li a3, 0x100022  # MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE
+  li a4, -1
+  li a5, 0
+  li a7, 222
+  ecall
+  li t0, 0x200000000
+  bne a0, t0, fail
+
+  # 8: the file mapping is back, contents and all
+  li t6, 8
+  lbu t1, 0(s2)
+  li t0, 102  # 'f'
+  bne t1, t0, fail
+
+  # 9: and still shared with the file
+  li t6, 9
+  li t0, 122  # 'z'
+  sb t0, 1(s2)
+  mv a0, s1
+  la a1, buf
+  li a2, 2
+  li a3, 0
+  li a7, 67
+  ecall
+  li t0, 2
+  bne a0, t0, fail
+  la a1, buf
+  lbu t1, 1(a1)
+  li t0, 122
+  bne t1, t0, fail
+
+  li a0, 0
+  li a7, 93
+  ecall
+
+fail:
+  mv a0, t6
+  li a7, 93
+  ecall
+
+path:
+  .asciz "data"
+  .align 3
+val:
+  .dword 0
+buf:
+  .dword 0
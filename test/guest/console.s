@@ -0,0 +1,118 @@
+# Boots on the --system board and writes "hello, console\n" to the virtio
+# console's transmit queue as two chains, kicked once. Powers off through
+# the test finisher with the number of the first check that fails, or 0.
+
+_start:
+  li t6, 1
+  la t0, fail
+  csrrw zero, mtvec, t0  # no trap is expected
+  li s0, 0x10002000  # virtio-mmio slot 1
+
+  # 1: a virtio-mmio console
+  lw t0, 0(s0)
+  li t1, 0x74726976  # "virt"
+  bne t0, t1, fail
+  lw t0, 8(s0)
+  li t1, 3
+  bne t0, t1, fail
+
+  # 2: it takes VIRTIO_F_VERSION_1
+  li t6, 2
+  sw zero, 0x70(s0)  # reset
+  li t0, 3  # ACKNOWLEDGE | DRIVER
+  sw t0, 0x70(s0)
+  li t0, 1
+  sw t0, 0x24(s0)
+  sw t0, 0x20(s0)  # feature bit 32
+  li t0, 11  # | FEATURES_OK
+  sw t0, 0x70(s0)
+  lw t0, 0x70(s0)
+  andi t0, t0, 8
+  beqz t0, fail
+
+  # 3: the transmit queue, 1, holds at least 8
+  li t6, 3
+  li t0, 1
+  sw t0, 0x30(s0)
+  lw t0, 0x34(s0)
+  li t1, 8
+  bltu t0, t1, fail
+  sw t1, 0x38(s0)
+  la t0, desc
+  sw t0, 0x80(s0)
+  srli t0, t0, 32
+  sw t0, 0x84(s0)
+  la t0, avail
+  sw t0, 0x90(s0)
+  srli t0, t0, 32
+  sw t0, 0x94(s0)
+  la t0, used
+  sw t0, 0xa0(s0)
+  srli t0, t0, 32
+  sw t0, 0xa4(s0)
+  li t0, 1
+  sw t0, 0x44(s0)
+  li t0, 15  # | DRIVER_OK
+  sw t0, 0x70(s0)
+
+  la s1, desc
+  la t0, hello
+  sd t0, 0(s1)
+  li t0, 7
+  sw t0, 8(s1)
+  la t0, console
+  sd t0, 16(s1)
+  li t0, 8
+  sw t0, 24(s1)
+  la t0, avail
+  sh zero, 4(t0)
+  li t1, 1
+  sh t1, 6(t0)
+  li t1, 2
+  sh t1, 2(t0)
+  li t0, 1
+  sw t0, 0x50(s0)  # notify queue 1
+
+  # 4: both chains come back, with nothing written into them
+  li t6, 4
+  la s2, used
+  li t2, 1000000
+poll:
+  lhu t0, 2(s2)
+  li t1, 2
+  beq t0, t1, done
+  addi t2, t2, -1
+  bnez t2, poll
+  j fail
+done:
+  lw t0, 8(s2)
+  bnez t0, fail
+  lw t0, 16(s2)
+  bnez t0, fail
+
+  li t0, 0x100000  # test finisher
+  li t1, 0x5555
+  sw t1, 0(t0)
+hang:
+  j hang
+
+fail:
+  li t0, 0x100000
+  slli t1, t6, 16
+  li t2, 0x3333
+  or t1, t1, t2
+  sw t1, 0(t0)
+  j hang
+
+hello:
+  .ascii "hello, "
+console:
+  .ascii "console\n"
+.align 4
+desc:
+  .space 128
+avail:
+  .space 24
+.align 2
+used:
+  .space 72
@@ -0,0 +1,19 @@
+# Run by embed_test.c through librvemu. Asks the embedder's syscall 0x1000
+# to double 21, counts to 10000 so the run spans several time slices, then
+# exits with the doubled value.
+
+_start:
+  li a0, 21
+  li a7, 0x1000
+  ecall
+  mv s0, a0
+
+  li t0, 0
+  li t1, 10000
+count:
+  addi t0, t0, 1
+  blt t0, t1, count
+
+  mv a0, s0
+  li a7, 93
+  ecall
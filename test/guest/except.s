@@ -0,0 +1,37 @@
+# Ends in the exception argv[1] names: i for an illegal instruction, r for
+# an encoding with reserved bits set, b for ebreak and l for a load from an
+# unmapped page, taken once the loop around it has been jitted.
+
+_start:
+  ld t0, 16(sp)
+  lbu s0, 0(t0)
+  li t0, 105
+  beq s0, t0, illegal
+  li t0, 114
+  beq s0, t0, reserved
+  li t0, 98
+  beq s0, t0, break
+  la s1, val
+  li s3, 0
+  li s4, 4000
+
+load:
+  ld t0, 0(s1)
+  addi s3, s3, 1
+  blt s3, s4, load
+  li s1, 0
+  j load
+
+illegal:
+  .word 0
+
+reserved:
+  # slliw with a nonzero funct7
+  .word 0x0200109b
+
+break:
+  ebreak
+
+  .align 3
+val:
+  .dword 0
@@ -0,0 +1,49 @@
+# Checks that the only fds it has are its stdio: closing any of 3 to 63
+# must fail with EBADF. A file it opens then gets fd 3. Given an argument,
+# it goes on to die of a segfault.
+
+_start:
+  ld s0, 0(sp)
+
+  li t6, 1
+  li s1, 3
+  li s2, 64
+close_next:
+  mv a0, s1
+  li a7, 57
+  ecall
+  li t0, -9
+  bne a0, t0, fail
+  addi s1, s1, 1
+  blt s1, s2, close_next
+
+  li t6, 2
+  li a0, -100
+  la a1, path
+  li a2, 0x601
+  li a3, 0x1a4
+  li a7, 56
+  ecall
+  li t0, 3
+  bne a0, t0, fail
+  li t6, 3
+  li a7, 57
+  ecall
+  bnez a0, fail
+
+  li t0, 1
+  beq s0, t0, done
+  ld t0, 0(zero)
+
+done:
+  li a0, 0
+  li a7, 93
+  ecall
+
+fail:
+  mv a0, t6
+  li a7, 93
+  ecall
+
+path:
+  .asciz "out"
@@ -0,0 +1,69 @@
+# Prints its arguments one per line and exits with their count. Under
+# --fork-at-marker they come from SYS_RVEMU_FORKSRV, which must place them
+# without moving the program break. A failed check exits with 100 plus its
+# number.
+
+_start:
+  ld s0, 0(sp)
+  addi s1, sp, 8
+
+  li t6, 1
+  li a0, 0
+  li a7, 214
+  ecall
+  li t0, 4096
+  add s2, a0, t0
+  mv a0, s2
+  ecall
+  bne a0, s2, fail
+
+  li a7, 0x52560000
+  ecall
+  bltz a0, check_brk
+  mv s0, a0
+  mv s1, a1
+
+check_brk:
+  li t6, 2
+  li a0, 0
+  li a7, 214
+  ecall
+  bne a0, s2, fail
+
+  li s3, 0
+next_arg:
+  bge s3, s0, done
+  slli t0, s3, 3
+  add t0, s1, t0
+  ld s4, 0(t0)
+  mv t1, s4
+strlen:
+  lbu t2, 0(t1)
+  beqz t2, print
+  addi t1, t1, 1
+  j strlen
+print:
+  li a0, 1
+  mv a1, s4
+  sub a2, t1, s4
+  li a7, 64
+  ecall
+  li a0, 1
+  la a1, newline
+  li a2, 1
+  ecall
+  addi s3, s3, 1
+  j next_arg
+
+done:
+  mv a0, s0
+  li a7, 93
+  ecall
+
+fail:
+  addi a0, t6, 100
+  li a7, 93
+  ecall
+
+newline:
+  .ascii "\n"
@@ -0,0 +1,43 @@
+# Boots on the --system board and reaches devices with floating-point loads
+# and stores: it reads mtime with fld and flw, then powers off by storing
+# the finisher's code with fsw, or fsd when a check fails, with the number
+# of the first check that fails, or 0.
+
+_start:
+  li t6, 1
+  la t0, fail
+  csrrw zero, mtvec, t0  # a fault is a failure too
+  li s1, 0x200bff8  # CLINT mtime
+
+  # 1: fld reads the device, not the memory behind it
+  ld s2, 0(s1)
+  .word 0x0004b007  # fld f0, 0(s1)
+  .word 0xe2000353  # fmv.x.d t1, f0
+  beqz t1, fail
+  bltu t1, s2, fail
+
+  # 2: and so does flw, NaN-boxed
+  li t6, 2
+  .word 0x0004a087  # flw f1, 0(s1)
+  .word 0xe00083d3  # fmv.x.w t2, f1
+  beqz t2, fail
+  .word 0xe2008e53  # fmv.x.d t3, f1
+  srli t3, t3, 32
+  li t0, 0xffffffff
+  bne t3, t0, fail
+
+  li t0, 0x100000  # test finisher
+  li t1, 0x5555
+  .word 0xf0030153  # fmv.w.x f2, t1
+  .word 0x0022a027  # fsw f2, 0(t0)
+hang:
+  j hang
+
+fail:
+  li t0, 0x100000
+  slli t1, t6, 16
+  li t2, 0x3333
+  or t1, t1, t2
+  .word 0xf20301d3  # fmv.d.x f3, t1
+  .word 0x0032b027  # fsd f3, 0(t0)
+  j hang
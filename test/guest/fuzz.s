@@ -0,0 +1,122 @@
+# A fuzz target that opens files, writes them and grows its heap on every
+# input, then faults. Run with --vfs-allow allowed and input preloaded, in a
+# directory holding input, which starts with "in", and allowed/host, which
+# starts with "host". Each run has to start from the state of the first, so
+# every run crashes; one that sees what an earlier run left behind exits
+# with the number of the check that failed instead.
+
+_start:
+  li t6, 1
+  la a1, input
+  li a2, 0  # O_RDONLY
+  jal open
+  bltz a0, fail
+  mv s0, a0
+  la a1, host
+  li a2, 0
+  jal open
+  bltz a0, fail
+  mv s1, a0
+  li a0, 0
+  li a7, 214
+  ecall
+  mv s2, a0
+
+  la a0, buf
+  li a1, 64
+  li a7, 0x52560004  # SYS_RVEMU_FUZZ_START
+  ecall
+
+  # 2: the in-memory fd is back at its offset and the file as it was
+  li t6, 2
+  mv a0, s0
+  la a1, buf
+  li a2, 2
+  li a7, 63
+  ecall
+  li t0, 2
+  bne a0, t0, fail
+  la a1, buf
+  lbu t1, 0(a1)
+  li t0, 105  # 'i'
+  bne t1, t0, fail
+
+  # 3: so is the host fd
+  li t6, 3
+  mv a0, s1
+  la a1, buf
+  li a2, 4
+  li a7, 63
+  ecall
+  li t0, 4
+  bne a0, t0, fail
+  la a1, buf
+  lbu t1, 0(a1)
+  li t0, 104  # 'h'
+  bne t1, t0, fail
+
+  # 4: a file created by an earlier run is gone
+  li t6, 4
+  la a1, log
+  li a2, 0
+  jal open
+  li t0, -2  # ENOENT
+  bne a0, t0, fail
+
+  # 5: the break is where it was
+  li t6, 5
+  li a0, 0
+  li a7, 214
+  ecall
+  bne a0, s2, fail
+
+  # 6: fds opened by earlier runs were closed, so there is room for more
+  li t6, 6
+  la a1, log
+  li a2, 0x201  # O_WRONLY | O_CREAT
+  jal open
+  bltz a0, fail
+  la a1, host
+  li a2, 0
+  jal open
+  bltz a0, fail
+  la a1, input
+  li a2, 2  # O_RDWR
+  jal open
+  bltz a0, fail
+
+  # leave the files changed and the heap grown
+  la a1, buf
+  li a2, 2
+  li a3, 0
+  li a7, 68
+  ecall
+  li t0, 0x100000
+  add a0, s2, t0
+  li a7, 214
+  ecall
+
+  ld t0, 0(zero)
+
+# openat(AT_FDCWD, a1, a2, 0644)
+open:
+  li a0, -100
+  li a3, 0x1a4
+  li a7, 56
+  ecall
+  ret
+
+fail:
+  mv a0, t6
+  li a7, 93
+  ecall
+
+input:
+  .asciz "input"
+host:
+  .asciz "allowed/host"
+log:
+  .asciz "log"
+.align 8
+buf:
+  .space 64
@@ -0,0 +1,52 @@
+# Writes its id, the first byte of argv[1], to its own memory and, often
+# enough for the block to be jitted, through addresses one to eight guest
+# windows above and below it, which wrap back around into its own window.
+# Run side by side in --batch, a guest that reached another's memory would
+# see a foreign id when it checks.
+
+_start:
+  ld t0, 16(sp)
+  lbu s0, 0(t0)
+  la s1, val
+  sd s0, 0(s1)
+  li s3, 0
+  li s4, 4000
+
+wild:
+  andi t0, s3, 7
+  addi t0, t0, 1
+  slli t0, t0, 35
+  add t1, s1, t0
+  sd s0, 0(t1)
+  li t6, 1
+  ld t2, 0(t1)
+  bne t2, s0, fail
+  sub t1, s1, t0
+  sd s0, 0(t1)
+  li t6, 2
+  ld t2, 0(t1)
+  bne t2, s0, fail
+  addi s3, s3, 1
+  blt s3, s4, wild
+
+  # give the other guests time to do the same before the last check
+  li t0, 1000000
+spin:
+  addi t0, t0, -1
+  bnez t0, spin
+
+  li t6, 3
+  ld t2, 0(s1)
+  bne t2, s0, fail
+  li a0, 0
+  li a7, 93
+  ecall
+
+fail:
+  mv a0, t6
+  li a7, 93
+  ecall
+
+  .align 3
+val:
+  .dword 0
@@ -0,0 +1,52 @@
+# Stirs a table with a xorshift generator, often enough for the loop to be
+# jitted, and writes the table and a sum over it to stdout, which has to
+# be the same whether it ran jitted or interpreted.
+
+_start:
+  li s0, 0x9e3779b97f4a7c15
+  la s1, table
+  li s2, 0
+  li s3, 0
+  li s4, 20000
+
+stir:
+  slli t0, s0, 13
+  xor s0, s0, t0
+  srli t0, s0, 7
+  xor s0, s0, t0
+  slli t0, s0, 17
+  xor s0, s0, t0
+  andi t1, s0, 63
+  slli t1, t1, 3
+  add t1, s1, t1
+  ld t2, 0(t1)
+  add t2, t2, s0
+  sd t2, 0(t1)
+  lw t3, 4(t1)
+  addw t3, t3, t2
+  sw t3, 0(t1)
+  lbu t4, 3(t1)
+  sltu t5, t4, s3
+  add s2, s2, t5
+  sb s3, 7(t1)
+  lh t4, 2(t1)
+  sub s2, s2, t4
+  addi s3, s3, 1
+  blt s3, s4, stir
+
+  la t0, sum
+  sd s2, 0(t0)
+  li a0, 1
+  mv a1, s1
+  li a2, 520
+  li a7, 64
+  ecall
+  li a0, 0
+  li a7, 93
+  ecall
+
+  .align 3
+table:
+  .space 512
+sum:
+  .dword 0
@@ -0,0 +1,147 @@
+# mmap and munmap argument checks. Exits with the number of the first check
+# that fails, or 0.
+
+_start:
+  # 1: MAP_FIXED past the end of the guest window
+  li t6, 1
+  li a0, 0x800000000
+  li a1, 4096
+  li a3, 0x32  # MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS
+  jal map
+  li t0, -12  # ENOMEM
+  bne a0, t0, fail
+
+  # 2: MAP_FIXED straddling the end of the window
+  li t6, 2
+  li a0, 0x7ffffff000
+  li a1, 0x2000
+  li a3, 0x32
+  jal map
+  li t0, -12
+  bne a0, t0, fail
+
+  # 3: a length that overflows when rounded up to pages
+  li t6, 3
+  li a0, 0
+  li a1, -1
+  li a3, 0x22  # MAP_PRIVATE | MAP_ANONYMOUS
+  jal map
+  li t0, -12
+  bne a0, t0, fail
+
+  # 4: munmap past the end of the window
+  li t6, 4
+  li a0, 0x800000000
+  li a1, 4096
+  li a7, 215
+  ecall
+  li t0, -22  # EINVAL
+  bne a0, t0, fail
+
+  # 5: munmap with a length that wraps around
+  li t6, 5
+  li a0, 0x10000000
+  li a1, -4096
+  li a7, 215
+  ecall
+  li t0, -22
+  bne a0, t0, fail
+
+  # 6: MAP_FIXED_NOREPLACE over the program itself
+  li t6, 6
+  li a0, 0x10000
+  li a1, 4096
+  li a3, 0x100022  # MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE
+  jal map
+  li t0, -17  # EEXIST
+  bne a0, t0, fail
+
+  # 7: MAP_FIXED_NOREPLACE on a free range lands exactly there
+  li t6, 7
+  li a0, 0x200000000
+  li a1, 0x2000
+  li a3, 0x100022
+  jal map
+  li t0, 0x200000000
+  bne a0, t0, fail
+  li t1, 1234
+  sd t1, 8(a0)
+  ld t2, 8(a0)
+  bne t1, t2, fail
+
+  # 8: and a second one there collides with it
+  li t6, 8
+  li a0, 0x200001000
+  li a1, 4096
+  li a3, 0x100022
+  jal map
+  li t0, -17
+  bne a0, t0, fail
+
+  # 9: a plain anonymous mapping still works
+  li t6, 9
+  li a0, 0
+  li a1, 4096
+  li a3, 0x22
+  jal map
+  li t0, 0x800000000
+  bgeu a0, t0, fail
+  li t1, 99
+  sd t1, 0(a0)
+  ld t2, 0(a0)
+  bne t1, t2, fail
+
+  # 10: unmapped ranges are used again, so mapping and unmapping 2 GiB ten
+  # times fits the 16 GiB above the heap
+  li t6, 10
+  li s0, 10
+remap:
+  li a0, 0
+  li a1, 0x80000000
+  li a3, 0x22
+  jal map
+  li t0, 0x800000000
+  bgeu a0, t0, fail
+  li a1, 0x80000000
+  li a7, 215
+  ecall
+  bnez a0, fail
+  addi s0, s0, -1
+  bnez s0, remap
+
+  # 11: a break past the heap's room stays where it was
+  li t6, 11
+  li a0, 0
+  li a7, 214
+  ecall
+  mv s0, a0
+  li t0, 0x800000000
+  add a0, s0, t0
+  li a7, 214
+  ecall
+  bne a0, s0, fail
+
+  # 12: and so does one below the start of the heap
+  li t6, 12
+  li a0, 4096
+  li a7, 214
+  ecall
+  bne a0, s0, fail
+
+  li a0, 0
+  li a7, 93
+  ecall
+
+# mmap(a0, a1, PROT_READ | PROT_WRITE, a3, -1, 0)
+map:
+  li a2, 3
+  li a4, -1
+  li a5, 0
+  li a7, 222
+  ecall
+  ret
+
+fail:
+  mv a0, t6
+  li a7, 93
+  ecall
@@ -0,0 +1,40 @@
+# Writes "1\n" to stdout, overwrites it with pwrite and then appends "3\n".
+# With stdout a file, that leaves "2\n3\n" when the writes land in order.
+
+_start:
+  li a0, 1
+  la a1, one
+  li a2, 2
+  li a7, 64
+  ecall
+
+  li a0, 1
+  la a1, two
+  li a2, 2
+  li a3, 0
+  li a7, 68
+  ecall
+  li t0, 2
+  bne a0, t0, fail
+
+  li a0, 1
+  la a1, three
+  li a2, 2
+  li a7, 64
+  ecall
+
+  li a0, 0
+  li a7, 93
+  ecall
+
+fail:
+  li a0, 1
+  li a7, 93
+  ecall
+
+one:
+  .ascii "1\n"
+two:
+  .ascii "2\n"
+three:
+  .ascii "3\n"
@@ -0,0 +1,59 @@
+# Writes to stdout what changes from run to run: the monotonic clock, the
+# time of day and 16 bytes of /dev/urandom. Exits with the number of the
+# first call that fails, or 0.
+
+_start:
+  li t6, 1
+  li a0, 1  # CLOCK_MONOTONIC
+  la a1, out
+  li a7, 113
+  ecall
+  bnez a0, fail
+
+  li t6, 2
+  la a0, out
+  addi a0, a0, 16
+  li a1, 0
+  li a7, 169
+  ecall
+  bnez a0, fail
+
+  li t6, 3
+  li a0, -100  # AT_FDCWD
+  la a1, urandom
+  li a2, 0  # O_RDONLY
+  li a3, 0
+  li a7, 56
+  ecall
+  bltz a0, fail
+  la a1, out
+  addi a1, a1, 32
+  li a2, 16
+  li a7, 63
+  ecall
+  li t0, 16
+  bne a0, t0, fail
+
+  li t6, 4
+  li a0, 1
+  la a1, out
+  li a2, 48
+  li a7, 64
+  ecall
+  li t0, 48
+  bne a0, t0, fail
+
+  li a0, 0
+  li a7, 93
+  ecall
+
+fail:
+  mv a0, t6
+  li a7, 93
+  ecall
+
+urandom:
+  .asciz "/dev/urandom"
+.align 8
+out:
+  .space 48
@@ -0,0 +1,96 @@
+# Boots on the --system board in S mode under --sbi, prints "sbi\n" with
+# the debug console extension and takes a timer interrupt armed with
+# set_timer, then shuts down with the system reset extension. Fails through
+# the test finisher with the number of the first check that fails.
+
+_start:
+  li t6, 1
+  la t0, trap
+  csrrw zero, stvec, t0
+
+  # 1: the TIME and DBCN extensions are there
+  li a0, 0x54494d45  # TIME
+  li a6, 3  # probe_extension
+  li a7, 0x10  # BASE
+  ecall
+  bnez a0, fail
+  beqz a1, fail
+  li a0, 0x4442434e  # DBCN
+  li a6, 3
+  li a7, 0x10
+  ecall
+  bnez a0, fail
+  beqz a1, fail
+
+  # 2: a console write takes all of the buffer
+  li t6, 2
+  li a0, 4
+  la a1, message
+  li a2, 0
+  li a6, 0  # console_write
+  li a7, 0x4442434e
+  ecall
+  bnez a0, fail
+  li t0, 4
+  bne a1, t0, fail
+
+  # 3: set_timer 1 ms ahead
+  li t6, 3
+  csrrs s1, time, zero
+  li t0, 10000
+  add s2, s1, t0
+  mv a0, s2
+  li a6, 0  # set_timer
+  li a7, 0x54494d45
+  ecall
+  bnez a0, fail
+  li t0, 0x20  # STIE
+  csrrs zero, sie, t0
+  csrrsi zero, sstatus, 2  # SIE
+
+  # 4: the interrupt comes within a second
+  li t6, 4
+  li t0, 10000000
+  add s3, s1, t0
+wait:
+  csrrs t1, time, zero
+  bltu t1, s3, wait
+  j fail
+
+trap:
+  # 5: it is the supervisor timer, taken no earlier than asked
+  li t6, 5
+  csrrs t0, scause, zero
+  li t1, 0x8000000000000005
+  bne t0, t1, fail
+  csrrs t1, time, zero
+  bltu t1, s2, fail
+
+  # 6: the next set_timer clears it
+  li t6, 6
+  li a0, -1
+  li a6, 0
+  li a7, 0x54494d45
+  ecall
+  csrrs t0, sip, zero
+  andi t0, t0, 0x20  # STIP
+  bnez t0, fail
+
+  li a0, 0  # shutdown
+  li a1, 0  # no reason
+  li a6, 0  # system_reset
+  li a7, 0x53525354  # SRST
+  ecall
+hang:
+  j hang
+
+fail:
+  li t0, 0x100000  # test finisher
+  slli t1, t6, 16
+  li t2, 0x3333
+  or t1, t1, t2
+  sw t1, 0(t0)
+  j hang
+
+message:
+  .ascii "sbi\n"
@@ -0,0 +1,73 @@
+# Grows its heap and saves itself with SYS_RVEMU_SNAPSHOT, then exits
+# with 7. Restored from the snapshot, the same call returns 1 and it checks
+# its memory and heap came back and the heap still grows, then exits with
+# the number of the first check that fails, or 0.
+
+_start:
+  la s1, val
+  li t0, 42
+  sd t0, 0(s1)
+  li a0, 0
+  li a7, 214
+  ecall
+  mv s2, a0
+  li t0, 0x1000
+  add a0, s2, t0
+  li a7, 214
+  ecall
+  li t0, 43
+  sd t0, 0(s2)
+
+  li a7, 0x52560001  # SYS_RVEMU_SNAPSHOT
+  ecall
+  li t6, 1
+  bltz a0, fail
+  bnez a0, restored
+  li a0, 7
+  li a7, 93
+  ecall
+
+restored:
+  # 2: memory written before the snapshot
+  li t6, 2
+  ld t1, 0(s1)
+  li t0, 42
+  bne t1, t0, fail
+
+  # 3: the heap
+  li t6, 3
+  li a0, 0
+  li a7, 214
+  ecall
+  li t0, 0x1000
+  add t0, s2, t0
+  bne a0, t0, fail
+  ld t1, 0(s2)
+  li t0, 43
+  bne t1, t0, fail
+
+  # 4: growing it maps more past the restored end
+  li t6, 4
+  li t0, 0x400000
+  add s3, s2, t0
+  mv a0, s3
+  li a7, 214
+  ecall
+  bne a0, s3, fail
+  li t0, 44
+  sd t0, -8(s3)
+  ld t1, -8(s3)
+  bne t1, t0, fail
+
+  li a0, 0
+  li a7, 93
+  ecall
+
+fail:
+  mv a0, t6
+  li a7, 93
+  ecall
+
+  .align 3
+val:
+  .dword 0
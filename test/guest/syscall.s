@@ -0,0 +1,265 @@
+# Host I/O and time syscalls and the errors they return. Exits with the
+# number of the first check that fails, or 0, and writes "abc\n" to stdout
+# on the way.
+
+_start:
+  # 1: pread on a closed fd
+  li t6, 1
+  li a0, 77
+  la a1, buf
+  li a2, 8
+  li a3, 0
+  li a7, 67
+  ecall
+  li t0, -9  # EBADF
+  bne a0, t0, fail
+
+  # 2: pwrite on a closed fd
+  li t6, 2
+  li a0, 77
+  la a1, buf
+  li a2, 8
+  li a3, 0
+  li a7, 68
+  ecall
+  li t0, -9
+  bne a0, t0, fail
+
+  # 3: readv on a closed fd
+  li t6, 3
+  li a0, 77
+  la a1, iov
+  li a2, 2
+  li a7, 65
+  ecall
+  li t0, -9
+  bne a0, t0, fail
+
+  # 4: writev on a closed fd
+  li t6, 4
+  li a0, 77
+  la a1, iov
+  li a2, 2
+  li a7, 66
+  ecall
+  li t0, -9
+  bne a0, t0, fail
+
+  # 5: preadv on a closed fd
+  li t6, 5
+  li a0, 77
+  la a1, iov
+  li a2, 2
+  li a3, 0
+  li a7, 69
+  ecall
+  li t0, -9
+  bne a0, t0, fail
+
+  # 6: pwritev on a closed fd
+  li t6, 6
+  li a0, 77
+  la a1, iov
+  li a2, 2
+  li a3, 0
+  li a7, 70
+  ecall
+  li t0, -9
+  bne a0, t0, fail
+
+  # 7: more iovecs than UIO_MAXIOV
+  li t6, 7
+  li a0, 1
+  la a1, iov
+  li a2, 1025
+  li a7, 66
+  ecall
+  li t0, -22  # EINVAL
+  bne a0, t0, fail
+
+  # 8: writev of two pieces to stdout
+  li t6, 8
+  li a0, 1
+  la a1, iov
+  li a2, 2
+  li a7, 66
+  ecall
+  li t0, 4
+  bne a0, t0, fail
+
+  # 9: a file written and read back at an offset
+  li t6, 9
+  li a0, -100  # AT_FDCWD
+  la a1, path
+  li a2, 0x602  # O_RDWR | O_CREAT | O_TRUNC
+  li a3, 0x1a4
+  li a7, 56
+  ecall
+  bltz a0, fail
+  mv s0, a0
+  mv a0, s0
+  la a1, text
+  li a2, 3
+  li a3, 2
+  li a7, 68
+  ecall
+  li t0, 3
+  bne a0, t0, fail
+  mv a0, s0
+  la a1, buf
+  li a2, 8
+  li a3, 1
+  li a7, 67
+  ecall
+  li t0, 4  # a hole byte and "ab\n"
+  bne a0, t0, fail
+  la a1, buf
+  lbu t1, 1(a1)
+  li t0, 97
+  bne t1, t0, fail
+
+  # 10: preadv splits what it reads across the iovecs
+  li t6, 10
+  mv a0, s0
+  la a1, iov2
+  li a2, 2
+  li a3, 2
+  li a7, 69
+  ecall
+  li t0, 3
+  bne a0, t0, fail
+  la a1, buf
+  lbu t1, 16(a1)
+  li t0, 98
+  bne t1, t0, fail
+
+  # 11: fstat on a closed fd leaves the buffer alone
+  li t6, 11
+  li a0, 77
+  la a1, stat
+  li a7, 80
+  ecall
+  li t0, -9
+  bne a0, t0, fail
+  la a1, stat
+  ld t1, 0(a1)
+  li t0, 0x5a5a
+  bne t1, t0, fail
+
+  # 12: and fstat into unmapped memory fails instead of faulting
+  li t6, 12
+  mv a0, s0
+  li a1, 0x300000000
+  li a7, 80
+  ecall
+  li t0, -14  # EFAULT
+  bne a0, t0, fail
+
+  # 13: the fast-path time calls fail on unmapped memory too
+  li t6, 13
+  li a0, 1  # CLOCK_MONOTONIC
+  li a1, 0x300000000
+  li a7, 113
+  ecall
+  li t0, -14
+  bne a0, t0, fail
+  li a0, 0x300000000
+  li a1, 0
+  li a7, 169
+  ecall
+  li t0, -14
+  bne a0, t0, fail
+
+  # 14: the monotonic clock is a proper timespec and does not go back
+  li t6, 14
+  li a0, 1
+  la a1, ts
+  li a7, 113
+  ecall
+  bnez a0, fail
+  li a0, 1
+  la a1, ts2
+  li a7, 113
+  ecall
+  bnez a0, fail
+  la a1, ts
+  ld t1, 0(a1)
+  ld t2, 8(a1)
+  ld t3, 16(a1)
+  ld t4, 24(a1)
+  li t0, 1000000000
+  bgeu t2, t0, fail
+  bgeu t4, t0, fail
+  blt t3, t1, fail
+  bne t3, t1, monotonic
+  blt t4, t2, fail
+monotonic:
+
+  # 15: gettimeofday gives a time after 2020 with a proper tv_usec
+  li t6, 15
+  la a0, tv
+  li a1, 0
+  li a7, 169
+  ecall
+  bnez a0, fail
+  la a1, tv
+  ld t1, 0(a1)
+  ld t2, 8(a1)
+  li t0, 1577836800
+  blt t1, t0, fail
+  li t0, 1000000
+  bgeu t2, t0, fail
+
+  # 16: and the realtime clock read after it is no earlier
+  li t6, 16
+  li a0, 0  # CLOCK_REALTIME
+  la a1, ts
+  li a7, 113
+  ecall
+  bnez a0, fail
+  la a1, ts
+  ld t3, 0(a1)
+  blt t3, t1, fail
+
+  li a0, 0
+  li a7, 93
+  ecall
+
+fail:
+  mv a0, t6
+  li a7, 93
+  ecall
+
+.align 8
+iov:
+  .dword piece1
+  .dword 2
+  .dword piece2
+  .dword 2
+iov2:
+  .dword buf
+  .dword 1
+  .dword buf2
+  .dword 8
+piece1:
+  .ascii "ab"
+piece2:
+  .ascii "c\n"
+text:
+  .ascii "ab\n"
+path:
+  .asciz "data"
+.align 8
+buf:
+  .space 16
+buf2:
+  .space 16
+stat:
+  .dword 0x5a5a
+  .space 120
+ts:
+  .space 16
+ts2:
+  .space 16
+tv:
+  .space 16
@@ -0,0 +1,52 @@
+# Boots on the --system board, arms the CLINT timer 1 ms ahead and waits
+# for its interrupt through mtvec. Powers off through the test finisher
+# with the number of the first check that fails, or 0.
+
+_start:
+  li t6, 1
+  la t0, trap
+  csrrw zero, mtvec, t0
+  li s0, 0x2000000  # CLINT
+  li t0, 0xbff8  # mtime
+  add s1, s0, t0
+  ld t1, 0(s1)
+  li t0, 10000
+  add s2, t1, t0
+  li t0, 0x4000  # mtimecmp
+  add t0, s0, t0
+  sd s2, 0(t0)
+  li t0, 0x80  # MTIE
+  csrrs zero, mie, t0
+  csrrsi zero, mstatus, 8  # MIE
+
+  # 1: the interrupt comes within a second
+  li t0, 10000000
+  add s3, t1, t0
+wait:
+  ld t1, 0(s1)
+  bltu t1, s3, wait
+  j fail
+
+trap:
+  # 2: it is the machine timer, taken no earlier than mtimecmp
+  li t6, 2
+  csrrs t0, mcause, zero
+  li t1, 0x8000000000000007
+  bne t0, t1, fail
+  ld t1, 0(s1)
+  bltu t1, s2, fail
+
+pass:
+  li t0, 0x100000  # test finisher
+  li t1, 0x5555
+  sw t1, 0(t0)
+hang:
+  j hang
+
+fail:
+  li t0, 0x100000
+  slli t1, t6, 16
+  li t2, 0x3333
+  or t1, t1, t2
+  sw t1, 0(t0)
+  j hang
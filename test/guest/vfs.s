@@ -0,0 +1,106 @@
+# Checks of the in-memory filesystem, run with --vfs-allow allowed and
+# input preloaded, twice, in a directory holding allowed/, a file named
+# secret and one named input that starts with "in". Exits with the number
+# of the first check that fails, or 0.
+
+_start:
+  # 1: ".." out of the allowed prefix does not reach the host
+  li t6, 1
+  la a1, escape
+  li a2, 0  # O_RDONLY
+  jal open
+  li t0, -2  # ENOENT
+  bne a0, t0, fail
+
+  # 2: a sibling sharing the prefix's name stays in memory
+  li t6, 2
+  la a1, sibling
+  li a2, 0x201  # O_WRONLY | O_CREAT
+  jal open
+  bltz a0, fail
+  mv s1, a0
+
+  # 3: a path inside the prefix, spelled untidily, goes to the host
+  li t6, 3
+  la a1, inside
+  li a2, 0x202  # O_RDWR | O_CREAT
+  jal open
+  bltz a0, fail
+  mv s0, a0
+
+  # 4: relative to a directory fd, which the vfs cannot resolve
+  li t6, 4
+  mv a0, s0
+  la a1, sibling
+  li a2, 0x202
+  li a3, 0x1a4
+  li a7, 56
+  ecall
+  li t0, -38  # ENOSYS
+  bne a0, t0, fail
+
+  # 5: fstat on a closed fd
+  li t6, 5
+  li a0, 77
+  la a1, stat
+  li a7, 80
+  ecall
+  li t0, -9  # EBADF
+  bne a0, t0, fail
+
+  # 6: a write far past the end is refused rather than allocated
+  li t6, 6
+  mv a0, s1
+  la a1, stat
+  li a2, 8
+  li a3, 0x10000000000
+  li a7, 68
+  ecall
+  li t0, -27  # EFBIG
+  bne a0, t0, fail
+
+  # 7: the input preloaded twice reads as itself
+  li t6, 7
+  la a1, input
+  li a2, 0
+  jal open
+  bltz a0, fail
+  la a1, stat
+  li a2, 2
+  li a7, 63
+  ecall
+  li t0, 2
+  bne a0, t0, fail
+  la a1, stat
+  lbu t1, 1(a1)
+  li t0, 110  # 'n'
+  bne t1, t0, fail
+
+  li a0, 0
+  li a7, 93
+  ecall
+
+# openat(AT_FDCWD, a1, a2, 0644)
+open:
+  li a0, -100
+  li a3, 0x1a4
+  li a7, 56
+  ecall
+  ret
+
+fail:
+  mv a0, t6
+  li a7, 93
+  ecall
+
+escape:
+  .asciz "allowed/../secret"
+sibling:
+  .asciz "allowedfoo"
+inside:
+  .asciz "./allowed//f"
+input:
+  .asciz "input"
+.align 8
+stat:
+  .space 128
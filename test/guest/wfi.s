@@ -0,0 +1,50 @@
+# Boots on the --system board with the machine timer enabled in mie but
+# interrupts off in mstatus, arms the timer 50 ms ahead and waits in WFI.
+# Powers off through the test finisher with the number of the first check
+# that fails, or 0.
+
+_start:
+  li t6, 1
+  la t0, fail
+  csrrw zero, mtvec, t0  # no trap is expected
+  li s0, 0x2000000  # CLINT
+  li t0, 0xbff8  # mtime
+  add s1, s0, t0
+  ld t1, 0(s1)
+  li t0, 500000
+  add s2, t1, t0
+  li t0, 0x4000  # mtimecmp
+  add t0, s0, t0
+  sd s2, 0(t0)
+  li t0, 0x80  # MTIE
+  csrrs zero, mie, t0
+  li s3, 0
+
+sleep:
+  wfi
+  # 1: WFI sleeps until the timer is due rather than returning at once
+  addi s3, s3, 1
+  li t0, 100
+  bgeu s3, t0, fail
+  ld t1, 0(s1)
+  bltu t1, s2, sleep
+
+  # 2: and wakes with it pending
+  li t6, 2
+  csrrs t0, mip, zero
+  andi t0, t0, 0x80  # MTIP
+  beqz t0, fail
+
+  li t0, 0x100000  # test finisher
+  li t1, 0x5555
+  sw t1, 0(t0)
+hang:
+  j hang
+
+fail:
+  li t0, 0x100000
+  slli t1, t6, 16
+  li t2, 0x3333
+  or t1, t1, t2
+  sw t1, 0(t0)
+  j hang
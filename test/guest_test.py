@@ -0,0 +1,373 @@
+#!/usr/bin/env python3
+"""Runs guest programs under rvemu and checks how they end.
+
+    guest_test.py RVEMU [TEST...]
+
+The programs live in test/guest and are assembled with rvasm.py, so no
+riscv toolchain is needed. Most of them check their own results and exit
+with the number of the first check that failed. With no TEST given, every
+test runs.
+"""
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+import rvasm
+
+GUEST_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "guest")
+TIMEOUT = 60
+RAM_BASE = 0x80000000  # where --system guests are linked
+
+TESTS = {}
+
+
+def test(fn):
+    TESTS[fn.__name__.replace("_", "-")] = fn
+    return fn
+
+
+class TestFailure(Exception):
+    pass
+
+
+class Env:
+    def __init__(self, rvemu, tmp):
+        self.rvemu = rvemu
+        self.tmp = tmp
+
+    def path(self, name):
+        return os.path.join(self.tmp, name)
+
+    def asm(self, name, base=rvasm.BASE):
+        """Assembles guest/<name>.s and returns the program's path."""
+        out = self.path(name)
+        if not os.path.exists(out):
+            with open(os.path.join(GUEST_DIR, name + ".s")) as f:
+                rvasm.build(f.read(), out, base)
+        return out
+
+    def tool(self, name):
+        """Returns the path of a tool built next to rvemu."""
+        return os.path.join(os.path.dirname(self.rvemu), name)
+
+    def run(self, *args, stdin=None, stdout=subprocess.PIPE, expect=0):
+        """Runs rvemu with args and checks its exit status."""
+        result = subprocess.run([self.rvemu, *args], input=stdin,
+                                stdout=stdout, stderr=subprocess.PIPE,
+                                timeout=TIMEOUT, cwd=self.tmp)
+        check_status(result, expect)
+        return result
+
+
+def check_status(result, expect):
+    status = result.returncode
+    if status == expect:
+        return
+    raise TestFailure(
+        f"{' '.join(map(str, result.args))} exited with {status}, "
+        f"expected {expect}\nstdout: {result.stdout!r}\n"
+        f"stderr: {result.stderr!r}")
+
+
+def check(cond, message):
+    if not cond:
+        raise TestFailure(message)
+
+
+def start_server(env, sock, *args):
+    """Starts rvemu with args and waits until it takes connections on sock."""
+    server = subprocess.Popen([env.rvemu, *args], stderr=subprocess.PIPE,
+                              cwd=env.tmp)
+    deadline = time.monotonic() + TIMEOUT
+    while True:
+        # the server drops a connection that sends no request
+        with socket.socket(socket.AF_UNIX) as probe:
+            try:
+                probe.connect(sock)
+                return server
+            except OSError:
+                pass
+        if server.poll() is not None or time.monotonic() > deadline:
+            server.kill()
+            raise TestFailure(f"fork server on {sock} did not start: "
+                              f"{server.communicate()[1]!r}")
+        time.sleep(0.01)
+
+
+def forkrun(env, sock, *args):
+    return subprocess.run([env.tool("rvemu-forkrun"), sock, *args],
+                          capture_output=True, timeout=TIMEOUT, cwd=env.tmp)
+
+
+def run_system(env, name, *args, **kwargs):
+    """Boots guest/<name>.s on the --system board, with no console input.
+    It powers off through the test finisher, which gives the exit status."""
+    return env.run("--system", *args, env.asm(name, base=RAM_BASE),
+                   stdin=b"", **kwargs)
+
+
+def embed_test(env, test, prog):
+    """Runs one of the checks of embed_test.c, which uses librvemu."""
+    result = subprocess.run([env.tool("rvemu-embed-test"), test,
+                             env.asm(prog)],
+                            capture_output=True, timeout=TIMEOUT)
+    check_status(result, 0)
+
+
+@test
+def checkpoint(env):
+    with open(env.path("data"), "wb") as f:
+        f.write(b"file".ljust(4096, b"\0"))
+    env.run(env.asm("checkpoint"))
+
+
+@test
+def budget(env):
+    embed_test(env, "budget", "jit")
+
+
+@test
+def embed(env):
+    embed_test(env, "embed", "embed")
+
+
+@test
+def exceptions(env):
+    # the guest dies of the signal its exception maps to, jitted or not
+    prog = env.asm("except")
+    for mode in ([], ["--jit"]):
+        for arg, sig in (("i", 4), ("r", 4), ("b", 5), ("l", 11)):
+            env.run(*mode, prog, arg, expect=-sig)
+
+
+@test
+def fork_server(env):
+    prog = env.asm("forksrv")
+    for mode in ([], ["--fork-at-marker"]):
+        sock = env.path("sock")
+        # a socket left behind by a server that is gone is replaced
+        stale = socket.socket(socket.AF_UNIX)
+        stale.bind(sock)
+        stale.close()
+        server = start_server(env, sock, "--fork-server", sock, *mode, prog)
+        try:
+            for args in ([], ["a", "bc"]):
+                result = forkrun(env, sock, prog, *args)
+                check_status(result, 1 + len(args))
+                want = "".join(f"{a}\n" for a in [prog, *args]).encode()
+                check(result.stdout == want,
+                      f"{mode}: stdout was {result.stdout!r}")
+
+            # a run of some other program is refused
+            check_status(forkrun(env, sock, env.asm("mmap")), 127)
+
+            # and so is a second server on a socket that is in use
+            env.run("--fork-server", sock, prog, expect=1)
+        finally:
+            server.kill()
+            server.wait()
+        os.unlink(sock)
+
+    # a file that is not a socket is never removed
+    with open(env.path("file"), "w") as f:
+        f.write("data")
+    result = env.run("--fork-server", env.path("file"), prog, expect=1)
+    with open(env.path("file")) as f:
+        check(f.read() == "data", "the fork server replaced a regular file")
+
+
+@test
+def fuzz(env):
+    corpus = env.path("corpus")
+    os.mkdir(corpus)
+    runs = 1100  # more than the guest has fds
+    for i in range(runs):
+        with open(os.path.join(corpus, str(i)), "w") as f:
+            f.write(str(i))
+    with open(env.path("input"), "w") as f:
+        f.write("input")
+    os.mkdir(env.path("allowed"))
+    with open(env.path("allowed/host"), "w") as f:
+        f.write("host")
+    result = env.run("--fuzz-corpus", corpus, "--vfs-allow", "allowed",
+                     "--vfs-preload", "input", env.asm("fuzz"), expect=1)
+    summary = f"fuzz: {runs} runs, {runs} crashes"
+    check(summary.encode() in result.stderr,
+          f"stderr was {result.stderr!r}, expected {summary!r}")
+
+
+@test
+def jit(env):
+    prog = env.asm("jit")
+    interp = env.run(prog).stdout
+    check(len(interp) == 520, f"stdout was {interp!r}")
+    jitted = env.run("--jit", prog).stdout
+    check(jitted == interp,
+          f"jitted stdout was {jitted!r}, interpreted {interp!r}")
+
+
+@test
+def mmap(env):
+    env.run(env.asm("mmap"))
+
+
+@test
+def batch_isolation(env):
+    prog = env.asm("isolate")
+    with open(env.path("batch"), "w") as f:
+        for i in range(16):
+            f.write(f"{prog} {chr(ord('a') + i)}\n")
+    env.run("--batch", env.path("batch"), "--workers", "4")
+    env.run("--jit", "--batch", env.path("batch"), "--workers", "4")
+
+
+@test
+def buffer_output(env):
+    out = env.path("out")
+    with open(out, "wb") as f:
+        env.run("--buffer-output", env.asm("outbuf"), stdout=f)
+    with open(out, "rb") as f:
+        data = f.read()
+    check(data == b"2\n3\n", f"stdout was {data!r}")
+
+
+@test
+def system_blk(env):
+    with open(env.path("disk"), "wb") as f:
+        f.write(bytes(512) + b"virtblk!".ljust(512, b"\0"))
+    run_system(env, "blk", "--drive", env.path("disk"))
+
+
+@test
+def system_console(env):
+    out = run_system(env, "console").stdout
+    check(out == b"hello, console\n", f"stdout was {out!r}")
+
+
+@test
+def system_fp_mmio(env):
+    run_system(env, "fpmmio")
+
+
+@test
+def system_sbi(env):
+    out = run_system(env, "sbi", "--sbi").stdout
+    check(out == b"sbi\n", f"stdout was {out!r}")
+
+
+@test
+def system_timer(env):
+    run_system(env, "timer")
+
+
+@test
+def system_wfi(env):
+    run_system(env, "wfi")
+
+
+@test
+def trace(env):
+    env.run("--trace", "ring", "--trace-size", "4", env.asm("syscall"))
+    tracedump = env.tool("rvemu-tracedump")
+    dump = subprocess.run([tracedump, env.path("ring")], capture_output=True,
+                          timeout=TIMEOUT)
+    check_status(dump, 0)
+    lines = dump.stdout.decode().splitlines()
+    check(len(lines) == 4 and " exit(0" in lines[-1],
+          f"tracedump printed {dump.stdout!r}")
+
+    # a ring whose size does not fit a file is refused, not wrapped around
+    result = env.run("--trace", "huge", "--trace-size",
+                     str(2**64 // 96 + 1), env.asm("syscall"), expect=1)
+    check(b"cannot create trace file" in result.stderr,
+          f"stderr was {result.stderr!r}")
+
+
+@test
+def replay(env):
+    prog = env.asm("replay")
+    log = env.path("log")
+    recorded = env.run("--record", log, prog).stdout
+    check(len(recorded) == 48, f"stdout was {recorded!r}")
+    replayed = env.run("--replay", log, prog).stdout
+    check(replayed == recorded,
+          f"replayed stdout was {replayed!r}, recorded {recorded!r}")
+
+
+@test
+def serve_fds(env):
+    prog = env.asm("fds")
+    sock = env.path("sock")
+    server = start_server(env, sock, "--serve", sock, "--workers", "2")
+    try:
+        # the daemon's own fds are not the guest's to close, so it keeps
+        # serving, and a guest that dies of a signal is reported as such
+        for args, status in (([], 0), ([], 0), (["crash"], 128 + 11),
+                             ([], 0)):
+            check_status(forkrun(env, sock, prog, *args), status)
+    finally:
+        server.kill()
+        server.wait()
+
+
+@test
+def snapshot(env):
+    image = env.path("image")
+    env.run("--snapshot", image, env.asm("snapshot"), expect=7)
+    env.run("--restore", image)
+
+
+@test
+def syscall(env):
+    # the time checks hold with the tick-granular clocks too
+    for mode in ([], ["--coarse-clock"]):
+        result = env.run(*mode, env.asm("syscall"))
+        check(result.stdout == b"abc\n", f"stdout was {result.stdout!r}")
+
+
+@test
+def syscall_io_uring(env):
+    # the same results through the ring, or its blocking fallback
+    result = env.run("--io-uring", env.asm("syscall"))
+    check(result.stdout == b"abc\n", f"stdout was {result.stdout!r}")
+
+
+@test
+def vfs(env):
+    os.mkdir(env.path("allowed"))
+    with open(env.path("secret"), "w") as f:
+        f.write("secret")
+    with open(env.path("input"), "w") as f:
+        f.write("input")
+    env.run("--vfs-allow", "allowed", "--vfs-preload", "input",
+            "--vfs-preload", "input", env.asm("vfs"))
+    check(not os.path.exists(env.path("allowedfoo")),
+          "allowedfoo was created on the host")
+    check(os.path.exists(env.path("allowed/f")),
+          "allowed/f was not created on the host")
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("usage: guest_test.py RVEMU [TEST...]")
+    rvemu = os.path.abspath(sys.argv[1])
+    names = sys.argv[2:] or sorted(TESTS)
+    failed = []
+    for name in names:
+        if name not in TESTS:
+            sys.exit(f"unknown test {name}")
+        with tempfile.TemporaryDirectory(prefix="rvemu-test-") as tmp:
+            try:
+                TESTS[name](Env(rvemu, tmp))
+                print(f"PASS {name}")
+            except (TestFailure, subprocess.TimeoutExpired) as e:
+                print(f"FAIL {name}: {e}")
+                failed.append(name)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,329 @@
+#!/usr/bin/env python3
+"""A small RV64 assembler for the guest tests, so they need no toolchain.
+
+Takes one instruction or directive per line and writes a static ELF with a
+single RWX segment at 0x10000, entered at _start:
+
+    rvasm.py prog.s prog
+
+Besides the usual RV64IM instructions and CSR ops it knows li (any 64-bit
+value), la, mv, j, ret, nop and the branches against zero, and the .word,
+.dword, .ascii, .asciz, .space and .align directives. Anything else can be
+spelled out with .word.
+"""
+import ast
+import os
+import re
+import struct
+import sys
+
+BASE = 0x10000
+BSS_SIZE = 0x10000  # zeroed memory past the end of the image
+
+ABI = ("zero ra sp gp tp t0 t1 t2 s0 s1 a0 a1 a2 a3 a4 a5 a6 a7 "
+       "s2 s3 s4 s5 s6 s7 s8 s9 s10 s11 t3 t4 t5 t6").split()
+REGS = {name: i for i, name in enumerate(ABI)}
+REGS.update({f"x{i}": i for i in range(32)})
+REGS["fp"] = 8
+
+ALU_I = {"addi": 0, "slti": 2, "sltiu": 3, "xori": 4, "ori": 6, "andi": 7}
+SHIFT_I = {"slli": (1, 0), "srli": (5, 0), "srai": (5, 0x400)}
+ALU_R = {
+    "add": (0, 0), "sub": (0, 0x20), "sll": (1, 0), "slt": (2, 0),
+    "sltu": (3, 0), "xor": (4, 0), "srl": (5, 0), "sra": (5, 0x20),
+    "or": (6, 0), "and": (7, 0), "mul": (0, 1), "mulh": (1, 1),
+    "mulhu": (3, 1), "div": (4, 1), "divu": (5, 1), "rem": (6, 1),
+    "remu": (7, 1),
+}
+ALU_RW = {
+    "addw": (0, 0), "subw": (0, 0x20), "sllw": (1, 0), "srlw": (5, 0),
+    "sraw": (5, 0x20), "mulw": (0, 1), "divw": (4, 1), "remw": (6, 1),
+}
+LOADS = {"lb": 0, "lh": 1, "lw": 2, "ld": 3, "lbu": 4, "lhu": 5, "lwu": 6}
+STORES = {"sb": 0, "sh": 1, "sw": 2, "sd": 3}
+BRANCHES = {"beq": 0, "bne": 1, "blt": 4, "bge": 5, "bltu": 6, "bgeu": 7}
+ZERO_BRANCHES = {"beqz": (0, False), "bnez": (1, False), "bltz": (4, False),
+                 "bgez": (5, False), "bgtz": (4, True), "blez": (5, True)}
+CSR_OPS = {"csrrw": 1, "csrrs": 2, "csrrc": 3,
+           "csrrwi": 5, "csrrsi": 6, "csrrci": 7}
+CSRS = {
+    "sstatus": 0x100, "sie": 0x104, "stvec": 0x105, "sepc": 0x141,
+    "scause": 0x142, "stval": 0x143, "sip": 0x144, "mstatus": 0x300,
+    "medeleg": 0x302, "mideleg": 0x303, "mie": 0x304, "mtvec": 0x305,
+    "mepc": 0x341, "mcause": 0x342, "mtval": 0x343, "mip": 0x344,
+    "time": 0xc01,
+}
+FIXED = {"ecall": 0x73, "ebreak": 0x100073, "mret": 0x30200073,
+         "sret": 0x10200073, "wfi": 0x10500073, "nop": 0x13,
+         "ret": 0x8067}
+
+
+class AsmError(Exception):
+    pass
+
+
+def reg(name):
+    try:
+        return REGS[name]
+    except KeyError:
+        raise AsmError(f"bad register {name}") from None
+
+
+def enc_r(op, f3, f7, rd, rs1, rs2):
+    return op | rd << 7 | f3 << 12 | rs1 << 15 | rs2 << 20 | f7 << 25
+
+
+def enc_i(op, f3, rd, rs1, imm):
+    return op | rd << 7 | f3 << 12 | rs1 << 15 | (imm & 0xfff) << 20
+
+
+def enc_s(f3, rs1, rs2, imm):
+    imm &= 0xfff
+    return (0x23 | (imm & 0x1f) << 7 | f3 << 12 | rs1 << 15 | rs2 << 20 |
+            (imm >> 5) << 25)
+
+
+def enc_b(f3, rs1, rs2, imm):
+    imm &= 0x1fff
+    return (0x63 | (imm >> 11 & 1) << 7 | (imm >> 1 & 0xf) << 8 | f3 << 12 |
+            rs1 << 15 | rs2 << 20 | (imm >> 5 & 0x3f) << 25 |
+            (imm >> 12 & 1) << 31)
+
+
+def enc_u(op, rd, imm):
+    return op | rd << 7 | (imm & 0xfffff) << 12
+
+
+def enc_j(rd, imm):
+    imm &= 0x1fffff
+    return (0x6f | rd << 7 | (imm >> 12 & 0xff) << 12 |
+            (imm >> 11 & 1) << 20 | (imm >> 1 & 0x3ff) << 21 |
+            (imm >> 20 & 1) << 31)
+
+
+def sext(value, bits):
+    value &= (1 << bits) - 1
+    return value - (1 << bits) if value >> (bits - 1) else value
+
+
+def hi_lo(value):
+    lo = sext(value, 12)
+    return (value - lo) >> 12 & 0xfffff, lo
+
+
+def li_words(rd, value):
+    value = sext(value, 64)
+    if -2048 <= value < 2048:
+        return [enc_i(0x13, 0, rd, 0, value)]
+    if -(1 << 31) <= value < (1 << 31):
+        hi, lo = hi_lo(value)
+        return [enc_u(0x37, rd, hi), enc_i(0x1b, 0, rd, rd, lo)]
+    lo = sext(value, 12)
+    rest = (value - lo) >> 12
+    shift = 12
+    while rest & 1 == 0:
+        rest >>= 1
+        shift += 1
+    words = li_words(rd, rest) + [enc_i(0x13, 1, rd, rd, shift)]
+    if lo:
+        words.append(enc_i(0x13, 0, rd, rd, lo))
+    return words
+
+
+def strip_comment(line):
+    quoted = False
+    for i, c in enumerate(line):
+        if c == '"' and (i == 0 or line[i - 1] != "\\"):
+            quoted = not quoted
+        elif c == "#" and not quoted:
+            return line[:i]
+    return line
+
+
+def string_literal(text):
+    return ast.literal_eval("b" + text.strip())
+
+
+class Assembler:
+    def __init__(self, base=BASE):
+        self.base = base
+        self.labels = {}
+
+    def value(self, text):
+        text = text.strip()
+        if text in self.labels:
+            return self.labels[text]
+        try:
+            return int(text, 0)
+        except ValueError:
+            raise AsmError(f"bad value {text}") from None
+
+    def mem(self, text):
+        m = re.fullmatch(r"\s*(-?\w*)\((\w+)\)\s*", text)
+        if not m:
+            raise AsmError(f"bad memory operand {text}")
+        return self.value(m.group(1) or "0"), reg(m.group(2))
+
+    def size(self, pc, op, rest, args):
+        if op == "li":
+            try:
+                return 4 * len(li_words(0, int(args[1], 0)))
+            except ValueError:
+                return 8  # a label, which fits 32 bits
+        if op == "la":
+            return 8
+        if op == ".word":
+            return 4 * len(args)
+        if op == ".dword":
+            return 8 * len(args)
+        if op == ".ascii":
+            return len(string_literal(rest))
+        if op == ".asciz":
+            return len(string_literal(rest)) + 1
+        if op == ".space":
+            return int(args[0], 0)
+        if op == ".align":
+            return -pc % int(args[0], 0)
+        return 4
+
+    def encode(self, pc, op, rest, a):
+        if op == "li":
+            try:
+                return li_words(reg(a[0]), int(a[1], 0))
+            except ValueError:
+                hi, lo = hi_lo(self.value(a[1]))
+                rd = reg(a[0])
+                return [enc_u(0x37, rd, hi), enc_i(0x1b, 0, rd, rd, lo)]
+        if op == "la":
+            hi, lo = hi_lo(self.value(a[1]) - pc)
+            rd = reg(a[0])
+            return [enc_u(0x17, rd, hi), enc_i(0x13, 0, rd, rd, lo)]
+        if op in FIXED:
+            return [FIXED[op]]
+        if op in ALU_I:
+            return [enc_i(0x13, ALU_I[op], reg(a[0]), reg(a[1]),
+                          self.value(a[2]))]
+        if op == "addiw":
+            return [enc_i(0x1b, 0, reg(a[0]), reg(a[1]), self.value(a[2]))]
+        if op in SHIFT_I:
+            f3, hi = SHIFT_I[op]
+            return [enc_i(0x13, f3, reg(a[0]), reg(a[1]),
+                          self.value(a[2]) | hi)]
+        if op in ALU_R:
+            f3, f7 = ALU_R[op]
+            return [enc_r(0x33, f3, f7, reg(a[0]), reg(a[1]), reg(a[2]))]
+        if op in ALU_RW:
+            f3, f7 = ALU_RW[op]
+            return [enc_r(0x3b, f3, f7, reg(a[0]), reg(a[1]), reg(a[2]))]
+        if op in LOADS:
+            off, base = self.mem(a[1])
+            return [enc_i(0x03, LOADS[op], reg(a[0]), base, off)]
+        if op in STORES:
+            off, base = self.mem(a[1])
+            return [enc_s(STORES[op], base, reg(a[0]), off)]
+        if op in BRANCHES:
+            return [enc_b(BRANCHES[op], reg(a[0]), reg(a[1]),
+                          self.value(a[2]) - pc)]
+        if op in ZERO_BRANCHES:
+            f3, swap = ZERO_BRANCHES[op]
+            rs1, rs2 = (0, reg(a[0])) if swap else (reg(a[0]), 0)
+            return [enc_b(f3, rs1, rs2, self.value(a[1]) - pc)]
+        if op in ("lui", "auipc"):
+            return [enc_u(0x37 if op == "lui" else 0x17, reg(a[0]),
+                          self.value(a[1]))]
+        if op == "jal":
+            if len(a) == 1:
+                a = ["ra"] + a
+            return [enc_j(reg(a[0]), self.value(a[1]) - pc)]
+        if op == "j":
+            return [enc_j(0, self.value(a[0]) - pc)]
+        if op == "jalr":
+            off, base = self.mem(a[1])
+            return [enc_i(0x67, 0, reg(a[0]), base, off)]
+        if op == "mv":
+            return [enc_i(0x13, 0, reg(a[0]), reg(a[1]), 0)]
+        if op in CSR_OPS:
+            csr = CSRS[a[1]] if a[1] in CSRS else self.value(a[1])
+            src = self.value(a[2]) if op.endswith("i") else reg(a[2])
+            return [enc_i(0x73, CSR_OPS[op], reg(a[0]), src, csr)]
+        if op == ".word":
+            return [self.value(x) & 0xffffffff for x in a]
+        raise AsmError(f"unknown instruction {op}")
+
+    def data(self, op, rest, a):
+        if op == ".dword":
+            return b"".join(struct.pack("<Q", self.value(x) & (2**64 - 1))
+                            for x in a)
+        if op == ".ascii":
+            return string_literal(rest)
+        if op == ".asciz":
+            return string_literal(rest) + b"\0"
+        return None
+
+    def assemble(self, source):
+        items = []
+        pc = self.base
+        for number, line in enumerate(source.splitlines(), 1):
+            line = strip_comment(line).strip()
+            while line and ":" in line.split()[0]:
+                label, _, line = line.partition(":")
+                self.labels[label.strip()] = pc
+                line = line.strip()
+            if not line:
+                continue
+            op, _, rest = line.partition(" ")
+            args = [x.strip() for x in rest.split(",")] if rest else []
+            try:
+                size = self.size(pc, op, rest, args)
+            except (AsmError, ValueError, SyntaxError, IndexError) as e:
+                raise AsmError(f"line {number}: {e}") from None
+            items.append((number, pc, op, rest, args, size))
+            pc += size
+
+        out = bytearray()
+        for number, pc, op, rest, args, size in items:
+            try:
+                if op in (".space", ".align"):
+                    chunk = bytes(size)
+                else:
+                    chunk = self.data(op, rest, args)
+                    if chunk is None:
+                        chunk = b"".join(struct.pack("<I", w) for w in
+                                         self.encode(pc, op, rest, args))
+            except (AsmError, KeyError, ValueError, IndexError) as e:
+                raise AsmError(f"line {number}: {e}") from None
+            if len(chunk) != size:
+                raise AsmError(f"line {number}: size changed in pass 2")
+            out += chunk
+        return bytes(out)
+
+
+def elf(code, entry, base=BASE):
+    header_size, phdr_size, offset = 64, 56, 0x1000
+    ident = b"\x7fELF" + bytes([2, 1, 1, 0]) + bytes(8)
+    header = ident + struct.pack("<HHIQQQIHHHHHH", 2, 243, 1, entry,
+                                 header_size, 0, 0, header_size, phdr_size,
+                                 1, 0, 0, 0)
+    phdr = struct.pack("<IIQQQQQQ", 1, 7, offset, base, base, len(code),
+                       len(code) + BSS_SIZE, 0x1000)
+    body = header + phdr
+    return body + bytes(offset - len(body)) + code
+
+
+def build(source, out, base=BASE):
+    asm = Assembler(base)
+    code = asm.assemble(source)
+    with open(out, "wb") as f:
+        f.write(elf(code, asm.labels.get("_start", base), base))
+    os.chmod(out, 0o755)
+    return asm.labels
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit("usage: rvasm.py SOURCE OUTPUT")
+    try:
+        with open(sys.argv[1]) as f:
+            build(f.read(), sys.argv[2])
+    except AsmError as e:
+        sys.exit(f"{sys.argv[1]}: {e}")
@@ -0,0 +1,73 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "types.h"
+
+// Runs one guest on an `rvemu --fork-server` with this process's stdio and
+// exits with the guest's status.
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <socket> <program> [args...]\n", argv[0]);
+    return 1;
+  }
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  // the server resolves the program's path in its own directory
+  char program[PATH_MAX];
+  if (realpath(argv[2], program)) argv[2] = program;
+
+  u32 len = 0;
+  for (int i = 2; i < argc; i++) {
+    len += strlen(argv[i]) + 1;
+  }
+  char* strings = malloc(len);
+  char* s = strings;
+  for (int i = 2; i < argc; i++) {
+    s = stpcpy(s, argv[i]) + 1;
+  }
+
+  int fds[3] = {0, 1, 2};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  struct iovec iov = {&len, sizeof(len)};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, 0) != sizeof(len) ||
+      write(fd, strings, len) != len) {
+    perror("send");
+    return 1;
+  }
+
+  i32 status;
+  if (read(fd, &status, sizeof(status)) != sizeof(status)) {
+    fprintf(stderr, "%s: no status from the fork server\n", argv[0]);
+    return 1;
+  }
+  if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  return WEXITSTATUS(status);
+}
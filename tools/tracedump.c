@@ -0,0 +1,143 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "syscall.h"
+#include "trace.h"
+#include "types.h"
+
+static const char* syscall_names[] = {
+    [SYS_EXIT] = "exit",
+    [SYS_EXIT_GROUP] = "exit_group",
+    [SYS_GETPID] = "getpid",
+    [SYS_KILL] = "kill",
+    [SYS_TGKILL] = "tgkill",
+    [SYS_READ] = "read",
+    [SYS_WRITE] = "write",
+    [SYS_OPENAT] = "openat",
+    [SYS_CLOSE] = "close",
+    [SYS_LSEEK] = "lseek",
+    [SYS_BRK] = "brk",
+    [SYS_LINKAT] = "linkat",
+    [SYS_UNLINKAT] = "unlinkat",
+    [SYS_MKDIRAT] = "mkdirat",
+    [SYS_RENAMEAT] = "renameat",
+    [SYS_CHDIR] = "chdir",
+    [SYS_GETCWD] = "getcwd",
+    [SYS_FSTAT] = "fstat",
+    [SYS_FSTATAT] = "fstatat",
+    [SYS_FACCESSAT] = "faccessat",
+    [SYS_PREAD] = "pread64",
+    [SYS_PWRITE] = "pwrite64",
+    [SYS_READV] = "readv",
+    [SYS_PREADV] = "preadv",
+    [SYS_PWRITEV] = "pwritev",
+    [SYS_UNAME] = "uname",
+    [SYS_GETUID] = "getuid",
+    [SYS_GETEUID] = "geteuid",
+    [SYS_GETGID] = "getgid",
+    [SYS_GETEGID] = "getegid",
+    [SYS_GETTID] = "gettid",
+    [SYS_SYSINFO] = "sysinfo",
+    [SYS_MMAP] = "mmap",
+    [SYS_MUNMAP] = "munmap",
+    [SYS_MREMAP] = "mremap",
+    [SYS_MPROTECT] = "mprotect",
+    [SYS_PRLIMIT64] = "prlimit64",
+    [SYS_RT_SIGACTION] = "rt_sigaction",
+    [SYS_WRITEV] = "writev",
+    [SYS_GETTIMEOFDAY] = "gettimeofday",
+    [SYS_TIMES] = "times",
+    [SYS_FSYNC] = "fsync",
+    [SYS_FCNTL] = "fcntl",
+    [SYS_FTRUNCATE] = "ftruncate",
+    [SYS_GETDENTS] = "getdents64",
+    [SYS_DUP] = "dup",
+    [SYS_DUP3] = "dup3",
+    [SYS_READLINKAT] = "readlinkat",
+    [SYS_RT_SIGPROCMASK] = "rt_sigprocmask",
+    [SYS_IOCTL] = "ioctl",
+    [SYS_GETRLIMIT] = "getrlimit",
+    [SYS_SETRLIMIT] = "setrlimit",
+    [SYS_GETRUSAGE] = "getrusage",
+    [SYS_CLOCK_GETTIME] = "clock_gettime",
+    [SYS_CLOCK_GETRES] = "clock_getres",
+    [SYS_SET_TID_ADDRESS] = "set_tid_address",
+    [SYS_SET_ROBUST_LIST] = "set_robust_list",
+    [SYS_MADVISE] = "madvise",
+    [SYS_STATX] = "statx",
+};
+
+static void print_record(const TraceRecord* rec) {
+  const char* name = NULL;
+  if (rec->nr < sizeof(syscall_names) / sizeof(syscall_names[0])) {
+    name = syscall_names[rec->nr];
+  }
+
+  printf("%8lu %12lu.%06lu pc=%#010lx ", rec->seq,
+         rec->timestamp_ns / 1000000000, rec->timestamp_ns / 1000 % 1000000,
+         rec->pc);
+  if (name) {
+    printf("%s(", name);
+  } else {
+    printf("syscall_%lu(", rec->nr);
+  }
+  for (int i = 0; i < 6; i++) {
+    printf(i == 0 ? "%#lx" : ", %#lx", rec->args[i]);
+  }
+
+  if (rec->duration_ns == RVEMU_TRACE_PENDING) {
+    printf(") = ? <unfinished>\n");
+  } else {
+    printf(") = %ld <%lu.%03luus>\n", (i64)rec->ret, rec->duration_ns / 1000,
+           rec->duration_ns % 1000);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <trace-file>\n", argv[0]);
+    return 1;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 ||
+      st.st_size < RVEMU_TRACE_HEADER_SIZE) {
+    fprintf(stderr, "%s: cannot read trace file\n", argv[1]);
+    return 1;
+  }
+
+  u8* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "%s: cannot map trace file\n", argv[1]);
+    return 1;
+  }
+
+  const TraceHeader* header = (const TraceHeader*)base;
+  if (header->magic != RVEMU_TRACE_MAGIC ||
+      header->record_size != sizeof(TraceRecord) || header->capacity == 0 ||
+      header->capacity > (st.st_size - RVEMU_TRACE_HEADER_SIZE) /
+                             sizeof(TraceRecord)) {
+    fprintf(stderr, "%s: not an rvemu trace file\n", argv[1]);
+    return 1;
+  }
+
+  // walk the ring from the oldest surviving record to the newest
+  const TraceRecord* records =
+      (const TraceRecord*)(base + RVEMU_TRACE_HEADER_SIZE);
+  u64 first = header->head > header->capacity
+                  ? header->head - header->capacity + 1
+                  : 1;
+  for (u64 seq = first; seq <= header->head; seq++) {
+    const TraceRecord* rec = &records[(seq - 1) % header->capacity];
+    if (rec->seq == seq) {
+      print_record(rec);
+    }
+  }
+  return 0;
+}